@@ -0,0 +1,39 @@
+#ifndef ALIENOS_IO_INTERRUPT_H
+#define ALIENOS_IO_INTERRUPT_H
+
+/* Hosted build stand in for the kernel's interrupt.h. There are no interrupts on the host, so the enable
+   flag is only a variable. It still matters, kmalloc() uses thread magazines only with it set. */
+
+#include <stdbool.h>
+
+extern bool host_interrupts_enabled;
+
+/* Returns if interrupts are enabled. */
+static inline bool interrupt_is_enabled (void)
+{
+    return host_interrupts_enabled;
+}
+
+/* Restore interrupt enable value. */
+static inline void interrupt_restore (bool enabled)
+{
+    host_interrupts_enabled = enabled;
+}
+
+/* Enables interrupts, returning the previous interrupt enable state. */
+static inline bool interrupt_enable (void)
+{
+    const bool prev_enabled = host_interrupts_enabled;
+    host_interrupts_enabled = true;
+    return prev_enabled;
+}
+
+/* Disables interrupts, returning the previous interrupt enable state. */
+static inline bool interrupt_disable (void)
+{
+    const bool prev_enabled = host_interrupts_enabled;
+    host_interrupts_enabled = false;
+    return prev_enabled;
+}
+
+#endif /* ALIENOS_IO_INTERRUPT_H */
\ No newline at end of file
@@ -0,0 +1,453 @@
+/* Kernel heap benchmark, runs as a Linux process on the hosted build (make bench).
+
+   Usage: kmalloc_bench [-v] [-n ops] [-s seed] <workload> [trace]
+
+   Workloads:
+   - small: random 1 to 256 byte requests replacing each other in a window of live blocks.
+   - mixed: mostly small requests with some pages and a few large blocks, a third are krealloc()s.
+   - burst: rounds of thread stack sized kpage_alloc()s with small allocations between them, all freed.
+   - realloc: buffers grown by doubling with krealloc(), alongside small allocations.
+   - frag: leaves large free holes between small pinned blocks, then replaces random blocks of up to 12 KiB
+     in a window of live blocks, so the heap stays fragmented. The workload of test_latency.
+   - trace: replays the kmalloc_trace records of a serial log (make KMALLOC_TRACE=1) until 'ops'
+     operations have run.
+
+   Prints one line of key=value fields, every operation is timed on it's own with the time stamp counter:
+   workload=mixed policy=tlsf hardening=standard ops=1000000 ops_per_sec=... p50_cycles=... p99_cycles=...
+   max_cycles=... alloc_max_cycles=... free_max_cycles=... peak_bytes=... large_peak_bytes=...
+
+   make bench-hardening builds it once per hardening level (KMALLOC_HARDENING), the difference in cycles
+   between the levels is the per call cost of the checks.
+
+   peak_bytes is the high water mark of the heap segments, large_peak_bytes the one of the blocks that took
+   the large block path (KMALLOC_LARGE_THRESHOLD). */
+
+#include "kmalloc_host.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "alienos/mem/kmalloc.h"
+#include "alienos/cpu/cpu.h"
+
+/* Live blocks the random workloads keep. */
+#define BENCH_SLOTS 4096
+
+/* Cycles taken by every timed operation. */
+static uint32_t *bench_cycles;
+static size_t bench_ops = 0;
+static size_t bench_max_ops;
+
+/* Worst case of kmalloc() and kfree() alone. */
+static uint32_t alloc_max_cycles = 0;
+static uint32_t free_max_cycles = 0;
+
+static void *slots[BENCH_SLOTS];
+static size_t slot_sizes[BENCH_SLOTS];
+
+static uint32_t bench_seed = 1;
+
+/* Pseudo random number, the same sequence for the same seed on every host. */
+static uint32_t bench_rand (void)
+{
+    bench_seed = bench_seed * 1103515245 + 12345;
+    return bench_seed >> 8;
+}
+
+/* Time one operation. Evaluates to the operation's result. */
+#define BENCH_TIME(expr) \
+    ({ \
+        const uint64_t bench_start = cpu_rdtsc (); \
+        __typeof__ (expr) bench_result = (expr); \
+        bench_record (cpu_rdtsc () - bench_start); \
+        bench_result; \
+    })
+
+static uint32_t bench_record (const uint64_t cycles)
+{
+    const uint32_t clamped = (cycles > UINT32_MAX) ? UINT32_MAX : (uint32_t) cycles;
+    bench_cycles[bench_ops++] = clamped;
+    return clamped;
+}
+
+static void *bench_kmalloc (const size_t size)
+{
+    const uint64_t start = cpu_rdtsc ();
+    void * const ptr = kmalloc (size);
+    const uint32_t cycles = bench_record (cpu_rdtsc () - start);
+    alloc_max_cycles = (cycles > alloc_max_cycles) ? cycles : alloc_max_cycles;
+    if (!ptr)
+    {
+        fprintf (stderr, "kmalloc(%zu) failed\n", size);
+        exit (1);
+    }
+    return ptr;
+}
+
+static void bench_kfree (void * const ptr)
+{
+    const uint64_t start = cpu_rdtsc ();
+    kfree (ptr);
+    const uint32_t cycles = bench_record (cpu_rdtsc () - start);
+    free_max_cycles = (cycles > free_max_cycles) ? cycles : free_max_cycles;
+}
+
+/* Free every live slot, untimed. */
+static void bench_clear_slots (void)
+{
+    for (size_t i = 0; i < BENCH_SLOTS; i++)
+    {
+        kfree (slots[i]);
+        slots[i] = NULL;
+    }
+}
+
+static void workload_small (void)
+{
+    while (bench_ops + 2 <= bench_max_ops)
+    {
+        const size_t slot = bench_rand () % BENCH_SLOTS;
+        if (slots[slot])
+        {
+            bench_kfree (slots[slot]);
+        }
+        slots[slot] = bench_kmalloc (1 + bench_rand () % 256);
+    }
+    bench_clear_slots ();
+}
+
+/* Request size for the mixed workload. */
+static size_t mixed_size (void)
+{
+    const uint32_t r = bench_rand () % 100;
+    if (r < 70)
+    {
+        return 1 + bench_rand () % 128;
+    }
+    else if (r < 95)
+    {
+        return 1 + bench_rand () % 4096;
+    }
+    return 1 + bench_rand () % (128 * 1024);
+}
+
+static void workload_mixed (void)
+{
+    while (bench_ops + 2 <= bench_max_ops)
+    {
+        const size_t slot = bench_rand () % BENCH_SLOTS;
+        const size_t size = mixed_size ();
+        if (slots[slot] && bench_rand () % 3 == 0)
+        {
+            slots[slot] = BENCH_TIME (krealloc (slots[slot], size));
+            continue;
+        }
+
+        if (slots[slot])
+        {
+            bench_kfree (slots[slot]);
+        }
+        slots[slot] = bench_kmalloc (size);
+    }
+    bench_clear_slots ();
+}
+
+static void workload_burst (void)
+{
+    void *stacks[64];
+    const size_t stack_cnt = sizeof (stacks) / sizeof (stacks[0]);
+    while (bench_ops + 4 * stack_cnt <= bench_max_ops)
+    {
+        for (size_t i = 0; i < stack_cnt; i++)
+        {
+            stacks[i] = BENCH_TIME (kpage_alloc (1 << 16));
+            slots[i] = bench_kmalloc (1 + bench_rand () % 512);
+        }
+        for (size_t i = 0; i < stack_cnt; i++)
+        {
+            bench_kfree (stacks[i]);
+            bench_kfree (slots[i]);
+            slots[i] = NULL;
+        }
+    }
+}
+
+static void workload_realloc (void)
+{
+    while (bench_ops + 2 <= bench_max_ops)
+    {
+        const size_t slot = bench_rand () % BENCH_SLOTS;
+        if (slot % 2 == 0)
+        {
+            /* Grow by doubling, start over once it gets large. */
+            const size_t size = (slot_sizes[slot] && slot_sizes[slot] < 64 * 1024) ? slot_sizes[slot] * 2 : 16;
+            if (size == 16 && slots[slot])
+            {
+                bench_kfree (slots[slot]);
+                slots[slot] = NULL;
+            }
+            slots[slot] = BENCH_TIME (krealloc (slots[slot], size));
+            slot_sizes[slot] = size;
+        }
+        else
+        {
+            if (slots[slot])
+            {
+                bench_kfree (slots[slot]);
+            }
+            slots[slot] = bench_kmalloc (1 + bench_rand () % 256);
+        }
+    }
+    bench_clear_slots ();
+}
+
+static void workload_frag (void)
+{
+    /* Large holes between small pins, none large enough for the biggest requests. */
+    void *holes[64];
+    void *pins[64];
+    const size_t pin_cnt = sizeof (pins) / sizeof (pins[0]);
+    for (size_t i = 0; i < pin_cnt; i++)
+    {
+        holes[i] = kmalloc (4096 + (i % 8) * 512);
+        pins[i] = kmalloc (16);
+    }
+    for (size_t i = 0; i < pin_cnt; i++)
+    {
+        kfree (holes[i]);
+    }
+
+    /* Only 128 of the slots are used, a small window keeps the holes from being filled for good. */
+    while (bench_ops + 2 <= bench_max_ops)
+    {
+        const uint32_t r = bench_rand ();
+        const size_t slot = r % 128;
+        const size_t size = (r & 0x8000) ? 1 + (r >> 4) % 256 : 1 + (r >> 4) % 12288;
+        if (slots[slot])
+        {
+            bench_kfree (slots[slot]);
+        }
+        slots[slot] = bench_kmalloc (size);
+    }
+
+    bench_clear_slots ();
+    for (size_t i = 0; i < pin_cnt; i++)
+    {
+        kfree (pins[i]);
+    }
+}
+
+/* One kmalloc_trace record. */
+struct TraceRecord
+{
+    bool alloc;
+    uint32_t ptr;
+    uint32_t size;
+};
+
+/* Get the value of 'key=' in a trace line. Returns false if it is missing. */
+static bool trace_field (const char * const line, const char * const key, const int base, uint32_t * const value)
+{
+    const char *field = strstr (line, key);
+    if (!field)
+    {
+        return false;
+    }
+
+    *value = strtoul (field + strlen (key), NULL, base);
+    return true;
+}
+
+static struct TraceRecord *trace_load (const char * const path, size_t * const cnt)
+{
+    FILE * const file = fopen (path, "r");
+    if (!file)
+    {
+        fprintf (stderr, "failed to open %s\n", path);
+        exit (1);
+    }
+
+    size_t capacity = 1024;
+    struct TraceRecord *records = malloc (capacity * sizeof (struct TraceRecord));
+    *cnt = 0;
+
+    char line[256];
+    while (fgets (line, sizeof (line), file))
+    {
+        const char * const start = strstr (line, "kmalloc_trace op=");
+        struct TraceRecord record;
+        if (!start || !trace_field (start, " ptr=", 16, &record.ptr)
+            || !trace_field (start, " size=", 10, &record.size))
+        {
+            continue;
+        }
+        record.alloc = strncmp (start + strlen ("kmalloc_trace op="), "alloc", 5) == 0;
+
+        if (*cnt == capacity)
+        {
+            capacity *= 2;
+            records = realloc (records, capacity * sizeof (struct TraceRecord));
+        }
+        records[(*cnt)++] = record;
+    }
+
+    fclose (file);
+    return records;
+}
+
+static void workload_trace (const char * const path)
+{
+    size_t cnt;
+    struct TraceRecord * const records = trace_load (path, &cnt);
+    if (cnt == 0)
+    {
+        fprintf (stderr, "no kmalloc_trace records in %s\n", path);
+        exit (1);
+    }
+
+    /* Open addressing table from traced pointers to the replay's blocks. */
+    size_t table_size = 1;
+    while (table_size < 2 * cnt)
+    {
+        table_size *= 2;
+    }
+    uint32_t * const keys = calloc (table_size, sizeof (uint32_t));
+    void ** const values = calloc (table_size, sizeof (void *));
+
+    while (bench_ops < bench_max_ops)
+    {
+        for (size_t i = 0; i < cnt && bench_ops < bench_max_ops; i++)
+        {
+            size_t h = (records[i].ptr * 2654435761u) & (table_size - 1);
+            while (keys[h] && keys[h] != records[i].ptr)
+            {
+                h = (h + 1) & (table_size - 1);
+            }
+
+            /* An allocation of a live pointer means it changed hands without a traced free. */
+            if (keys[h] && values[h])
+            {
+                bench_kfree (values[h]);
+                values[h] = NULL;
+            }
+
+            if (records[i].alloc)
+            {
+                keys[h] = records[i].ptr;
+                values[h] = bench_kmalloc (records[i].size);
+            }
+        }
+
+        /* Start the next pass with an empty heap. */
+        for (size_t h = 0; h < table_size; h++)
+        {
+            kfree (values[h]);
+            values[h] = NULL;
+            keys[h] = 0;
+        }
+    }
+
+    free (keys);
+    free (values);
+    free (records);
+}
+
+static int compare_cycles (const void * const a, const void * const b)
+{
+    const uint32_t x = *(const uint32_t *) a;
+    const uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void usage (void)
+{
+    fprintf (stderr, "usage: kmalloc_bench [-v] [-n ops] [-s seed] small|mixed|burst|realloc|frag|trace [log]\n");
+    exit (2);
+}
+
+int main (int argc, char **argv)
+{
+    bench_max_ops = 1000000;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++)
+    {
+        if (strcmp (argv[arg], "-v") == 0)
+        {
+            kmalloc_host_verbose = true;
+        }
+        else if (strcmp (argv[arg], "-n") == 0 && arg + 1 < argc)
+        {
+            bench_max_ops = strtoul (argv[++arg], NULL, 10);
+        }
+        else if (strcmp (argv[arg], "-s") == 0 && arg + 1 < argc)
+        {
+            bench_seed = strtoul (argv[++arg], NULL, 10);
+        }
+        else
+        {
+            usage ();
+        }
+    }
+    if (arg >= argc)
+    {
+        usage ();
+    }
+
+    const char * const workload = argv[arg];
+    bench_cycles = malloc (bench_max_ops * sizeof (uint32_t));
+    kmalloc_host_init ();
+
+    struct timespec start, end;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    if (strcmp (workload, "small") == 0)
+    {
+        workload_small ();
+    }
+    else if (strcmp (workload, "mixed") == 0)
+    {
+        workload_mixed ();
+    }
+    else if (strcmp (workload, "burst") == 0)
+    {
+        workload_burst ();
+    }
+    else if (strcmp (workload, "realloc") == 0)
+    {
+        workload_realloc ();
+    }
+    else if (strcmp (workload, "frag") == 0)
+    {
+        workload_frag ();
+    }
+    else if (strcmp (workload, "trace") == 0 && arg + 1 < argc)
+    {
+        workload_trace (argv[arg + 1]);
+    }
+    else
+    {
+        usage ();
+    }
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    qsort (bench_cycles, bench_ops, sizeof (uint32_t), compare_cycles);
+    const struct KMStats stats = kmalloc_getstats ();
+
+    printf ("workload=%s policy=%s hardening=%s ops=%zu ops_per_sec=%.0f p50_cycles=%u p99_cycles=%u "
+            "max_cycles=%u alloc_max_cycles=%u free_max_cycles=%u peak_bytes=%zu large_peak_bytes=%zu\n", workload,
+            KMALLOC_POLICY_NAME, KMALLOC_HARDENING_NAME, bench_ops, bench_ops / seconds,
+            bench_ops ? bench_cycles[bench_ops / 2] : 0, bench_ops ? bench_cycles[bench_ops * 99 / 100] : 0,
+            bench_ops ? bench_cycles[bench_ops - 1] : 0, alloc_max_cycles, free_max_cycles, stats.heap_peak_bytes,
+            stats.large_peak_bytes);
+
+    if (kmalloc_host_verbose)
+    {
+        kmalloc_dump (false);
+    }
+
+    free (bench_cycles);
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,187 @@
+#include "kmalloc_host.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alienos/mem/kmalloc.h"
+#include "alienos/mem/page.h"
+#include "alienos/kernel/kernel.h"
+#include "alienos/kernel/synch.h"
+#include "alienos/kernel/thread.h"
+#include "alienos/io/interrupt.h"
+#include "alienos/io/io.h"
+
+#undef printf
+
+/* The page allocator keeps it's state array right after the kernel image, so the arena starts where the
+   kernel would end. */
+uint8_t host_arena[KMALLOC_HOST_ARENA_SIZE] __attribute__((aligned (PAGE_SIZE)));
+extern uint8_t kernel_start __attribute__((alias ("host_arena")));
+extern uint8_t kernel_end __attribute__((alias ("host_arena")));
+
+bool host_interrupts_enabled = false;
+bool kmalloc_host_verbose = false;
+
+/* The only thread, so kmalloc() has magazines to use. */
+static thread_t host_thread;
+thread_t *current_thread = &host_thread;
+
+void kmalloc_host_init (void)
+{
+    static multiboot_memory_map_t mmap[1];
+    mmap[0].size = sizeof (mmap[0]) - sizeof (mmap[0].size);
+    mmap[0].addr = (uintptr_t) host_arena;
+    mmap[0].len = sizeof (host_arena);
+    mmap[0].type = MULTIBOOT_MEMORY_AVAILABLE;
+
+    static multiboot_info_t mbinfo;
+    mbinfo.flags = MULTIBOOT_INFO_MEM_MAP;
+    mbinfo.mmap_addr = (uintptr_t) mmap;
+    mbinfo.mmap_length = sizeof (mmap);
+
+    /* Touch every page of the arena up front, so first touch page faults do not show up as worst cases. */
+    memset (host_arena, 0, sizeof (host_arena));
+
+    kmalloc_init (&mbinfo);
+    interrupt_enable ();
+}
+
+static void host_vpanic (const char * const format, va_list params)
+{
+    fprintf (stderr, "KERNAL PANIC!!!\n");
+    vfprintf (stderr, format, params);
+    fprintf (stderr, "\n");
+    abort ();
+}
+
+void kernel_panic (const char * const format, ...)
+{
+    va_list params;
+    va_start (params, format);
+    host_vpanic (format, params);
+    va_end (params);
+}
+
+void kernel_assert (const bool cond, const char * const format, ...)
+{
+    if (!cond)
+    {
+        va_list params;
+        va_start (params, format);
+        host_vpanic (format, params);
+        va_end (params);
+    }
+}
+
+void io_serial_printf (const enum COMPort port, const char * const format, ...)
+{
+    (void) port;
+    if (kmalloc_host_verbose)
+    {
+        va_list params;
+        va_start (params, format);
+        vprintf (format, params);
+        va_end (params);
+    }
+}
+
+void io_serial_unsafe_printf (const enum COMPort port, const char * const format, ...)
+{
+    (void) port;
+    if (kmalloc_host_verbose)
+    {
+        va_list params;
+        va_start (params, format);
+        vprintf (format, params);
+        va_end (params);
+    }
+}
+
+/* Single threaded, so nothing ever waits. */
+void semaphore_init (semaphore_t * const sem, const int32_t initial_count)
+{
+    sem->count = initial_count;
+    sem->wait_queue_head = NULL;
+    sem->wait_queue_tail = NULL;
+}
+
+void semaphore_down (semaphore_t * const sem)
+{
+    kernel_assert (sem->count > 0, "semaphore_down(): would block forever in the hosted build");
+    sem->count--;
+}
+
+bool semaphore_try_down (semaphore_t * const sem)
+{
+    if (sem->count <= 0)
+    {
+        return false;
+    }
+
+    sem->count--;
+    return true;
+}
+
+void semaphore_up (semaphore_t * const sem)
+{
+    sem->count++;
+}
+
+void mutex_init (mutex_t * const mutex)
+{
+    semaphore_init (&mutex->sem, 1);
+    mutex->holder = NULL;
+    mutex->recursion_count = 0;
+}
+
+bool mutex_try_acquire (mutex_t * const mutex)
+{
+    if (mutex->holder == current_thread)
+    {
+        mutex->recursion_count++;
+        return true;
+    }
+
+    if (semaphore_try_down (&mutex->sem))
+    {
+        mutex->holder = current_thread;
+        mutex->recursion_count = 1;
+        return true;
+    }
+
+    return false;
+}
+
+void mutex_acquire (mutex_t * const mutex)
+{
+    kernel_assert (mutex_try_acquire (mutex), "mutex_acquire(): would block forever in the hosted build");
+}
+
+void mutex_release (mutex_t * const mutex)
+{
+    kernel_assert (mutex->holder == current_thread, "mutex_release(): Owner thread must release the lock");
+    if (--mutex->recursion_count == 0)
+    {
+        mutex->holder = NULL;
+        semaphore_up (&mutex->sem);
+    }
+}
+
+thread_t *thread_create (void (* const entry_point) (void))
+{
+    (void) entry_point;
+    kernel_panic ("thread_create(): no threads in the hosted build");
+    return NULL;
+}
+
+thread_t *thread_create_ex (void (* const entry_point) (void *), void * const arg, const uint32_t priority)
+{
+    (void) entry_point;
+    (void) arg;
+    (void) priority;
+    kernel_panic ("thread_create_ex(): no threads in the hosted build");
+    return NULL;
+}
\ No newline at end of file
@@ -0,0 +1,22 @@
+#ifndef ALIENOS_HOST_KMALLOC_HOST_H
+#define ALIENOS_HOST_KMALLOC_HOST_H
+
+/* Runs the kernel heap as a Linux process (make bench). kmalloc_host.c stands in for the parts of the
+   kernel the heap needs: a multiboot memory map over a static arena, single threaded locks, a current
+   thread for the magazines, and kernel_assert() that aborts. Must be built for 32 bit x86 (-m32), the heap
+   stores pointers in 32 bit fields. */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Size of the static arena the page allocator manages. */
+#define KMALLOC_HOST_ARENA_SIZE (256u << 20)
+
+/* If false (the default), output the kernel sources send to the serial port is dropped. */
+extern bool kmalloc_host_verbose;
+
+/* Initializes the kernel heap over the arena, then enables "interrupts" like the kernel does once it is
+   running. */
+void kmalloc_host_init (void);
+
+#endif /* ALIENOS_HOST_KMALLOC_HOST_H */
\ No newline at end of file
@@ -1,10 +1,23 @@
 #ifndef ALIENOS_CPU_CPU_H
 #define ALIENOS_CPU_CPU_H
 
+#include <stdint.h>
+
 /* Stop execution keep CPU alive. */
 void cpu_idle_loop (void);
 
 /* Halt CPU. */
 extern void cpu_halt (void);
 
+/* Read the time stamp counter. Counts CPU cycles, not serializing. */
+static inline uint64_t cpu_rdtsc (void)
+{
+    uint32_t lo, hi;
+    asm volatile (
+        "rdtsc"
+        : "=a"(lo), "=d"(hi)
+    );
+    return ((uint64_t) hi << 32) | lo;
+}
+
 #endif /* ALIENOS_CPU_CPU_H */
\ No newline at end of file
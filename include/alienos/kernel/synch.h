@@ -11,11 +11,16 @@ typedef struct Semaphore
                                                stores how many threads are waiting. */
     tlistnode_t *wait_queue_head;              /* Singly linked list of threads that are blocked on this.
                                                Stored in FIFO order where the longest waiting threads are
-                                               near the head. */
+                                               near the head. The highest priority thread is woken first. */
     tlistnode_t *wait_queue_tail;              /* Tail of the singly linked list */
 } semaphore_t;
 
-/* Lock
+/* Most mutex holders a priority donation is passed through. A longer chain is most likely a deadlock. */
+#define MUTEX_DONATION_DEPTH 8
+
+/* Lock. A thread that blocks on a held lock donates it's priority to the holder until the lock is released,
+   and on to the holder of the lock the holder is blocked on, so a low priority holder can not stall higher
+   priority waiters behind medium priority threads.
 
    Usage:
    mutex_acquire (&lock);
@@ -27,6 +32,7 @@ typedef struct Mutex
     semaphore_t sem;
     thread_t *holder;                       /* Owner of the lock, only this thread can release */
     uint32_t recursion_count;               /* Support acquiring the same lock multiple times */
+    struct Mutex *held_next;                /* Next mutex in the holder's held_mutexes list. */
 } mutex_t;
 
 /* Condition Variable, used with a mutex to protect access to a shared resource.
@@ -43,7 +49,7 @@ typedef struct ConditionVariable
 {
     tlistnode_t *wait_queue_head;              /* Singly linked list of threads waiting to be signaled.
                                                Stored in FIFO order where longest waiting threads are near
-                                               the head. */
+                                               the head. The highest priority thread is woken first. */
     tlistnode_t *wait_queue_tail;              /* Tail of the singly linked list */
 } condvar_t;
 
@@ -71,6 +77,14 @@ bool mutex_try_acquire (mutex_t *mutex);
 /* Release the lock. */
 void mutex_release (mutex_t *mutex);
 
+/* Highest priority of the threads waiting on mutexes held by 'thread', THREAD_PRIORITY_MIN if there are
+   none. Must be synchronized externally (interrupts disabled). */
+uint32_t mutex_donated_priority (const thread_t *thread);
+
+/* If 'thread' is blocked on a mutex, donate it's priority down the chain of holders. Must be synchronized
+   externally (interrupts disabled). */
+void mutex_donate (const thread_t *thread);
+
 /* Initialize condition variable. */
 void condvar_init (condvar_t *condvar);
 
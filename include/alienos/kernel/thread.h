@@ -1,12 +1,79 @@
 #ifndef ALIENOS_KERNEL_THREAD_H
 #define ALIENOS_KERNEL_THREAD_H
 
+#include "alienos/mem/kmalloc.h"
+
 #include <stdint.h>
 
 #define THREAD_STACK_SPACE (1 << 16)
 
+/* Word written at the bottom of every thread stack, a thread that grew it's stack past the bottom
+   overwrites it. Checked whenever the thread is switched away from and when it's stack is released. */
+#define THREAD_STACK_CANARY 0x57AC4CA7
+
+/* Most stacks of exited threads kept for reuse. Pooled stacks are handed to new threads as they are, without
+   going back to the kernel heap or being cleared. thread_set_stack_pool_size() can lower the limit. */
+#define THREAD_STACK_POOL_SIZE 8
+
+/* Thread priorities. Higher values run first, threads of the same priority take turns. */
+#define THREAD_PRIORITY_COUNT 32
+#define THREAD_PRIORITY_MIN 0
+#define THREAD_PRIORITY_MAX (THREAD_PRIORITY_COUNT - 1)
+#define THREAD_PRIORITY_DEFAULT 16
+
+/* Scheduling policy, selected at build time (make THREAD_SCHED=...).
+   - THREAD_SCHED_PRIORITY: a thread keeps the priority it is given, threads of the same priority switch every
+     timer tick.
+   - THREAD_SCHED_MLFQ: multi level feedback queue. A thread that runs through a whole time slice drops one
+     priority, down to THREAD_MLFQ_LEVELS - 1 below the priority it was given, and gets twice as long a slice
+     at each level below. Blocking, sleeping or yielding does not, so threads that mostly wait stay above
+     the ones that compute. Every THREAD_MLFQ_BOOST_TICKS every thread is put back at the priority it was
+     given, so dropped threads can not starve.
+   - THREAD_SCHED_FAIR: fair share. Every thread gets CPU time in proportion to the weight of it's priority,
+     each priority step is worth about 1.25 times the one below, so a low priority thread gets less time
+     without ever starving. The ready thread that has run least for it's weight (virtual runtime) runs next.
+     A thread that wakes up is placed slightly behind the others, so threads that mostly wait run soon. */
+#if defined(THREAD_SCHED_MLFQ)
+#define THREAD_SCHED_NAME "mlfq"
+#elif defined(THREAD_SCHED_FAIR)
+#define THREAD_SCHED_NAME "fair"
+#else
+#ifndef THREAD_SCHED_PRIORITY
+#define THREAD_SCHED_PRIORITY
+#endif
+#define THREAD_SCHED_NAME "priority"
+#endif
+
+/* Levels a thread can drop below it's given priority. Only used by the MLFQ policy (THREAD_SCHED). */
+#define THREAD_MLFQ_LEVELS 4
+
+/* Timer ticks in a time slice at the top level, each level below doubles it. */
+#define THREAD_MLFQ_QUANTUM 1
+
+/* Timer ticks between putting every thread back at it's given priority. */
+#define THREAD_MLFQ_BOOST_TICKS 200
+
+/* Virtual runtime a thread of THREAD_PRIORITY_DEFAULT is charged for a timer tick. Threads of other priorities
+   are charged in inverse proportion to their weight. Only used by the fair policy (THREAD_SCHED). */
+#define THREAD_FAIR_TICK_VRUNTIME (1 << 20)
+
+/* Virtual runtime the running thread may get ahead of the ready thread that has run least before a timer tick
+   switches to it, and how far behind the others a thread that wakes up is placed. */
+#define THREAD_FAIR_GRANULARITY (THREAD_FAIR_TICK_VRUNTIME / 2)
+
 typedef uint32_t tid_t;
+
+struct ThreadStackStats
+{
+    uint32_t pool_hit_cnt;          /* How many stacks were taken from the pool. */
+    uint32_t pool_miss_cnt;         /* How many stacks were allocated because the pool was empty. */
+    uint32_t pool_free_cnt;         /* How many stacks were freed because the pool was full. */
+    uint32_t pooled_cnt;            /* How many stacks are currently in the pool. */
+    uint32_t pool_size;             /* Most stacks the pool currently keeps. */
+};
+
 struct Thread;
+struct Mutex;
 
 typedef struct ThreadListNode {
     struct Thread *thread;
@@ -14,6 +81,13 @@ typedef struct ThreadListNode {
     struct ThreadListNode *prev;
 } tlistnode_t;
 
+/* Red-black tree links of a ready thread, see THREAD_SCHED_FAIR. */
+typedef struct ThreadTreeNode {
+    struct Thread *left;            /* Threads that have run less. */
+    struct Thread *right;           /* Threads that have run more. */
+    uintptr_t parent;               /* Parent thread, the lowest bit is set if the node is red. */
+} ttreenode_t;
+
 typedef struct Thread
 {
     tid_t tid;                      /* Unique thread identifier */
@@ -31,6 +105,15 @@ typedef struct Thread
 
     uint32_t exit_code;             /* Exit code when thread terminates */
     uint32_t wakeup_ticks;          /* When should the thread be woken up */
+    uint32_t priority;              /* Priority the thread is scheduled at, the higher of base_priority and the
+                                       priorities donated by threads waiting on mutexes it holds. */
+    uint32_t base_priority;         /* Priority of the thread without donations. The MLFQ policy lowers it
+                                       below top_priority as the thread uses up it's time slices. */
+    uint32_t top_priority;          /* THREAD_PRIORITY_MIN to THREAD_PRIORITY_MAX, see thread_set_priority(). */
+    uint32_t slice_ticks;           /* Timer ticks of it's current time slice the thread has run for. */
+    uint32_t boost_epoch;           /* Last priority boost the thread was put back at top_priority for. */
+    uint64_t vruntime;              /* Time the thread has run for, weighted by it's priority. */
+    struct Mutex *held_mutexes;     /* Singly linked list of mutexes this thread holds, see mutex_acquire(). */
     void *stack_base;               /* Since we are using physical memory, we allocate the thread
                                        stack on the heap */
 
@@ -43,18 +126,26 @@ typedef struct Thread
     } blocker_type;                 /* Type of synchronization primitive this thread is blocked on */
     void *blocked_on;               /* Pointer to synchronization primitive this thread is blocked on */
 
+    struct KMMagazines kmalloc_magazines;   /* Recently freed small blocks, see kmalloc(). */
+
     /* Various lists this thread can be a part of. all_list contains all allocated threads,
        local_list is used for various uses like ready, blocked, sleeping, zombie queues. */
     tlistnode_t all_list;
     tlistnode_t local_list;
+    ttreenode_t ready_node;         /* Ready threads of the fair policy sit in a tree instead of a list. */
 } thread_t;
 
 extern thread_t *current_thread;
 
-/* Creates a thread and setup the thread stack. Passes arg to the entry point. Synchronized internally. */
+/* Creates a thread of the given priority and setup the thread stack. Passes arg to the entry point.
+   Synchronized internally. */
+thread_t *thread_create_ex (void (*entry_point) (void *), void *arg, uint32_t priority);
+
+/* Creates a thread of THREAD_PRIORITY_DEFAULT and setup the thread stack. Passes arg to the entry point.
+   Synchronized internally. */
 thread_t *thread_create_arg (void (*entry_point) (void *), void *arg);
 
-/* Creates a thread and setup the thread stack. Synchronized internally. */
+/* Creates a thread of THREAD_PRIORITY_DEFAULT and setup the thread stack. Synchronized internally. */
 thread_t *thread_create (void (*entry_point) (void));
 
 /* Initialize scheduler, creates dummy TCB for current execution flow. Creates an idle thread to default
@@ -75,7 +166,7 @@ void thread_sleep (uint32_t ticks);
    and idle thread. TODO: make O(1) */
 uint32_t thread_count (void);
 
-/* Count how many ready threads there are. Synchronized internally. TODO: make O(1). */
+/* Count how many ready threads there are. Synchronized internally. */
 uint32_t thread_count_ready (void);
 
 /* Count how many sleeping threads there are. Synchronized internally. TODO: make O(1). */
@@ -87,6 +178,25 @@ uint32_t thread_count_zombie (void);
 /* Get thread by tid. */
 thread_t *thread_get_by_tid (tid_t tid);
 
+/* Change the base priority of a thread. The priority policies always run a ready thread of the highest
+   priority, so the current thread yields if it is no longer the highest. Synchronized internally. */
+void thread_set_priority (thread_t *thread, uint32_t priority);
+
+/* Set the priority a thread is scheduled at, without changing it's base priority. Used for priority donation.
+   Must be synchronized externally (interrupts disabled). */
+void thread_update_priority (thread_t *thread, uint32_t priority);
+
+/* Yield if the scheduling policy would run a ready thread instead of the current thread, as it does for one
+   of a higher priority under the priority policies. Synchronized internally. */
+void thread_preempt (void);
+
+/* Set how many stacks of exited threads are kept for reuse, at most THREAD_STACK_POOL_SIZE. Stacks above the
+   new limit are freed. Returns the previous limit. Synchronized internally. */
+uint32_t thread_set_stack_pool_size (uint32_t size);
+
+/* Get thread stack stats. */
+struct ThreadStackStats thread_stack_getstats (void);
+
 /* Debug thread blocker dependencies. */
 void thread_debug_synch_dependencies ();
 
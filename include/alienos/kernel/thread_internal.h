@@ -0,0 +1,34 @@
+#ifndef ALIENOS_KERNEL_THREAD_INTERNAL_H
+#define ALIENOS_KERNEL_THREAD_INTERNAL_H
+
+/* Scheduler internals shared between thread.c and the scheduling policies (THREAD_SCHED). thread.c keeps
+   track of the running, sleeping and zombie threads, the policy decides which of the ready threads runs and
+   for how long. Not for use outside the thread scheduler.
+
+   Every hook is called with interrupts disabled. The running thread and the idle thread are never ready, a
+   running thread is handed back with sched_enqueue() when it is switched away from. */
+
+#include "alienos/kernel/thread.h"
+
+#include <stdbool.h>
+
+/* Add a thread that became ready (created, woken up or switched away from). Must be synchronized
+   externally. */
+void sched_enqueue (thread_t *thread);
+
+/* Remove a ready thread, so it's priority can change. Must be synchronized externally. */
+void sched_dequeue (thread_t *thread);
+
+/* Take the thread to run next off the ready threads. Returns NULL if no thread is ready. Must be synchronized
+   externally. */
+thread_t *sched_pick_next (void);
+
+/* Called every timer tick, 'current' is the running thread or NULL if it is idle. Returns true if the thread
+   has time left in it's time slice. Must be synchronized externally. */
+bool sched_tick (thread_t *current);
+
+/* Check if a ready thread should run instead of the running thread 'current'. 'slice_left' is false if the
+   thread used up or gave up the rest of it's time slice. Must be synchronized externally. */
+bool sched_preempts (const thread_t *current, bool slice_left);
+
+#endif /* ALIENOS_KERNEL_THREAD_INTERNAL_H */
\ No newline at end of file
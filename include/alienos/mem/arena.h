@@ -0,0 +1,85 @@
+#ifndef ALIENOS_MEM_ARENA_H
+#define ALIENOS_MEM_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Default size of the chunks an arena takes from the kernel heap, including the chunk header. */
+#define KARENA_CHUNK_SIZE 4096
+
+/* Alignment of karena_alloc(), the same as kmalloc(). */
+#define KARENA_ALIGN 16
+
+struct KArenaChunk;
+
+struct KArenaStats
+{
+    uint32_t allocation_cnt;            /* How many times karena_alloc() or karena_alloc_aligned() is called. */
+    size_t allocation_bytes;            /* Bytes requested from the arena. */
+    uint32_t chunk_cnt;                 /* How many chunks the arena currently owns. */
+    uint32_t chunk_alloc_cnt;           /* How many chunks were taken from the kernel heap. */
+    uint32_t chunk_free_cnt;            /* How many chunks were returned to the kernel heap. */
+    uint32_t reset_cnt;                 /* How many times karena_reset() is called. */
+};
+
+/* Arena. Hands out memory by bumping a pointer through chunks taken from the kernel heap, nothing is
+   freed on it's own. Everything allocated is released together by karena_reset() or karena_destroy(), or
+   back to a savepoint by karena_restore(), in time proportional to the number of chunks. Meant for
+   allocations that share a lifetime, like the temporary state of a single request.
+
+   Usage:
+   karena_t arena;
+   karena_init (&arena, "name", 0);
+   struct Object *obj = karena_alloc (&arena, sizeof (struct Object));
+   <...>
+   karena_destroy (&arena);
+*/
+typedef struct KArena
+{
+    const char *name;                   /* Name for debugging. */
+    size_t chunk_size;                  /* Size of the chunks taken from the kernel heap. */
+    struct KArenaChunk *chunks;         /* Chunks from newest to oldest, allocations are bumped out of the
+                                           newest. */
+    uint8_t *cur;                       /* Next free byte of the newest chunk. */
+    uint8_t *end;                       /* End of the newest chunk. */
+    struct KArenaStats stats;
+} karena_t;
+
+/* Position in an arena. Savepoints nest, restoring one also drops every savepoint taken after it. */
+typedef struct KArenaSavepoint
+{
+    struct KArenaChunk *chunk;          /* Newest chunk when the savepoint was taken. */
+    uint8_t *cur;                       /* Next free byte of that chunk. */
+} karena_savepoint_t;
+
+/* Initialize an arena taking 'chunk_size' byte chunks from the kernel heap (0 for KARENA_CHUNK_SIZE).
+   Does not allocate any memory. */
+void karena_init (karena_t *arena, const char *name, size_t chunk_size);
+
+/* Free every chunk of the arena, which can be initialized again afterwards. Must be synchronized
+   externally. */
+void karena_destroy (karena_t *arena);
+
+/* Allocate 'size' bytes aligned to KARENA_ALIGN. Requests larger than a chunk get a chunk of their own.
+   Returns NULL if the kernel heap is out of memory. Must be synchronized externally. */
+void *karena_alloc (karena_t *arena, size_t size);
+
+/* Same as karena_alloc() but aligned to 'align' bytes, which must be a power of 2. Must be synchronized
+   externally. */
+void *karena_alloc_aligned (karena_t *arena, size_t size, size_t align);
+
+/* Release everything allocated from the arena. The oldest chunk is kept for the next allocations, every
+   other chunk is returned to the kernel heap. Must be synchronized externally. */
+void karena_reset (karena_t *arena);
+
+/* Get the current position of the arena. */
+karena_savepoint_t karena_save (const karena_t *arena);
+
+/* Release everything allocated since 'savepoint' was taken, returning the chunks taken since then to the
+   kernel heap. Must be synchronized externally. */
+void karena_restore (karena_t *arena, karena_savepoint_t savepoint);
+
+/* Get stats. */
+struct KArenaStats karena_getstats (const karena_t *arena);
+
+#endif /* ALIENOS_MEM_ARENA_H */
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "alienos/kernel/multiboot.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -14,7 +15,8 @@
     | ^
     | |
     | |
-    | HEAP (Grows up)
+    | PAGES (page allocator, heap segments)
+    | PAGE STATE
     | STACK (grows down) 16 Kib
     | |
     | V
@@ -24,24 +26,177 @@
     | LOW ADDRESS
     ======================
 */
+/* Free block policy, selected at build time (make KMALLOC_POLICY=...). Decides how free blocks are
+   indexed and which free block serves a request.
+   - KMALLOC_POLICY_FIRSTFIT: size class bins for small blocks, first fit list for the rest.
+   - KMALLOC_POLICY_TLSF: two level segregated fit, bounded O(1) find.
+   - KMALLOC_POLICY_BESTFIT: red-black tree by size, O(log n) find of the smallest block that fits. */
+#if defined(KMALLOC_POLICY_TLSF)
+#define KMALLOC_POLICY_NAME "tlsf"
+#elif defined(KMALLOC_POLICY_BESTFIT)
+#define KMALLOC_POLICY_NAME "bestfit"
+#else
+#ifndef KMALLOC_POLICY_FIRSTFIT
+#define KMALLOC_POLICY_FIRSTFIT
+#endif
+#define KMALLOC_POLICY_NAME "firstfit"
+#endif
+
+/* Hardening level, selected at build time (make KMALLOC_HARDENING=...). Decides how much checking the heap
+   does to catch misuse, at a cost on every call (make bench-hardening measures it).
+   - KMALLOC_HARDENING_RELEASE: no checks.
+   - KMALLOC_HARDENING_STANDARD: block header magic and allocated bit checks on free and realloc, and free list
+     link checks.
+   - KMALLOC_HARDENING_PARANOID: standard checks, and freed memory is filled with KMALLOC_POISON_BYTE, every
+     heap block gets a redzone of KMALLOC_REDZONE_BYTE after the requested bytes that is checked on free, and
+     the whole heap is validated every time the free lists change. */
+#define KMALLOC_HARDENING_LEVEL_RELEASE 0
+#define KMALLOC_HARDENING_LEVEL_STANDARD 1
+#define KMALLOC_HARDENING_LEVEL_PARANOID 2
+#if defined(KMALLOC_HARDENING_RELEASE)
+#define KMALLOC_HARDENING_LEVEL KMALLOC_HARDENING_LEVEL_RELEASE
+#define KMALLOC_HARDENING_NAME "release"
+#elif defined(KMALLOC_HARDENING_PARANOID)
+#define KMALLOC_HARDENING_LEVEL KMALLOC_HARDENING_LEVEL_PARANOID
+#define KMALLOC_HARDENING_NAME "paranoid"
+#else
+#ifndef KMALLOC_HARDENING_STANDARD
+#define KMALLOC_HARDENING_STANDARD
+#endif
+#define KMALLOC_HARDENING_LEVEL KMALLOC_HARDENING_LEVEL_STANDARD
+#define KMALLOC_HARDENING_NAME "standard"
+#endif
+
+/* Fill patterns of paranoid builds, chosen to be easy to spot in a memory dump. */
+#define KMALLOC_POISON_BYTE 0x6B
+#define KMALLOC_REDZONE_BYTE 0xBB
+
+/* Bytes reserved after the requested bytes of every heap block for the redzone, so every request takes this
+   much more memory in paranoid builds. */
+#if KMALLOC_HARDENING_LEVEL >= KMALLOC_HARDENING_LEVEL_PARANOID
+#define KMALLOC_REDZONE_SIZE 16
+#else
+#define KMALLOC_REDZONE_SIZE 0
+#endif
+
+/* Number of size class bins for small allocations. Requests of up to (16 << i) bytes belong to class i,
+   so bins serve requests of 16 to 2048 bytes. Only used by the first fit policy (KMALLOC_POLICY). */
+#define KMALLOC_BIN_COUNT 8
+
+/* Requests of more than this many bytes, and every request aligned to a page or more, skip the heap and
+   get a block of whole pages straight from the page allocator, so large blocks never leave holes between
+   small ones. Large blocks are told apart on kfree() by being the start of an allocated page block. */
+#define KMALLOC_LARGE_THRESHOLD (2 * 4096)
+
+/* kfree() gives the free block at the top of a heap segment back to the page allocator once it reaches
+   this many bytes. */
+#define KMALLOC_TRIM_THRESHOLD (64 * 1024)
+
+/* Per thread magazines of recently freed small blocks. Magazine i holds blocks of (32 + 16 * i) bytes
+   (including the header), so they serve requests of up to (16 + 16 * i) bytes. */
+#define KMALLOC_MAGAZINE_CLASSES 8
+
+/* How many blocks a magazine holds. Half of them move to or from the heap at a time. */
+#define KMALLOC_MAGAZINE_SIZE 8
+
+/* Magazines of a thread, hung off thread_t. Only it's thread touches them, so kmalloc() and kfree() take
+   no lock unless a magazine needs to be refilled or drained. */
+struct KMMagazines
+{
+    uint32_t cnt[KMALLOC_MAGAZINE_CLASSES];
+    void *blocks[KMALLOC_MAGAZINE_CLASSES][KMALLOC_MAGAZINE_SIZE];
+};
+
+/* Pool classes of kmalloc_atomic(). Class i holds blocks of (64 << (2 * i)) bytes, so the largest atomic
+   allocation is 4 KiB. */
+#define KMALLOC_ATOMIC_CLASSES 4
+
+/* How many blocks each atomic pool class reserves. The refill thread is woken once a class drops below
+   half of this. */
+#define KMALLOC_ATOMIC_POOL_SIZE 8
+
+/* Pool classes of pre-zeroed blocks for kcalloc(). Class i holds blocks of (1024 << (2 * i)) bytes, so
+   requests of 256 bytes to 4 KiB can skip zeroing. Larger requests take the large block path. */
+#define KMALLOC_ZEROED_CLASSES 2
+
+/* How many zeroed blocks each class keeps. */
+#define KMALLOC_ZEROED_POOL_SIZE 4
+
+/* Buckets of the latency histograms in KMStats. Bucket i counts operations that took less than (32 << i)
+   cycles, the last bucket counts every slower one too. */
+#define KMALLOC_CYCLE_BUCKETS 16
+
 struct KMStats
 {
     uint32_t allocation_cnt;            /* How many times the kmalloc(), kcalloc(), or krealloc() is called. */
     size_t allocation_bytes;            /* How many bytes was requested in total. */
     uint32_t free_cnt;                  /* How many times kfree() is called. */
     size_t free_bytes;                  /* How many bytes was freed in total. */
+    uint32_t bin_hits[KMALLOC_BIN_COUNT];   /* How many small allocations were served by their own size
+                                               class bin. First fit policy only. */
+    uint32_t bin_misses[KMALLOC_BIN_COUNT]; /* How many small allocations found their size class bin
+                                               empty and had to use a larger bin or the free list. */
+    uint32_t magazine_hits;             /* How many allocations were served by a thread's magazine. */
+    uint32_t magazine_refills;          /* How many times a magazine was refilled from the heap. */
+    uint32_t magazine_drains;           /* How many times a magazine was drained to the heap. */
+    uint32_t atomic_allocation_cnt;     /* How many times kmalloc_atomic() succeeded. */
+    uint32_t atomic_failed_cnt;         /* How many times kmalloc_atomic() found the pool empty. */
+    uint32_t atomic_free_cnt;           /* How many times kfree_atomic() is called. */
+    uint32_t atomic_refill_cnt;         /* How many times the refill thread topped up the pool. */
+    uint32_t zeroed_hits;               /* How many kcalloc() requests were served a pre-zeroed block. */
+    uint32_t zeroed_misses;             /* How many kcalloc() requests found their zeroed pool class empty. */
+    uint32_t zeroed_fill_cnt;           /* How many blocks the fill thread zeroed for the pool. */
+    uint32_t bulk_run_cnt;              /* How many kmalloc_bulk() calls were carved out of one free block. */
+    uint32_t large_allocation_cnt;      /* How many allocations took the large block path (also counted in
+                                           allocation_cnt). */
+    uint32_t large_free_cnt;            /* How many large blocks were freed (also counted in free_cnt). */
+    size_t large_bytes;                 /* How many bytes of pages large blocks currently take up. */
+    size_t large_peak_bytes;            /* High water mark of large_bytes. */
+    uint32_t shrink_cnt;                /* How many times the heap ran out of pages and called the shrinkers. */
+    size_t shrink_bytes;                /* How many bytes the shrinkers gave back in total. */
+    size_t heap_bytes;                  /* How many bytes the heap segments currently take up, not counting
+                                           large blocks. */
+    size_t heap_peak_bytes;             /* High water mark of heap_bytes. */
+    size_t trimmed_bytes;               /* How many bytes were given back to the page allocator in total. */
+    uint32_t alloc_cycles[KMALLOC_CYCLE_BUCKETS];   /* Latency histogram of kmalloc(), kmalloc_aligned() and
+                                                       kcalloc(), including waiting for the lock. */
+    uint32_t free_cycles[KMALLOC_CYCLE_BUCKETS];    /* Latency histogram of kfree(). */
+    uint32_t realloc_cycles[KMALLOC_CYCLE_BUCKETS]; /* Latency histogram of krealloc(). */
+    uint32_t split_cnt;                 /* How many times a block was split in two. */
+    uint32_t coalesce_cnt;              /* How many times a free block merged with a neighbor. */
+    uint32_t free_block_cnt;            /* How many free blocks there are (the free list length). */
+    size_t free_block_bytes;            /* How many bytes the free blocks take up. */
+    size_t largest_free_block;          /* Size of the largest free block. */
+    uint32_t fragmentation;             /* External fragmentation in thousandths, the share of free bytes that
+                                           are not in the largest free block. */
 };
 
-/* Initializes the kernel memory manager. Called during kernel init, interrupts must be disabled. */
+/* Initializes the kernel memory manager and the page allocator it takes heap segments from. Called during
+   kernel init, interrupts must be disabled. */
 void kmalloc_init (const multiboot_info_t *mbinfo);
 
-/* Allocates a chunck of memory of atleast 'size' bytes. Returns the pointer to it.
-   Synchronized internally. */
+/* Allocates a chunck of memory of atleast 'size' bytes. Returns the pointer to it, or NULL if there is not
+   enough memory even after running the shrinkers. Synchronized internally. */
 void *kmalloc (size_t size);
 
-/* Same as kmalloc() but not synchronized. */
+/* Same as kmalloc() but not synchronized. Does not run the shrinkers, since they free memory themselves. */
 void *_kmalloc_unsafe (size_t size);
 
+/* Allocates a chunck of memory of atleast 'size' bytes aligned to 'align' bytes, which must be a power of 2.
+   Returns the pointer to it, which can be passed to kfree() and krealloc() (krealloc() does not keep the
+   alignment if the memory moves). Synchronized internally. */
+void *kmalloc_aligned (size_t size, size_t align);
+
+/* Same as kmalloc_aligned() but not synchronized. */
+void *_kmalloc_aligned_unsafe (size_t size, size_t align);
+
+/* Allocates page aligned memory of 'size' bytes rounded up to whole pages. Returns the pointer to it, which
+   can be passed to kfree(). Synchronized internally. */
+void *kpage_alloc (size_t size);
+
+/* Same as kpage_alloc() but not synchronized. */
+void *_kpage_alloc_unsafe (size_t size);
+
 /* Allocates and zeros a chunck of memory. Returns the pointer to it. The size of the memory is
    at least 'nelems' x 'elemsize' bytes large. Synchronized internally. */
 void *kcalloc (size_t nelems, size_t elemsize);
@@ -64,10 +219,124 @@ void kfree (void *ptr);
 /* Same as kfree() but not synchronized. */
 void _kfree_unsafe (void *ptr);
 
-/* Debug log. Synchronized internally. */
-void kmalloc_printdebug (void);
+/* Allocates 'cnt' chuncks of memory of atleast 'size' bytes each with a single trip to the heap, storing the
+   pointers in 'ptrs'. The chuncks are carved out of one free block when there is one large enough, so they
+   are next to each other in memory. Otherwise, and for chuncks above KMALLOC_LARGE_THRESHOLD, they are
+   allocated one at a time. Each can be passed to kfree() on it's own. Returns false (with 'ptrs' left
+   undefined) if the memory could not be allocated. Synchronized internally. */
+bool kmalloc_bulk (size_t size, size_t cnt, void **ptrs);
+
+/* Same as kmalloc_bulk() but not synchronized. */
+bool _kmalloc_bulk_unsafe (size_t size, size_t cnt, void **ptrs);
+
+/* Free 'cnt' memory blocks with a single trip to the heap. NULL pointers are skipped. Blocks next to each
+   other in memory, like the ones from kmalloc_bulk(), are merged before they go back to the free lists.
+   Sorts 'ptrs' by address. Synchronized internally. */
+void kfree_bulk (void **ptrs, size_t cnt);
+
+/* Same as kfree_bulk() but not synchronized. */
+void _kfree_bulk_unsafe (void **ptrs, size_t cnt);
 
-/* Get stats. */
+/* Gives the free pages at the top of every heap segment back to the page allocator, releasing segments
+   that are entirely free. Returns how many bytes were given back. Synchronized internally. */
+size_t kmalloc_trim (void);
+
+/* Frees memory a subsystem holds on to but can do without, like a cache. Returns how many bytes were given
+   back. */
+typedef size_t (*kmalloc_shrink_t) (void *arg);
+
+/* Memory pressure callback. When the heap can not get pages from the page allocator, the synchronized
+   allocation functions call every registered shrinker and retry once if any memory was given back. Shrinkers
+   run in the allocating thread without the heap lock held, so they can kfree(), but must not allocate.
+
+   Usage:
+   static kmalloc_shrinker_t shrinker;
+   kmalloc_register_shrinker (&shrinker, "name", 10, cache_shrink, &cache);
+*/
+typedef struct KMShrinker
+{
+    const char *name;                   /* Name for debugging. */
+    kmalloc_shrink_t shrink;            /* Callback, passed 'arg'. */
+    void *arg;
+    uint32_t priority;                  /* Shrinkers with lower values run first. Caches that are cheap to
+                                           rebuild should go before ones that are expensive. */
+    uint32_t call_cnt;                  /* How many times the callback was called. */
+    size_t reclaimed_bytes;             /* How many bytes the callback gave back in total. */
+    struct KMShrinker *next;            /* Next shrinker, in priority order. */
+} kmalloc_shrinker_t;
+
+/* Register a statically allocated shrinker. Shrinkers with the same priority run in the order they were
+   registered. Synchronized internally. */
+void kmalloc_register_shrinker (kmalloc_shrinker_t *shrinker, const char *name, uint32_t priority,
+                                kmalloc_shrink_t shrink, void *arg);
+
+/* Remove a registered shrinker. Waits for shrinkers that are running to finish. Synchronized internally. */
+void kmalloc_unregister_shrinker (kmalloc_shrinker_t *shrinker);
+
+/* Call every registered shrinker in priority order. Returns how many bytes were given back in total. Does
+   nothing if called from a shrinker. Synchronized internally. */
+size_t kmalloc_shrink (void);
+
+/* Reserves the kmalloc_atomic() pool and starts the thread that refills it. Called during kernel init after
+   thread_main_init(). */
+void kmalloc_atomic_init (void);
+
+/* Allocates a chunck of memory of atleast 'size' bytes (at most 4 KiB) from the reserved pool without
+   blocking. Safe to call from interrupt handlers and with interrupts disabled. Returns NULL if the pool is
+   empty, the refill thread tops it up in the background. The result can be passed to kfree() or
+   kfree_atomic(). */
+void *kmalloc_atomic (size_t size);
+
+/* Free memory block without blocking. Safe to call from interrupt handlers and with interrupts disabled.
+   Works on any block from the kernel heap, the block goes back to the reserved pool or is handed to the
+   refill thread to kfree(). If ptr is NULL, nothing is done. */
+void kfree_atomic (void *ptr);
+
+/* Starts the thread that fills the kcalloc() pool with zeroed blocks. Called during kernel init after
+   thread_main_init(). */
+void kmalloc_zeroed_init (void);
+
+/* Zero one block for the kcalloc() pool. Called by the fill thread, can block on the heap lock. Returns false
+   if the pool is full or the heap is out of memory, so there is nothing to do for now. Synchronized
+   internally. */
+bool kmalloc_zeroed_fill (void);
+
+/* Return every block in a thread's magazines to the heap. Called when the thread is cleaned up.
+   Synchronized internally. */
+void kmalloc_magazines_flush (struct KMMagazines *magazines);
+
+/* Print the stats in a machine readable form, one record per line, starting with the record type and
+   followed by key=value fields (the kmalloc_cycles records list the histogram buckets in order). If 'blocks'
+   is true, every heap block is listed too. Thread context only, like kmalloc_getstats(). Synchronized
+   internally.
+
+   kmalloc policy=tlsf hardening=standard allocation_cnt=12 ...
+   kmalloc_cycles op=alloc 0 3 9 0 ...
+   kmalloc_shrinker name=zeroed priority=0 call_cnt=1 reclaimed_bytes=4096
+   kmalloc_segment addr=1c0000 size=4000
+   kmalloc_block addr=1c0010 size=20 alloc=1 cached=0 magic=1
+*/
+void kmalloc_dump (bool blocks);
+
+/* How many records the call site trace ring buffer holds (KMALLOC_TRACE builds only). */
+#define KMALLOC_TRACE_SIZE 4096
+
+/* Print the call site trace ring buffer, oldest record first, in the same format as kmalloc_dump(). Built
+   with KMALLOC_TRACE (make KMALLOC_TRACE=1), every kmalloc(), kmalloc_aligned(), kpage_alloc(), kcalloc(),
+   krealloc(), kfree(), kmalloc_atomic() and kfree_atomic() is recorded with it's return address, otherwise
+   the ring is empty. Run scripts/kmalloc_trace.py on the serial output to get bytes per call site.
+   Synchronized internally.
+
+   kmalloc_trace_info enabled=1 records=2 dropped=0
+   kmalloc_trace op=alloc caller=201a3c ptr=1c0010 size=24 tsc_hi=0 tsc_lo=8f2e11c0
+   kmalloc_trace op=free caller=201b70 ptr=1c0010 size=32 tsc_hi=0 tsc_lo=8f2e4410
+*/
+void kmalloc_trace_dump (void);
+
+/* Get stats. Takes the heap lock to look largest_free_block up in the free block policy's index, so it must be
+   called from a thread, not from an interrupt handler or before threads are initialized. The lookup walks
+   the large block list under first fit, one list under TLSF and down the tree's right side under best fit.
+   Synchronized internally. */
 struct KMStats kmalloc_getstats (void);
 
 /* Enable debug prints. */
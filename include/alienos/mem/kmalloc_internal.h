@@ -0,0 +1,318 @@
+#ifndef ALIENOS_MEM_KMALLOC_INTERNAL_H
+#define ALIENOS_MEM_KMALLOC_INTERNAL_H
+
+/* Kernel heap internals shared between kmalloc.c and the free block policies. Not for use outside the
+   kernel memory manager. */
+
+#include "alienos/mem/kmalloc.h"
+#include "alienos/mem/page.h"
+#include "alienos/kernel/kernel.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define KMALLOC_ALIGNMENT 16
+#define KMALLOC_MIN_BLOCK_SIZE KMALLOC_ALIGN (sizeof (km_block_header_t) + sizeof (uint32_t), KMALLOC_ALIGNMENT)
+
+/* Body size of the smallest size class, see KMStats bin_hits. */
+#define KMALLOC_BIN_MIN 16
+
+/* Memory block header flag bits in metadata. */
+#define KMALLOC_ALLOC_BIT 0b0001
+#define KMALLOC_PREV_ALLOC_BIT 0b0010       /* Set if the block physically before is allocated (or there is
+                                               no block before). */
+#define KMALLOC_CACHED_BIT 0b0100           /* Set while an allocated block sits in a thread's magazine. */
+
+/* Heap consistency check, compiled out of release builds (KMALLOC_HARDENING). 'cond' is not evaluated then. */
+#if KMALLOC_HARDENING_LEVEL >= KMALLOC_HARDENING_LEVEL_STANDARD
+#define KM_CHECK(cond, ...) kernel_assert ((cond), __VA_ARGS__)
+#else
+#define KM_CHECK(cond, ...) \
+    do { (void) sizeof (cond); } while (0)
+#endif
+
+/* Magic number stored in the padding. */
+#define KMALLOC_MAGIC 0xF00BA700
+
+#define KMALLOC_ALIGN(x, align) ((((x) + (align) - 1) / (align)) * (align))
+
+/* Memory blocks tile the heap. Free blocks store a copy of their size in the last 4 bytes (the footer) so
+   the block after can find them, which lets a freed block merge with both neighbors in O(1). The heap
+   ends with an epilogue, an allocated header of size 0, so every block has a block after it.
+
+   ======================
+   | Header (16 bytes)
+   | Body
+   | ...
+   | Footer (free only)
+   ======================
+*/
+typedef struct __attribute__((packed)) KMBlockHeader
+{
+    uint32_t metadata;              /* Upper 28 bits is the size of the block including header size.
+                                       Lower 4 bits are flags. */
+    struct  KMBlockHeader *next;    /* Pointer to next block in list. */
+    uint32_t magic;                 /* Magic number to detect bad pointers. */
+    struct KMBlockHeader *prev;     /* Pointer to previous block in list. */
+} km_block_header_t;
+
+/* Get size of block (include header size). */
+static inline size_t km_getsize (const km_block_header_t * const block)
+{
+    return block->metadata & ~(0b1111);
+}
+
+/* Assumption is size is 16 byte aligned and includes the header size. */
+static inline void km_setsize (km_block_header_t * const block, const size_t size)
+{
+    block->metadata = (block->metadata & (0b1111)) | size;
+}
+
+/* Return if the block is allocated. */
+static inline bool km_isalloc (const km_block_header_t * const block)
+{
+    return block->metadata & KMALLOC_ALLOC_BIT;
+}
+
+/* Set the block to be allocated. */
+static inline void km_setalloc (km_block_header_t * const block)
+{
+    block->metadata = (block->metadata & ~KMALLOC_ALLOC_BIT) | KMALLOC_ALLOC_BIT;
+}
+
+/* Set the block to be unallocated. */
+static inline void km_clearalloc (km_block_header_t * const block)
+{
+    block->metadata = (block->metadata & ~KMALLOC_ALLOC_BIT);
+}
+
+/* Return if the block sits in a thread's magazine. */
+static inline bool km_iscached (const km_block_header_t * const block)
+{
+    return block->metadata & KMALLOC_CACHED_BIT;
+}
+
+/* Set whether the block sits in a thread's magazine. */
+static inline void km_setcached (km_block_header_t * const block, const bool cached)
+{
+    block->metadata = (block->metadata & ~KMALLOC_CACHED_BIT) | (cached ? KMALLOC_CACHED_BIT : 0);
+}
+
+/* Return if the block physically before is allocated. */
+static inline bool km_isprevalloc (const km_block_header_t * const block)
+{
+    return block->metadata & KMALLOC_PREV_ALLOC_BIT;
+}
+
+/* Set whether the block physically before is allocated. */
+static inline void km_setprevalloc (km_block_header_t * const block, const bool prev_alloc)
+{
+    block->metadata = (block->metadata & ~KMALLOC_PREV_ALLOC_BIT) | (prev_alloc ? KMALLOC_PREV_ALLOC_BIT : 0);
+}
+
+/* Check if the block has a valid magic number. */
+static inline bool km_checkmagic (const km_block_header_t * const block)
+{
+    return block->magic == KMALLOC_MAGIC;
+}
+
+/* Set the block's magic number. */
+static inline void km_setmagic (km_block_header_t * const block)
+{
+    block->magic = KMALLOC_MAGIC;
+}
+
+/* Get the block physically after. */
+static inline km_block_header_t *km_nextblock (const km_block_header_t * const block)
+{
+    return (km_block_header_t *) (((uintptr_t) block) + km_getsize (block));
+}
+
+/* Get the block physically before. Only valid if that block is free. */
+static inline km_block_header_t *km_prevblock (const km_block_header_t * const block)
+{
+    const uint32_t prev_size = *(((const uint32_t *) block) - 1);
+    return (km_block_header_t *) (((uintptr_t) block) - prev_size);
+}
+
+/* Copy the size of a free block into it's footer. */
+static inline void km_setfooter (km_block_header_t * const block)
+{
+    *(((uint32_t *) km_nextblock (block)) - 1) = km_getsize (block);
+}
+
+/* Returns if 'ptr' came from the large block path (KMALLOC_LARGE_THRESHOLD), that is it is the start of an
+   allocated page block. Heap blocks never are, the first one in a segment comes after the segment header. */
+static inline bool km_islarge (const void * const ptr)
+{
+    return page_isalloc (ptr);
+}
+
+/* Get the block size (including header) needed to serve a request of 'size' bytes. */
+static inline size_t km_target_size (const size_t size)
+{
+    const size_t target_size = KMALLOC_ALIGN (size + KMALLOC_REDZONE_SIZE + sizeof (km_block_header_t),
+                                              KMALLOC_ALIGNMENT);
+    return (target_size < KMALLOC_MIN_BLOCK_SIZE) ? KMALLOC_MIN_BLOCK_SIZE : target_size;
+}
+
+/* Initializes the header of the memory block. Does not insert into the free list. The block before is
+   assumed to be allocated. */
+static inline void km_initblock (km_block_header_t * const block, const size_t size)
+{
+    block->metadata = KMALLOC_PREV_ALLOC_BIT;
+    km_setsize (block, size);
+    km_setmagic (block);
+    block->next = NULL;
+    block->prev = NULL;
+}
+
+/* Mark block as allocated and let the block after know. */
+static inline void km_markalloc (km_block_header_t * const block)
+{
+    km_setalloc (block);
+    km_setprevalloc (km_nextblock (block), true);
+}
+
+/* Mark block as free, write it's footer and let the block after know. */
+static inline void km_markfree (km_block_header_t * const block)
+{
+    km_clearalloc (block);
+    km_setfooter (block);
+    km_setprevalloc (km_nextblock (block), false);
+}
+
+/* Zero 'size' bytes at 'ptr' a word at a time with a string store. */
+static inline void km_zero (void * const ptr, const size_t size)
+{
+    void *dst = ptr;
+    size_t cnt = size / sizeof (uint32_t);
+    asm volatile (
+        "rep stosl"
+        : "+D"(dst), "+c"(cnt)
+        : "a"(0)
+        : "memory"
+    );
+
+    uint8_t * const tail = (uint8_t *) dst;
+    for (size_t i = 0; i < size % sizeof (uint32_t); i++)
+    {
+        tail[i] = 0;
+    }
+}
+
+/* Remember the requested size of an allocated block in it's unused 'prev' link and fill the rest of it's body
+   with the redzone. Does nothing unless the build is paranoid (KMALLOC_HARDENING). */
+static inline void km_redzone_set (km_block_header_t * const block, const size_t size)
+{
+#if KMALLOC_HARDENING_LEVEL >= KMALLOC_HARDENING_LEVEL_PARANOID
+    block->prev = (km_block_header_t *) size;
+    memset (((uint8_t *) (block + 1)) + size, KMALLOC_REDZONE_BYTE,
+            km_getsize (block) - sizeof (km_block_header_t) - size);
+#else
+    (void) block;
+    (void) size;
+#endif
+}
+
+/* Panic if anything was written past the requested size of an allocated block. Does nothing unless the build
+   is paranoid (KMALLOC_HARDENING). */
+static inline void km_redzone_check (const km_block_header_t * const block)
+{
+#if KMALLOC_HARDENING_LEVEL >= KMALLOC_HARDENING_LEVEL_PARANOID
+    const size_t size = (size_t) block->prev;
+    const size_t body = km_getsize (block) - sizeof (km_block_header_t);
+    kernel_assert (size + KMALLOC_REDZONE_SIZE <= body, "km_redzone_check(): block %x has no redzone",
+                   (uintptr_t) block);
+    for (const uint8_t *cur = ((const uint8_t *) (block + 1)) + size; cur < ((const uint8_t *) (block + 1)) + body;
+         cur++)
+    {
+        kernel_assert (*cur == KMALLOC_REDZONE_BYTE, "km_redzone_check(): overflow past %u bytes of block %x",
+                       size, (uintptr_t) block);
+    }
+#else
+    (void) block;
+#endif
+}
+
+/* Fill freed memory with the poison pattern, so use after free reads garbage that stands out. Does nothing
+   unless the build is paranoid (KMALLOC_HARDENING). */
+static inline void km_poison (void * const ptr, const size_t size)
+{
+#if KMALLOC_HARDENING_LEVEL >= KMALLOC_HARDENING_LEVEL_PARANOID
+    memset (ptr, KMALLOC_POISON_BYTE, size);
+#else
+    (void) ptr;
+    (void) size;
+#endif
+}
+
+/* Stats, updated by kmalloc.c and the policies. Must be synchronized externally. */
+extern struct KMStats kmalloc_stats;
+
+/* Add a free block to the policy's index. Must be synchronized externally. */
+void km_list_add (km_block_header_t *block);
+
+/* Remove a free block from the policy's index. The block's size must not have changed since it was
+   added. Must be synchronized externally. */
+void km_list_remove (km_block_header_t *block);
+
+/* Find a free block of atleast 'size' bytes (including header) in the policy's index. Does not remove it.
+   Returns NULL if there is none. Must be synchronized externally. */
+km_block_header_t *km_list_find (size_t size);
+
+/* Get the size of the largest free block in the policy's index, 0 if it is empty. Must be synchronized
+   externally. */
+size_t km_list_largest (void);
+
+/* Check the policy's index is consistent and every block in it is free. Returns how many blocks it holds.
+   Only used by paranoid builds (KMALLOC_HARDENING). Must be synchronized externally. */
+size_t km_list_validate (void);
+
+/* Take and give back the heap lock, for callers of the _unsafe functions such as test_latency. Thread context
+   only, the lock is a mutex. */
+void km_lock (void);
+void km_unlock (void);
+
+/* Allocate a heap block straight from the free lists, without the magazines, the large block path or the
+   stats of kmalloc(). Blocks on the heap lock. */
+void *km_alloc_block (size_t size);
+
+/* Take a zeroed block from the kcalloc() pool for a request of 'size' bytes. Returns NULL if the request
+   is not served by the pool or it's class is empty. Synchronized internally. */
+km_block_header_t *km_zeroed_take (size_t size);
+
+/* Give every block in the kcalloc() pool back to the heap. Shrinker callback, returns how many bytes were
+   given back. Synchronized internally. */
+size_t km_zeroed_shrink (void *arg);
+
+/* Return the current thread's magazines to the heap. Shrinker callback, returns how many bytes were given
+   back. Synchronized internally. */
+size_t km_magazines_shrink (void *arg);
+
+/* Set up the shrinker registry and register the kernel heap's own shrinkers. Called by kmalloc_init(). */
+void km_shrinker_init (void);
+
+/* Print a kmalloc_shrinker record for every registered shrinker, see kmalloc_dump(). Synchronized
+   internally. */
+void km_shrinker_dump (void);
+
+/* Call site trace record operations. */
+#define KMALLOC_TRACE_ALLOC 0
+#define KMALLOC_TRACE_FREE 1
+
+/* Record an allocation or free made by 'caller' in the trace ring buffer. Only built with KMALLOC_TRACE.
+   Synchronized internally. */
+void km_trace (uint32_t op, const void *caller, const void *ptr, size_t size);
+
+/* Trace an operation when the kernel is built with KMALLOC_TRACE, otherwise compiles to nothing. */
+#ifdef KMALLOC_TRACE
+#define KM_TRACE(op, caller, ptr, size) km_trace ((op), (caller), (ptr), (size))
+#else
+#define KM_TRACE(op, caller, ptr, size) \
+    do { (void) (caller); (void) (ptr); (void) (size); } while (0)
+#endif
+
+#endif /* ALIENOS_MEM_KMALLOC_INTERNAL_H */
\ No newline at end of file
@@ -0,0 +1,62 @@
+#ifndef ALIENOS_MEM_PAGE_H
+#define ALIENOS_MEM_PAGE_H
+
+#include "alienos/kernel/multiboot.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PAGE_SIZE 4096
+
+/* Largest block is (1 << PAGE_MAX_ORDER) pages (256 MiB). */
+#define PAGE_MAX_ORDER 16
+
+struct PageStats
+{
+    uint32_t total_pages;               /* How many pages are managed. */
+    uint32_t free_pages;                /* How many pages are currently free. */
+    uint32_t alloc_cnt;                 /* How many times page_alloc() succeeded. */
+    uint32_t free_cnt;                  /* How many times page_free() is called. */
+    uint32_t split_cnt;                 /* How many times a block was split in half. */
+    uint32_t merge_cnt;                 /* How many times a block merged with it's buddy. */
+};
+
+/* Buddy physical page allocator. Hands out blocks of (1 << order) pages aligned to their size. Freed
+   blocks merge with their buddy (the other half of the block they were split from) when it is free too.
+
+   Usage:
+   uint8_t *pages = page_alloc (2);     // 4 pages
+   <...>
+   page_free (pages);
+*/
+
+/* Initializes the page allocator from every available region in the multiboot memory map. Memory below
+   1 MiB, the kernel image and the multiboot info are left out. Called during kernel init, interrupts must
+   be disabled. */
+void page_init (const multiboot_info_t *mbinfo);
+
+/* Allocates a block of (1 << order) pages. Returns NULL if there is no free block large enough.
+   Synchronized internally. */
+void *page_alloc (uint32_t order);
+
+/* Frees a block returned by page_alloc(). If page is NULL, nothing is done. Synchronized internally. */
+void page_free (void *page);
+
+/* Shrinks a block returned by page_alloc() to (1 << order) pages, giving the pages after back to the free
+   lists. The block keeps it's address. Synchronized internally. */
+void page_shrink (void *page, uint32_t order);
+
+/* Get the smallest order whose block holds 'size' bytes. */
+uint32_t page_order (size_t size);
+
+/* Returns if 'page' is the start of an allocated block. */
+bool page_isalloc (const void *page);
+
+/* Get the order of an allocated block returned by page_alloc(). */
+uint32_t page_getorder (const void *page);
+
+/* Get stats. */
+struct PageStats page_getstats (void);
+
+#endif /* ALIENOS_MEM_PAGE_H */
\ No newline at end of file
@@ -0,0 +1,78 @@
+#ifndef ALIENOS_MEM_SLAB_H
+#define ALIENOS_MEM_SLAB_H
+
+#include "alienos/kernel/synch.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of a slab. Slabs are aligned to their size so an object can find it's slab by masking it's
+   address. */
+#define KMEM_SLAB_SIZE 4096
+
+struct KMemSlab;
+
+struct KMemCacheStats
+{
+    uint32_t allocation_cnt;            /* How many times kmem_cache_alloc() is called. */
+    uint32_t free_cnt;                  /* How many times kmem_cache_free() is called. */
+    uint32_t active_objs;               /* How many objects are currently allocated. */
+    uint32_t objs_per_slab;             /* How many objects fit in a slab. */
+    uint32_t slab_cnt;                  /* How many slabs the cache currently owns. */
+    uint32_t slab_alloc_cnt;            /* How many slabs were taken from the kernel heap. */
+    uint32_t slab_free_cnt;             /* How many empty slabs were returned to the kernel heap. */
+};
+
+/* Object cache. Carves slabs into fixed size objects so allocating and freeing is a list pop/push
+   without the kernel heap's per block header.
+
+   Usage:
+   kmem_cache_t *cache = kmem_cache_create ("name", sizeof (struct Object), 0, NULL);
+   struct Object *obj = kmem_cache_alloc (cache);
+   <...>
+   kmem_cache_free (cache, obj);
+*/
+typedef struct KMemCache
+{
+    const char *name;                   /* Name for debugging. */
+    size_t objsize;                     /* Size of each object, including alignment padding. */
+    size_t offset;                      /* Offset of the first object from the start of the slab. */
+    size_t link_offset;                 /* Offset of the free list link within a free object. */
+    void (*ctor) (void *obj);           /* Called once on each object when it's slab is created. Freed
+                                           objects must be returned in their constructed state. */
+
+    struct KMemSlab *partial;           /* Slabs with some free objects. */
+    struct KMemSlab *full;              /* Slabs with no free objects. */
+    struct KMemSlab *empty;             /* Slabs with only free objects. */
+
+    struct KMemCacheStats stats;
+    mutex_t lock;
+} kmem_cache_t;
+
+/* Initialize a statically allocated cache of 'objsize' byte objects aligned to 'align' bytes (0 for
+   pointer alignment). 'ctor' may be NULL. Does not allocate any memory. */
+void kmem_cache_init (kmem_cache_t *cache, const char *name, size_t objsize, size_t align,
+                      void (*ctor) (void *obj));
+
+/* Same as kmem_cache_init() but allocates the cache on the kernel heap. Synchronized internally. */
+kmem_cache_t *kmem_cache_create (const char *name, size_t objsize, size_t align, void (*ctor) (void *obj));
+
+/* Free every slab of a cache created by kmem_cache_create() and the cache itself. All objects must have
+   been freed. Synchronized internally. */
+void kmem_cache_destroy (kmem_cache_t *cache);
+
+/* Allocate an object from the cache. Synchronized internally. */
+void *kmem_cache_alloc (kmem_cache_t *cache);
+
+/* Return an object to the cache it was allocated from. If obj is NULL, nothing is done. Synchronized
+   internally. */
+void kmem_cache_free (kmem_cache_t *cache, void *obj);
+
+/* Return every empty slab to the kernel heap. Returns how many slabs were freed. Synchronized
+   internally. */
+uint32_t kmem_cache_shrink (kmem_cache_t *cache);
+
+/* Get stats. */
+struct KMemCacheStats kmem_cache_getstats (const kmem_cache_t *cache);
+
+#endif /* ALIENOS_MEM_SLAB_H */
\ No newline at end of file
@@ -15,6 +15,9 @@ struct UnitTestsResult
 #define TEST(name) static const char *name (void)
 
 void kmalloc_test (struct UnitTestsResult *result);
+void slab_test (struct UnitTestsResult *result);
+void arena_test (struct UnitTestsResult *result);
+void page_test (struct UnitTestsResult *result);
 void io_test (struct UnitTestsResult *result);
 void thread_test (struct UnitTestsResult *result);
 void synch_test (struct UnitTestsResult *result);
@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""Aggregate a kmalloc call site trace by call site.
+
+Build the kernel with the trace ring buffer, capture the serial output and feed it to this script:
+
+    make KMALLOC_TRACE=1 qemu | tee serial.log
+    scripts/kmalloc_trace.py serial.log
+
+Every kmalloc_trace line printed by kmalloc_trace_dump() is replayed. For each call site (symbolized
+against iso/alienos.bin with addr2line) it reports how many allocations it made, how many bytes in total,
+how many bytes are still live at the end of the trace, and how long its freed blocks were held on average.
+Frees of blocks allocated before the ring wrapped are ignored.
+"""
+
+import argparse
+import shutil
+import subprocess
+import sys
+from collections import defaultdict
+
+
+def parse(lines):
+    """Yield the fields of each kmalloc_trace record, in the order they were printed."""
+    for line in lines:
+        words = line.split()
+        if not words or words[0] != "kmalloc_trace":
+            continue
+        fields = dict(word.split("=", 1) for word in words[1:] if "=" in word)
+        yield {
+            "op": fields["op"],
+            "caller": int(fields["caller"], 16),
+            "ptr": int(fields["ptr"], 16),
+            "size": int(fields["size"]),
+            "tsc": (int(fields["tsc_hi"], 16) << 32) | int(fields["tsc_lo"], 16),
+        }
+
+
+class Site:
+    def __init__(self):
+        self.allocs = 0
+        self.bytes = 0
+        self.live_bytes = 0
+        self.frees = 0
+        self.hold_cycles = 0
+
+
+def aggregate(records):
+    """Replay the records, matching frees to the allocation of the same pointer."""
+    sites = defaultdict(Site)
+    live = {}
+    for record in records:
+        if record["op"] == "alloc":
+            # The previous owner handed the block on without a traced free (e.g. a reserved pool).
+            if record["ptr"] in live:
+                caller, size, _ = live.pop(record["ptr"])
+                sites[caller].live_bytes -= size
+
+            site = sites[record["caller"]]
+            site.allocs += 1
+            site.bytes += record["size"]
+            site.live_bytes += record["size"]
+            live[record["ptr"]] = (record["caller"], record["size"], record["tsc"])
+        elif record["ptr"] in live:
+            caller, size, tsc = live.pop(record["ptr"])
+            site = sites[caller]
+            site.live_bytes -= size
+            site.frees += 1
+            site.hold_cycles += record["tsc"] - tsc
+    return sites
+
+
+def symbolize(binary, addresses, addr2line):
+    """Map return addresses to 'function file:line' of the call."""
+    names = {address: "?" for address in addresses}
+    if not addresses:
+        return names
+    tool = addr2line or shutil.which("i686-elf-addr2line") or shutil.which("addr2line")
+    if not tool:
+        print("warning: addr2line not found, call sites are not symbolized", file=sys.stderr)
+        return names
+
+    # The return address points after the call, step back into it.
+    query = "\n".join("%x" % (address - 1) for address in addresses)
+    try:
+        output = subprocess.run([tool, "-f", "-C", "-e", binary], input=query, capture_output=True,
+                                text=True, check=True).stdout.splitlines()
+    except (OSError, subprocess.CalledProcessError) as error:
+        print("warning: %s failed (%s), call sites are not symbolized" % (tool, error), file=sys.stderr)
+        return names
+
+    for address, function, location in zip(addresses, output[0::2], output[1::2]):
+        names[address] = "%s %s" % (function, location.split("/")[-1])
+    return names
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("log", nargs="?", type=argparse.FileType("r"), default=sys.stdin,
+                        help="serial output containing kmalloc_trace_dump() (default: stdin)")
+    parser.add_argument("--binary", default="iso/alienos.bin", help="kernel image to symbolize against")
+    parser.add_argument("--addr2line", help="addr2line to use (default: i686-elf-addr2line or addr2line)")
+    parser.add_argument("--sort", choices=["live", "bytes", "allocs", "hold"], default="live",
+                        help="column to sort call sites by (default: live)")
+    args = parser.parse_args()
+
+    sites = aggregate(parse(args.log))
+    names = symbolize(args.binary, sorted(sites), args.addr2line)
+
+    def hold(site):
+        return site.hold_cycles // site.frees if site.frees else 0
+
+    keys = {
+        "live": lambda item: item[1].live_bytes,
+        "bytes": lambda item: item[1].bytes,
+        "allocs": lambda item: item[1].allocs,
+        "hold": lambda item: hold(item[1]),
+    }
+
+    print("%10s %8s %12s %12s %14s  %s" % ("caller", "allocs", "bytes", "live bytes", "avg hold cyc", "site"))
+    for caller, site in sorted(sites.items(), key=keys[args.sort], reverse=True):
+        print("%10x %8d %12d %12d %14d  %s" % (caller, site.allocs, site.bytes, site.live_bytes, hold(site),
+                                                names[caller]))
+
+
+if __name__ == "__main__":
+    main()
@@ -63,6 +63,12 @@ void kernel_main(const unsigned int magic, const multiboot_info_t * const mbinfo
 	   SYNCHRONIZED FUNCTIONS ARE NOT CALLED BEFORE NOW. that means replacing any printf() with unsafe_printf(). */
 	thread_main_init ();
 
+	/* Reserve the pool interrupt handlers allocate from. */
+	kmalloc_atomic_init ();
+
+	/* Start zeroing blocks for kcalloc() in the background. */
+	kmalloc_zeroed_init ();
+
 	/* ====== INITIALIZATION DONE ====== */
 	interrupt_enable ();
 	printf ("Kernel Initialize Completed\n");
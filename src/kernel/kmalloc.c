@@ -1,29 +1,40 @@
 #include "alienos/mem/kmalloc.h"
+#include "alienos/mem/kmalloc_internal.h"
+#include "alienos/mem/page.h"
 #include "alienos/kernel/kernel.h"
 #include "alienos/io/io.h"
 #include "alienos/io/interrupt.h"
 #include "alienos/kernel/synch.h"
+#include "alienos/kernel/thread.h"
+#include "alienos/cpu/cpu.h"
 
 #include <stdbool.h>
+#include <string.h>
 
-#define KMALLOC_PAGESIZE 4096
-#define KMALLOC_ALIGNMENT 16
-#define KMALLOC_HEAP_INIT_SIZE (4 * KMALLOC_PAGESIZE)
-#define KMALLOC_MAX_INTERNAL_FRAG 16
+#define KMALLOC_HEAP_INIT_SIZE (4 * PAGE_SIZE)
 
-/* Memory block header flag bits in metadata. */
-#define KMALLOC_ALLOC_BIT 0b0001
+/* Smallest heap segment is (1 << KMALLOC_SEGMENT_MIN_ORDER) pages. */
+#define KMALLOC_SEGMENT_MIN_ORDER 2
 
-/* Magic number stored in the padding. */
-#define KMALLOC_MAGIC 0xF00BA700
+/* The heap is made of segments, blocks of pages from the page allocator. A segment starts with this
+   header, followed by the memory blocks, and ends with an epilogue. Blocks never span segments.
 
-#define KMALLOC_ALIGN(x, align) ((((x) + (align) - 1) / (align)) * (align))
-
-extern uint8_t kernel_end;
+   ======================
+   | Segment header (16 bytes)
+   | Memory blocks
+   | ...
+   | Epilogue (16 bytes)
+   ======================
+*/
+typedef struct KMSegment
+{
+    struct KMSegment *next;             /* Next segment of the heap. Not ordered. */
+    uint32_t size;                      /* Size of the segment in bytes. */
+    uint32_t reserved[2];               /* Keeps the first block 16 byte aligned. */
+} km_segment_t;
 
-static uint32_t kheap_begin;
-static uint32_t kheap_end;
-static uint32_t kheap_max_end;
+/* Every heap segment. */
+static km_segment_t *kheap_segments = NULL;
 
 static bool enable_debug_print = true;
 
@@ -44,184 +55,361 @@ void kmalloc_disabledebug (void)
 #define DEBUG(...) ;
 #endif
 
-static struct KMStats kmalloc_stats = {};
-
-
-typedef struct __attribute__((packed)) KMBlockHeader
-{
-    uint32_t metadata;              /* Upper 28 bits is the size of the block including header size.
-                                       Lower 4 bits are flags. */
-    struct  KMBlockHeader *next;    /* Pointer to next block in list. */
-    uint32_t pad[2];                /* Padding to ensure 16 byte alignment. */
-} km_block_header_t;
-
-/* List of free (unallocated) blocks in heap. */
-static km_block_header_t *free_list = NULL;
+struct KMStats kmalloc_stats = {};
 
 /* Lock access to free list. */
 static mutex_t free_list_lock;
 
-/* Should be called during init with interrupts disabled. */
-static bool internal_read_multibootinfo (const multiboot_info_t *const mbinfo)
+#if KMALLOC_HARDENING_LEVEL >= KMALLOC_HARDENING_LEVEL_PARANOID
+/* Walks every segment block by block, checking headers, footers and flags, and that the free blocks are the
+   ones in the policy's index. Called every time the free lists change. Must be synchronized externally. */
+static void km_validate (void)
 {
-    /* Panic if mmap is not available. */
-    kernel_assert (mbinfo->flags & MULTIBOOT_INFO_MEM_MAP, "kmalloc_init(): mmap unavailable");
-
-    bool found = false;
-    multiboot_memory_map_t *mmap = (multiboot_memory_map_t *) mbinfo->mmap_addr;
-
-    /* https://www.gnu.org/software/grub/manual/multiboot/multiboot.html#Boot-information-format */
-    DEBUG ("Searching Multiboot mmap\n");
-    while ((uint32_t) mmap < mbinfo->mmap_addr + mbinfo->mmap_length)
+    size_t free_cnt = 0;
+    size_t free_bytes = 0;
+    size_t largest = 0;
+    for (const km_segment_t *segment = kheap_segments; segment; segment = segment->next)
     {
-        /* If memory is available RAM, then check if the kernel is contained within. */
-        if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE)
+        const uintptr_t end = ((uintptr_t) segment) + segment->size;
+        bool prev_free = false;
+        const km_block_header_t *cur = (const km_block_header_t *) (segment + 1);
+        for (; km_getsize (cur); cur = km_nextblock (cur))
         {
-            const uint32_t start = (uint32_t) mmap->addr;
-            const uint32_t end = start + (uint32_t) mmap->len;
-
-            if (start <= (uintptr_t) &kernel_end && end > (uintptr_t) &kernel_end)
-            {
-                kheap_max_end = end;
-                found = true;
-
-                DEBUG ("> Found memory block: %x, %x \tTARGET FOUND\n", start, end);
-                break;
-            }
-            else
+            kernel_assert (km_checkmagic (cur), "km_validate(): block corrupted (%x)", (uintptr_t) cur);
+            kernel_assert (km_getsize (cur) % KMALLOC_ALIGNMENT == 0 && km_getsize (cur) >= KMALLOC_MIN_BLOCK_SIZE
+                           && (uintptr_t) km_nextblock (cur) < end, "km_validate(): bad size (%x)", (uintptr_t) cur);
+            kernel_assert (km_isprevalloc (cur) == !prev_free, "km_validate(): wrong prev alloc bit (%x)",
+                           (uintptr_t) cur);
+            if (!km_isalloc (cur))
             {
-                DEBUG ("> Found memory block: %x, %x\n", start, end);
+                kernel_assert (!prev_free, "km_validate(): free blocks not coalesced (%x)", (uintptr_t) cur);
+                kernel_assert (*(((const uint32_t *) km_nextblock (cur)) - 1) == km_getsize (cur),
+                               "km_validate(): bad footer (%x)", (uintptr_t) cur);
+                free_cnt++;
+                free_bytes += km_getsize (cur);
+                largest = (km_getsize (cur) > largest) ? km_getsize (cur) : largest;
             }
+            prev_free = !km_isalloc (cur);
         }
 
-        mmap = (multiboot_memory_map_t *) ((uint32_t) mmap + mmap->size + sizeof (mmap->size));
+        kernel_assert (km_checkmagic (cur) && km_isalloc (cur) && km_isprevalloc (cur) == !prev_free
+                       && (uintptr_t) (cur + 1) == end, "km_validate(): bad epilogue (%x)", (uintptr_t) cur);
     }
 
-    kernel_assert (found, "kmalloc_init(): failed to find valid memory block");
-    return true;
+    const size_t listed_cnt = km_list_validate ();
+    kernel_assert (listed_cnt == free_cnt, "km_validate(): %u free blocks but %u in the free lists", free_cnt,
+                   listed_cnt);
+    kernel_assert (kmalloc_stats.free_block_cnt == free_cnt && kmalloc_stats.free_block_bytes == free_bytes,
+                   "km_validate(): stats count %u free blocks of %u bytes, the heap has %u of %u",
+                   kmalloc_stats.free_block_cnt, kmalloc_stats.free_block_bytes, free_cnt, free_bytes);
+    kernel_assert (km_list_largest () == largest, "km_validate(): largest free block is %u, not %u",
+                   largest, km_list_largest ());
 }
-
-/* Get size of block (include header size). */
-static inline size_t km_getsize (const km_block_header_t * const block)
+#else
+static inline void km_validate (void)
 {
-    return block->metadata & ~(0b1111);
 }
+#endif
 
-/* Assumption is size is 16 byte aligned and includes the header size. */
-static inline void km_setsize (km_block_header_t * const block, const size_t size)
+/* Frees a block, merging it with it's free neighbors, and adds the result to it's list. Returns the free
+   block containing 'block' after coalescing. Must be synchronized externally. */
+static km_block_header_t *km_insert (km_block_header_t *block)
 {
-    block->metadata = (block->metadata & (0b1111)) | size;
+    if (!block)
+    {
+        return NULL;
+    }
+
+    size_t size = km_getsize (block);
+
+    /* Merge with the block after. */
+    km_block_header_t * const next = km_nextblock (block);
+    if (!km_isalloc (next))
+    {
+        KM_CHECK (km_checkmagic (next), "km_insert(): next block corrupted (%x)", (uintptr_t) next);
+        km_list_remove (next);
+        size += km_getsize (next);
+        kmalloc_stats.coalesce_cnt++;
+    }
+
+    /* Merge with the block before. */
+    if (!km_isprevalloc (block))
+    {
+        km_block_header_t * const prev = km_prevblock (block);
+        KM_CHECK (km_checkmagic (prev) && !km_isalloc (prev),
+                  "km_insert(): prev block corrupted (%x,%x)", (uintptr_t) prev, (uintptr_t) block);
+        km_list_remove (prev);
+        size += km_getsize (prev);
+        block = prev;
+        kmalloc_stats.coalesce_cnt++;
+    }
+
+    km_setsize (block, size);
+    km_markfree (block);
+    km_list_add (block);
+    km_validate ();
+    return block;
 }
 
-/* Return if the block is allocated. */
-static inline bool km_isalloc (const km_block_header_t * const block)
+/* Gives the free block at the top of a segment back to the page allocator if it is atleast 'threshold' bytes.
+   The segment shrinks to the smallest order that still holds it's allocated blocks, or is released if it is
+   entirely free. 'link' points to the segment in kheap_segments. Returns how many bytes were given back.
+   Must be synchronized externally. */
+static size_t km_trim (km_segment_t ** const link, const size_t threshold)
 {
-    return block->metadata & KMALLOC_ALLOC_BIT;
+    km_segment_t * const segment = *link;
+    km_block_header_t * const epilogue =
+        (km_block_header_t *) (((uintptr_t) segment) + segment->size - sizeof (km_block_header_t));
+    if (km_isprevalloc (epilogue))
+    {
+        return 0;
+    }
+
+    km_block_header_t * const top = km_prevblock (epilogue);
+    KM_CHECK (km_checkmagic (top) && !km_isalloc (top), "km_trim(): top block corrupted (%x)", (uintptr_t) top);
+    if (km_getsize (top) < threshold)
+    {
+        return 0;
+    }
+
+    const size_t old_size = segment->size;
+    const size_t used = ((uintptr_t) top) - ((uintptr_t) segment);
+
+    /* Nothing is allocated, release the whole segment. */
+    if (used == sizeof (km_segment_t))
+    {
+        km_list_remove (top);
+        *link = segment->next;
+        page_free (segment);
+
+        kmalloc_stats.heap_bytes -= old_size;
+        kmalloc_stats.trimmed_bytes += old_size;
+        DEBUG ("Releasing Heap [%x,%x]\n", (uintptr_t) segment, ((uintptr_t) segment) + old_size);
+        return old_size;
+    }
+
+    /* The free block left at the top must be empty or large enough to be a block. */
+    uint32_t order = page_order (used + sizeof (km_block_header_t));
+    order = (order < KMALLOC_SEGMENT_MIN_ORDER) ? KMALLOC_SEGMENT_MIN_ORDER : order;
+    size_t rest = (PAGE_SIZE << order) - used - sizeof (km_block_header_t);
+    if (rest != 0 && rest < KMALLOC_MIN_BLOCK_SIZE)
+    {
+        order++;
+        rest += PAGE_SIZE << (order - 1);
+    }
+
+    if ((size_t) (PAGE_SIZE << order) >= old_size)
+    {
+        return 0;
+    }
+
+    km_list_remove (top);
+    segment->size = PAGE_SIZE << order;
+
+    /* The block before the top block is allocated, since free blocks never touch. */
+    km_block_header_t * const new_epilogue =
+        (km_block_header_t *) (((uintptr_t) segment) + segment->size - sizeof (km_block_header_t));
+    km_initblock (new_epilogue, 0);
+    km_setalloc (new_epilogue);
+    if (rest != 0)
+    {
+        km_setsize (top, rest);
+        km_markfree (top);
+        km_list_add (top);
+    }
+
+    page_shrink (segment, order);
+
+    kmalloc_stats.heap_bytes -= old_size - segment->size;
+    kmalloc_stats.trimmed_bytes += old_size - segment->size;
+    DEBUG ("Trimming Heap [%x,%x] to %x\n", (uintptr_t) segment, ((uintptr_t) segment) + old_size,
+           segment->size);
+    return old_size - segment->size;
 }
 
-/* Set the block to be allocated. */
-static inline void km_setalloc (km_block_header_t * const block)
+/* Trims every segment, see km_trim(). Returns how many bytes were given back. Must be synchronized
+   externally. */
+static size_t km_trim_all (const size_t threshold)
 {
-    block->metadata = (block->metadata & ~KMALLOC_ALLOC_BIT) | KMALLOC_ALLOC_BIT;
+    size_t released = 0;
+    km_segment_t **link = &kheap_segments;
+    while (*link)
+    {
+        km_segment_t * const segment = *link;
+        released += km_trim (link, threshold);
+
+        /* Released segments are already unlinked. */
+        if (*link == segment)
+        {
+            link = &segment->next;
+        }
+    }
+
+    return released;
 }
 
-/* Set the block to be unallocated. */
-static inline void km_clearalloc (km_block_header_t * const block)
+/* Frees an allocated block with km_insert(). Gives the top of the segment back once enough of it is free, so
+   bursts do not pin memory. Must be synchronized externally. */
+static void km_release (km_block_header_t * const block)
 {
-    block->metadata = (block->metadata & ~KMALLOC_ALLOC_BIT);
+    km_block_header_t * const free_block = km_insert (block);
+    if (km_getsize (free_block) >= KMALLOC_TRIM_THRESHOLD && km_getsize (km_nextblock (free_block)) == 0)
+    {
+        km_segment_t **link = &kheap_segments;
+        while ((uintptr_t) free_block < (uintptr_t) *link
+               || (uintptr_t) free_block >= ((uintptr_t) *link) + (*link)->size)
+        {
+            link = &(*link)->next;
+        }
+        km_trim (link, KMALLOC_TRIM_THRESHOLD);
+    }
 }
 
-/* Check if the block has a valid magic number. */
-static inline bool km_checkmagic (const km_block_header_t * const block)
+/* Creates a new block of atleast 'size' bytes (including header) in a new heap segment. Does not insert into
+   free list. To allocate a block to satisfy request, pass in 'reqsize + 16' to account for size of header.
+   Returns NULL if there are not enough free pages, the caller runs the shrinkers once it has released the
+   lock. Must be synchronized externally. */
+static km_block_header_t *km_extend (const size_t size)
 {
-    return block->pad[0] == KMALLOC_MAGIC;
+    uint32_t order = page_order (sizeof (km_segment_t) + size + sizeof (km_block_header_t));
+    order = (order < KMALLOC_SEGMENT_MIN_ORDER) ? KMALLOC_SEGMENT_MIN_ORDER : order;
+
+    km_segment_t *segment = page_alloc (order);
+    if (!segment)
+    {
+        /* Free pages at the top of other segments may be enough once given back. */
+        km_trim_all (0);
+        segment = page_alloc (order);
+    }
+    if (!segment)
+    {
+        DEBUG ("Out of pages for a segment of order %u\n", order);
+        return NULL;
+    }
+
+    segment->size = PAGE_SIZE << order;
+    segment->next = kheap_segments;
+    kheap_segments = segment;
+
+    kmalloc_stats.heap_bytes += segment->size;
+    if (kmalloc_stats.heap_bytes > kmalloc_stats.heap_peak_bytes)
+    {
+        kmalloc_stats.heap_peak_bytes = kmalloc_stats.heap_bytes;
+    }
+
+    /* Nothing is before the first block, so it never merges backwards out of the segment. */
+    km_block_header_t * const block = (km_block_header_t *) (segment + 1);
+    km_initblock (block, segment->size - sizeof (km_segment_t) - sizeof (km_block_header_t));
+    km_setalloc (block);
+
+    km_block_header_t * const epilogue = km_nextblock (block);
+    km_initblock (epilogue, 0);
+    km_setalloc (epilogue);
+
+    DEBUG ("Extending Heap [%x,%x]\n", (uintptr_t) segment, ((uintptr_t) segment) + segment->size);
+    return block;
 }
 
-/* Set the block's magic number. */
-static inline void km_setmagic (km_block_header_t * const block)
+/* Get how many bytes the memory at 'ptr' can hold, whichever path it was allocated on. */
+static inline size_t km_bodysize (const void * const ptr)
 {
-    block->pad[0] = KMALLOC_MAGIC;
+    if (km_islarge (ptr))
+    {
+        return (size_t) PAGE_SIZE << page_getorder (ptr);
+    }
+
+    return km_getsize (((const km_block_header_t *) ptr) - 1) - sizeof (km_block_header_t);
 }
 
-/* Initializes the header of the memory block. Does not insert into the free list. */
-static inline void km_initblock (km_block_header_t * const block, const size_t size)
+/* Count allocated blocks. The magazines count without free_list_lock, so the counters are only ever updated
+   with interrupts disabled, on every path. Synchronized internally. */
+static inline void km_count_alloc (const uint32_t cnt, const size_t bytes)
 {
-    km_setsize (block, size);
-    km_clearalloc (block);
-    km_setmagic (block);
+    const bool interrupts = interrupt_disable ();
+    kmalloc_stats.allocation_cnt += cnt;
+    kmalloc_stats.allocation_bytes += bytes;
+    interrupt_restore (interrupts);
 }
 
-/* Checks if a block in the free list can be coalesced with it's neighbor. Free list is
-   memory ordered. Must be synchronized externally. */
-static void km_coalesce (km_block_header_t * const block)
+/* Count freed blocks, see km_count_alloc(). Synchronized internally. */
+static inline void km_count_free (const uint32_t cnt, const size_t bytes)
 {
-    if (block->next && ((uintptr_t) block) + km_getsize (block) == (uintptr_t) block->next)
-    {
-        km_setsize (block, km_getsize (block) + km_getsize (block->next));
-        block->next = block->next->next;
-    }
+    const bool interrupts = interrupt_disable ();
+    kmalloc_stats.free_cnt += cnt;
+    kmalloc_stats.free_bytes += bytes;
+    interrupt_restore (interrupts);
 }
 
-/* Inserts a block into free list, sorted by memory address. Must be synchronized externally. */
-static void km_insert (km_block_header_t * const block)
+/* Allocates a large block of atleast 'size' bytes aligned to 'align' bytes straight from the page allocator.
+   The block has no header, the page allocator keeps it's size. Returns NULL if there are not enough free
+   pages. Must be synchronized externally. */
+static void *km_large_alloc (const size_t size, const size_t align)
 {
-    if (!block)
+    const uint32_t order = page_order ((size > align) ? size : align);
+    void *ptr = page_alloc (order);
+    if (!ptr)
     {
-        return;
+        /* Free pages at the top of heap segments may be enough once given back. */
+        km_trim_all (0);
+        ptr = page_alloc (order);
     }
-
-    /* Free list is empty or the block comes before the free list. */
-    if (!free_list || (uintptr_t) block < (uintptr_t) free_list)
+    if (!ptr)
     {
-        block->next = free_list;
-        free_list = block;
-        km_coalesce (free_list);
-        return;
+        return NULL;
     }
 
-    km_block_header_t *prev = free_list;
-    km_block_header_t *next = free_list->next;
-
-    while (next != NULL && (uintptr_t) next < (uintptr_t) block)
+    const size_t bytes = (size_t) PAGE_SIZE << order;
+    km_count_alloc (1, bytes);
+    kmalloc_stats.large_allocation_cnt++;
+    kmalloc_stats.large_bytes += bytes;
+    if (kmalloc_stats.large_bytes > kmalloc_stats.large_peak_bytes)
     {
-        prev = next;
-        next = next->next;
+        kmalloc_stats.large_peak_bytes = kmalloc_stats.large_bytes;
     }
 
-    kernel_assert (prev->next == next, "km_insert(): mismatch prev/next (%x,%x)",
-                   (uintptr_t) prev->next, (uintptr_t) next);
-    kernel_assert (((uintptr_t) prev) + km_getsize (prev) <= (uintptr_t) block,
-                   "km_insert(): prev is not before block (%x,%x)", (uintptr_t) prev, (uintptr_t) block);
-    kernel_assert (next == NULL || ((uintptr_t) block) + km_getsize (block) <= (uintptr_t) next,
-                   "km_insert(): next is not after block (%x,%x)", (uintptr_t) block, (uintptr_t) next);
-
-    /* Insert block in between prev and next blocks in the free list. */
-    block->next = next;
-    prev->next = block;
-    km_coalesce (block);
-    km_coalesce (prev);
+    DEBUG ("Allocating Large Block [%x,%x]\n", (uintptr_t) ptr, ((uintptr_t) ptr) + bytes);
+    return ptr;
 }
 
-/* Creates a new block of 'size' bytes (including header) to add to kernel heap. Does not insert into
-   free list. To allocate a block to satisfy request, pass in 'reqsize + 16' to account for size of header.
-   Must be synchronized externally. */
-static km_block_header_t *km_extend (const size_t size)
+/* Gives a large block back to the page allocator. Must be synchronized externally. */
+static void km_large_free (void * const ptr)
 {
-    const size_t block_size = KMALLOC_ALIGN (size, KMALLOC_PAGESIZE);
-    const uint32_t block_begin = kheap_end;
-    kheap_end = kheap_end + block_size;
+    const size_t bytes = (size_t) PAGE_SIZE << page_getorder (ptr);
+    km_count_free (1, bytes);
+    kmalloc_stats.large_free_cnt++;
+    kmalloc_stats.large_bytes -= bytes;
+
+    km_poison (ptr, bytes);
+    page_free (ptr);
+    DEBUG ("Freeing Large Block [%x,%x]\n", (uintptr_t) ptr, ((uintptr_t) ptr) + bytes);
+}
 
-    /* We reached the limit of the safe memory region. Virtual memory will mitigate this issue. */
-    if (kheap_end > kheap_max_end)
+/* Resizes a large block. Shrinks in place while the request still takes the large block path, otherwise
+   the contents move to a new block. Must be synchronized externally. */
+static void *km_large_realloc (void * const ptr, const size_t size)
+{
+    const uint32_t order = page_getorder (ptr);
+    const uint32_t new_order = page_order (size);
+    if (size > KMALLOC_LARGE_THRESHOLD && new_order <= order)
     {
-        kernel_panic ("km_extend(): out of memory");
+        /* The pages given back count as freed, so allocated minus freed bytes stays what is in use. */
+        const size_t released = ((size_t) PAGE_SIZE << order) - ((size_t) PAGE_SIZE << new_order);
+        page_shrink (ptr, new_order);
+        km_count_free (0, released);
+        kmalloc_stats.large_bytes -= released;
+        return ptr;
     }
 
-    km_block_header_t * const block = (km_block_header_t *) block_begin;
-    km_initblock (block, block_size);
+    void * const new_ptr = _kmalloc_unsafe (size);
+    if (!new_ptr)
+    {
+        return NULL;
+    }
 
-    DEBUG ("Extending Heap [%x,%x]\n", (uintptr_t) block, ((uintptr_t) block) + km_getsize (block));
-    return block;
+    const size_t old_size = (size_t) PAGE_SIZE << order;
+    memcpy (new_ptr, ptr, (size < old_size) ? size : old_size);
+    km_large_free (ptr);
+    return new_ptr;
 }
 
 void kmalloc_init (const multiboot_info_t * const mbinfo)
@@ -229,57 +417,118 @@ void kmalloc_init (const multiboot_info_t * const mbinfo)
     /* Called during kernel init, interrupts must be off. */
     kernel_assert (!interrupt_is_enabled (), "kmalloc_init(): interrupts are enabled");
     kernel_assert (sizeof (km_block_header_t) == 16, "kmalloc_init(): km_block_header_t is not 16 bytes");
+    kernel_assert (sizeof (km_segment_t) == 16, "kmalloc_init(): km_segment_t is not 16 bytes");
 
     static bool init = false;
     kernel_assert (!init, "kmalloc_init(): already initialized");
     init = true;
 
-    kernel_assert (internal_read_multibootinfo (mbinfo), "kmalloc_init(): failed to read multiboot info");
-
-    kheap_begin = KMALLOC_ALIGN ((uintptr_t) &kernel_end, KMALLOC_PAGESIZE);
-    kheap_end = kheap_begin;
-    km_insert (km_extend (KMALLOC_HEAP_INIT_SIZE));
-    DEBUG ("Kernal Heap: [%x, %x] (MAX %x)\n", kheap_begin, kheap_end, kheap_max_end);
+    page_init (mbinfo);
+    kernel_assert (km_insert (km_extend (KMALLOC_HEAP_INIT_SIZE)), "kmalloc_init(): out of memory");
     mutex_init (&free_list_lock);
+    km_shrinker_init ();
 }
 
-/* Find first block to satisfy request size. Removes from the free list if found, otherwise extends. Must
-   be synchronized externally. */
-static km_block_header_t *km_find (const size_t size)
+/* Carves 'size' bytes off the front of a block in the free list and marks it allocated. The remainder,
+   if large enough to be split off, goes back to the free lists. Returns the carved off block. Must be
+   synchronized externally. */
+static km_block_header_t *km_carve (km_block_header_t * const block, const size_t size)
 {
-    km_block_header_t *prev = NULL;
-    km_block_header_t *cur = free_list;
-    while (cur && km_getsize (cur) < size)
+    km_list_remove (block);
+
+    /* Not enough extra space to justify split. */
+    if (km_getsize (block) < size + KMALLOC_MIN_BLOCK_SIZE)
     {
-        prev = cur;
-        cur = cur->next;
+        km_markalloc (block);
+        km_validate ();
+        return block;
     }
 
+    /* The remainder's neighbors are this (allocated) block and an allocated block, since free blocks
+       never touch, so it does not need to be coalesced. */
+    km_block_header_t * const split_block = (km_block_header_t *) (((uint8_t *) block) + size);
+    km_initblock (split_block, km_getsize (block) - size);
+    km_setfooter (split_block);
+    km_list_add (split_block);
+
+    km_setsize (block, size);
+    km_setalloc (block);
+    kmalloc_stats.split_cnt++;
+    km_validate ();
+
+    DEBUG ("New block at %x (%x,%x)\n", (uintptr_t) split_block, size, km_getsize (split_block));
+    return block;
+}
+
+/* Find a block to satisfy request size using the free block policy. Removes from the free list and marks
+   allocated if found, otherwise extends. Returns NULL if the heap could not be extended. Must be synchronized
+   externally. */
+static km_block_header_t *km_find (const size_t size)
+{
+    km_block_header_t *block = km_list_find (size);
+
     /* No valid block found, try to extend. */
-    if (!cur)
+    if (!block)
+    {
+        block = km_insert (km_extend (size));
+    }
+
+    return block ? km_carve (block, size) : NULL;
+}
+
+/* Find a block to satisfy request size with it's body aligned to 'align' (greater than
+   KMALLOC_ALIGNMENT) bytes. The slack before the aligned block is split off into the free lists. Removes
+   from the free list and marks allocated if found, otherwise extends. Returns NULL if the heap could not be
+   extended. Must be synchronized externally. */
+static km_block_header_t *km_find_aligned (const size_t size, const size_t align)
+{
+    /* Any block this large fits the aligned block after slack that is either empty or large enough to be
+       a free block itself. */
+    const size_t search_size = size + align + KMALLOC_MIN_BLOCK_SIZE;
+    km_block_header_t *block = km_list_find (search_size);
+    if (!block)
     {
-        return km_extend (size);
+        block = km_insert (km_extend (search_size));
+    }
+    if (!block)
+    {
+        return NULL;
     }
 
-    /* Remove from free list. */
-    if (!prev)
+    uintptr_t body = KMALLOC_ALIGN ((uintptr_t) (block + 1), align);
+    const size_t lead = body - sizeof (km_block_header_t) - (uintptr_t) block;
+    if (lead != 0 && lead < KMALLOC_MIN_BLOCK_SIZE)
     {
-        free_list = cur->next;
+        body += align;
     }
-    else
+
+    km_block_header_t * const aligned = ((km_block_header_t *) body) - 1;
+    if (aligned != block)
     {
-        prev->next = cur->next;
+        /* The slack keeps the front of the block, the aligned block gets the rest. Neither has a free
+           neighbor so they go straight back into the free lists. */
+        const size_t size_before = km_getsize (block);
+        km_list_remove (block);
+        km_setsize (block, (uintptr_t) aligned - (uintptr_t) block);
+        km_initblock (aligned, size_before - km_getsize (block));
+        km_markfree (block);
+        km_list_add (block);
+
+        km_setfooter (aligned);
+        km_list_add (aligned);
+        kmalloc_stats.split_cnt++;
+        DEBUG ("Aligned block at %x, slack %x\n", (uintptr_t) aligned, km_getsize (block));
     }
-    cur->next = NULL;
-    return cur;
+
+    return km_carve (aligned, size);
 }
 
-/* Splits an unallocated block into two parts, returns the portion of 'size' bytes. Must be
-   externally. */
+/* Splits an allocated block into two parts, returns the portion of 'size' bytes. The rest is freed. Must
+   be synchronized externally. */
 static km_block_header_t *km_split (km_block_header_t * const block, const size_t size)
 {
     /* Not enough extra space to justify split. */
-    if (km_getsize (block) < size + KMALLOC_MAX_INTERNAL_FRAG)
+    if (km_getsize (block) < size + KMALLOC_MIN_BLOCK_SIZE)
     {
         return block;
     }
@@ -287,71 +536,404 @@ static km_block_header_t *km_split (km_block_header_t * const block, const size_
     /* Initialize new block header. */
     km_block_header_t * const split_block = (km_block_header_t *) (((uint8_t *) block) + size);
     km_initblock (split_block, km_getsize (block) - size);
-    km_insert (split_block);
 
     /* Update size of original block. */
     km_setsize (block, size);
+    km_insert (split_block);
+    kmalloc_stats.split_cnt++;
 
     DEBUG ("New block at %x (%x,%x)\n", (uintptr_t) split_block, size, km_getsize (split_block));
     return block;
 }
 
+/* Add the cycles since 'start' to a latency histogram. Synchronized internally. */
+static inline void km_record_cycles (uint32_t * const histogram, const uint64_t start)
+{
+    const uint64_t elapsed = cpu_rdtsc () - start;
+    const uint32_t cycles = (elapsed > UINT32_MAX) ? UINT32_MAX : (uint32_t) elapsed;
+
+    /* Bucket i counts operations that took less than (32 << i) cycles. */
+    int bucket = (cycles < 32) ? 0 : 31 - __builtin_clz (cycles) - 4;
+    bucket = (bucket < KMALLOC_CYCLE_BUCKETS) ? bucket : KMALLOC_CYCLE_BUCKETS - 1;
+
+    const bool interrupts = interrupt_disable ();
+    histogram[bucket]++;
+    interrupt_restore (interrupts);
+}
+
+/* Get the magazine class of a block or request of 'size' bytes (including header), or -1 if it is too
+   large for a magazine. */
+static inline int km_magazine_class (const size_t size)
+{
+    const size_t class = (size - KMALLOC_MIN_BLOCK_SIZE) / KMALLOC_ALIGNMENT;
+    return (class < KMALLOC_MAGAZINE_CLASSES) ? (int) class : -1;
+}
+
+/* Get the current thread's magazines, or NULL if they can not be used. Interrupt handlers and code running
+   with interrupts disabled go straight to the heap, so a thread's magazines are only ever touched by that
+   thread (or by clean up once it is a zombie). */
+static inline struct KMMagazines *km_magazines (void)
+{
+    return (current_thread && interrupt_is_enabled ()) ? &current_thread->kmalloc_magazines : NULL;
+}
+
+/* Return the oldest 'cnt' blocks of a magazine to the heap. Must be synchronized externally. */
+static void km_magazine_drain (struct KMMagazines * const magazines, const int class, const uint32_t cnt)
+{
+    void ** const blocks = magazines->blocks[class];
+    for (uint32_t i = 0; i < cnt; i++)
+    {
+        km_setcached (blocks[i], false);
+        km_insert (blocks[i]);
+    }
+
+    for (uint32_t i = cnt; i < magazines->cnt[class]; i++)
+    {
+        blocks[i - cnt] = blocks[i];
+    }
+    magazines->cnt[class] -= cnt;
+}
+
+/* Pop a block for a request of 'size' bytes (including header) from the current thread's magazine,
+   refilling it from the heap if it is empty. Returns NULL if magazines can not be used. */
+static km_block_header_t *km_magazine_alloc (const size_t size)
+{
+    struct KMMagazines * const magazines = km_magazines ();
+    const int class = km_magazine_class (size);
+    if (!magazines || class < 0)
+    {
+        return NULL;
+    }
+
+    void ** const blocks = magazines->blocks[class];
+    const bool refill = magazines->cnt[class] == 0;
+    if (refill)
+    {
+        /* The block the heap finds first ends up on top. The heap may run out part way, then the magazine
+           takes what was found. */
+        mutex_acquire (&free_list_lock);
+        uint32_t cnt = 0;
+        for (uint32_t i = KMALLOC_MAGAZINE_SIZE / 2; i > 0; i--, cnt++)
+        {
+            km_block_header_t * const block = km_find (size);
+            if (!block)
+            {
+                break;
+            }
+            km_setcached (block, true);
+            blocks[i - 1] = block;
+        }
+        for (uint32_t i = 0; i < cnt; i++)
+        {
+            blocks[i] = blocks[KMALLOC_MAGAZINE_SIZE / 2 - cnt + i];
+        }
+        magazines->cnt[class] = cnt;
+        kmalloc_stats.magazine_refills++;
+        mutex_release (&free_list_lock);
+
+        /* Left to the heap path, which runs the shrinkers. */
+        if (cnt == 0)
+        {
+            return NULL;
+        }
+    }
+
+    km_block_header_t * const block = blocks[--magazines->cnt[class]];
+    km_setcached (block, false);
+
+    const bool interrupts = interrupt_disable ();
+    kmalloc_stats.magazine_hits += refill ? 0 : 1;
+    interrupt_restore (interrupts);
+    km_count_alloc (1, km_getsize (block));
+    return block;
+}
+
+/* Push an allocated block onto the current thread's magazine, draining half of it to the heap if it is
+   full. Returns false if magazines can not be used. */
+static bool km_magazine_free (km_block_header_t * const block)
+{
+    struct KMMagazines * const magazines = km_magazines ();
+    const int class = km_magazine_class (km_getsize (block));
+    if (!magazines || class < 0)
+    {
+        return false;
+    }
+
+    if (magazines->cnt[class] == KMALLOC_MAGAZINE_SIZE)
+    {
+        mutex_acquire (&free_list_lock);
+        km_magazine_drain (magazines, class, KMALLOC_MAGAZINE_SIZE / 2);
+        kmalloc_stats.magazine_drains++;
+        mutex_release (&free_list_lock);
+    }
+
+    km_redzone_check (block);
+    km_poison (block + 1, km_getsize (block) - sizeof (km_block_header_t));
+    km_setcached (block, true);
+    magazines->blocks[class][magazines->cnt[class]++] = block;
+
+    km_count_free (1, km_getsize (block));
+    return true;
+}
+
+void kmalloc_magazines_flush (struct KMMagazines * const magazines)
+{
+    mutex_acquire (&free_list_lock);
+    for (int class = 0; class < KMALLOC_MAGAZINE_CLASSES; class++)
+    {
+        km_magazine_drain (magazines, class, magazines->cnt[class]);
+    }
+    mutex_release (&free_list_lock);
+}
+
+size_t km_magazines_shrink (void * const arg)
+{
+    (void) arg;
+
+    struct KMMagazines * const magazines = km_magazines ();
+    if (!magazines)
+    {
+        return 0;
+    }
+
+    size_t bytes = 0;
+    for (int class = 0; class < KMALLOC_MAGAZINE_CLASSES; class++)
+    {
+        for (uint32_t i = 0; i < magazines->cnt[class]; i++)
+        {
+            bytes += km_getsize (magazines->blocks[class][i]);
+        }
+    }
+
+    kmalloc_magazines_flush (magazines);
+    return bytes;
+}
+
 // #define mutex_acquire(d) ;
 // #define mutex_release(d) ;
 
 void *kmalloc (const size_t size)
 {
-    unsafe_printf ("ALLOCATING\n");
+    const uint64_t start = cpu_rdtsc ();
+
+    /* Small requests come from the thread's magazine without the lock. */
+    km_block_header_t * const block = km_magazine_alloc (km_target_size (size));
+    if (block)
+    {
+        km_redzone_set (block, size);
+        km_record_cycles (kmalloc_stats.alloc_cycles, start);
+        KM_TRACE (KMALLOC_TRACE_ALLOC, __builtin_return_address (0), block + 1, size);
+        return (void *) (block + 1);
+    }
+
     mutex_acquire (&free_list_lock);
-    void * const ptr = _kmalloc_unsafe (size);
+    void *ptr = _kmalloc_unsafe (size);
     mutex_release (&free_list_lock);
+
+    /* Out of pages, try once more if the shrinkers gave memory back. */
+    if (!ptr && kmalloc_shrink ())
+    {
+        mutex_acquire (&free_list_lock);
+        ptr = _kmalloc_unsafe (size);
+        mutex_release (&free_list_lock);
+    }
+
+    km_record_cycles (kmalloc_stats.alloc_cycles, start);
+    KM_TRACE (KMALLOC_TRACE_ALLOC, __builtin_return_address (0), ptr, size);
     return ptr;
 }
 
 void *_kmalloc_unsafe (const size_t size)
 {
-    const size_t target_size = KMALLOC_ALIGN (size + sizeof (km_block_header_t), KMALLOC_ALIGNMENT);
-    km_block_header_t *block = km_find (target_size);
+    if (size > KMALLOC_LARGE_THRESHOLD)
+    {
+        return km_large_alloc (size, PAGE_SIZE);
+    }
+
+    const size_t target_size = km_target_size (size);
+    km_block_header_t * const block = km_find (target_size);
     if (!block)
     {
         return NULL;
     }
 
-    block = km_split (block, target_size);
-    km_setalloc (block);
-    kmalloc_stats.allocation_cnt++;
-    kmalloc_stats.allocation_bytes += km_getsize (block);
+    km_count_alloc (1, km_getsize (block));
+    km_redzone_set (block, size);
 
     DEBUG ("Allocating Block [%x,%x]\n", (uintptr_t) block, ((uintptr_t) block) + km_getsize (block));
     return (void *) (block + 1);
 }
 
+void km_lock (void)
+{
+    mutex_acquire (&free_list_lock);
+}
+
+void km_unlock (void)
+{
+    mutex_release (&free_list_lock);
+}
+
+void *km_alloc_block (const size_t size)
+{
+    mutex_acquire (&free_list_lock);
+    void * const ptr = _kmalloc_unsafe (size);
+    mutex_release (&free_list_lock);
+    return ptr;
+}
+
+/* kmalloc_aligned() on behalf of 'caller', so kpage_alloc() traces it's own caller. */
+static void *km_alloc_aligned (const size_t size, const size_t align, const void * const caller)
+{
+    const uint64_t start = cpu_rdtsc ();
+
+    mutex_acquire (&free_list_lock);
+    void *ptr = _kmalloc_aligned_unsafe (size, align);
+    mutex_release (&free_list_lock);
+
+    if (!ptr && kmalloc_shrink ())
+    {
+        mutex_acquire (&free_list_lock);
+        ptr = _kmalloc_aligned_unsafe (size, align);
+        mutex_release (&free_list_lock);
+    }
+
+    km_record_cycles (kmalloc_stats.alloc_cycles, start);
+    KM_TRACE (KMALLOC_TRACE_ALLOC, caller, ptr, size);
+    return ptr;
+}
+
+void *kmalloc_aligned (const size_t size, const size_t align)
+{
+    return km_alloc_aligned (size, align, __builtin_return_address (0));
+}
+
+void *_kmalloc_aligned_unsafe (const size_t size, const size_t align)
+{
+    kernel_assert (align && (align & (align - 1)) == 0, "kmalloc_aligned(): alignment %u is not a power of 2",
+                   align);
+
+    /* Page aligned requests would leave a page of slack in the heap. */
+    if (size > KMALLOC_LARGE_THRESHOLD || align >= PAGE_SIZE)
+    {
+        return km_large_alloc (size, align);
+    }
+
+    /* Every block is already aligned this much. */
+    if (align <= KMALLOC_ALIGNMENT)
+    {
+        return _kmalloc_unsafe (size);
+    }
+
+    km_block_header_t * const block = km_find_aligned (km_target_size (size), align);
+    if (!block)
+    {
+        return NULL;
+    }
+
+    km_count_alloc (1, km_getsize (block));
+    km_redzone_set (block, size);
+
+    DEBUG ("Allocating Aligned Block [%x,%x]\n", (uintptr_t) block, ((uintptr_t) block) + km_getsize (block));
+    return (void *) (block + 1);
+}
+
+void *kpage_alloc (const size_t size)
+{
+    return km_alloc_aligned (KMALLOC_ALIGN (size, PAGE_SIZE), PAGE_SIZE, __builtin_return_address (0));
+}
+
+void *_kpage_alloc_unsafe (const size_t size)
+{
+    return _kmalloc_aligned_unsafe (KMALLOC_ALIGN (size, PAGE_SIZE), PAGE_SIZE);
+}
+
 void *kcalloc (const size_t nelems, const size_t elemsize)
 {
-    unsafe_printf ("CALLOCATING\n");
+    const uint64_t start = cpu_rdtsc ();
+
+    /* Small requests come from the thread's magazine without the lock. */
+    const size_t bytes = nelems * elemsize;
+    km_block_header_t * const block = km_magazine_alloc (km_target_size (bytes));
+    if (block)
+    {
+        km_zero (block + 1, bytes);
+        km_redzone_set (block, bytes);
+        km_record_cycles (kmalloc_stats.alloc_cycles, start);
+        KM_TRACE (KMALLOC_TRACE_ALLOC, __builtin_return_address (0), block + 1, bytes);
+        return (void *) (block + 1);
+    }
+
     mutex_acquire (&free_list_lock);
-    void * const ptr = _kcalloc_unsafe (nelems, elemsize);
+    void *ptr = _kcalloc_unsafe (nelems, elemsize);
     mutex_release (&free_list_lock);
+
+    if (!ptr && kmalloc_shrink ())
+    {
+        mutex_acquire (&free_list_lock);
+        ptr = _kcalloc_unsafe (nelems, elemsize);
+        mutex_release (&free_list_lock);
+    }
+
+    km_record_cycles (kmalloc_stats.alloc_cycles, start);
+    KM_TRACE (KMALLOC_TRACE_ALLOC, __builtin_return_address (0), ptr, bytes);
     return ptr;
 }
 
 void *_kcalloc_unsafe (const size_t nelems, const size_t elemsize)
 {
     const size_t bytes = nelems * elemsize;
-    uint8_t *mem = (uint8_t *) _kmalloc_unsafe (bytes);
-    for (size_t i = 0; i < bytes; i++)
+
+    /* Blocks zeroed ahead of time by the fill thread, cut down to size. The block was counted as allocated in
+       full when the pool was filled, so the tail given back counts as freed. */
+    km_block_header_t * const block = km_zeroed_take (bytes);
+    if (block)
+    {
+        const size_t pooled_size = km_getsize (block);
+        km_split (block, km_target_size (bytes));
+        km_count_free (0, pooled_size - km_getsize (block));
+        km_redzone_set (block, bytes);
+        DEBUG ("Allocating Zeroed Block [%x,%x]\n", (uintptr_t) block, ((uintptr_t) block) + km_getsize (block));
+        return (void *) (block + 1);
+    }
+
+    void * const mem = _kmalloc_unsafe (bytes);
+    if (mem)
     {
-        mem[i] = 0;
+        km_zero (mem, bytes);
     }
 
-    return (void *) mem;
+    return mem;
 }
 
 void *krealloc (void * const ptr, const size_t size)
 {
+    const uint64_t start = cpu_rdtsc ();
+    const size_t old_size = ptr ? km_bodysize (ptr) : 0;
+
     mutex_acquire (&free_list_lock);
-    void * const new_ptr = _krealloc_unsafe (ptr, size);
+    void *new_ptr = _krealloc_unsafe (ptr, size);
     mutex_release (&free_list_lock);
+
+    /* On failure the old block is left alone, so it can be tried again. */
+    if (!new_ptr && size != 0 && kmalloc_shrink ())
+    {
+        mutex_acquire (&free_list_lock);
+        new_ptr = _krealloc_unsafe (ptr, size);
+        mutex_release (&free_list_lock);
+    }
+
+    km_record_cycles (kmalloc_stats.realloc_cycles, start);
+
+    /* Traced as freeing the old block and allocating the new one, even if it did not move. */
+    if (ptr)
+    {
+        KM_TRACE (KMALLOC_TRACE_FREE, __builtin_return_address (0), ptr, old_size);
+    }
+    if (new_ptr)
+    {
+        KM_TRACE (KMALLOC_TRACE_ALLOC, __builtin_return_address (0), new_ptr, size);
+    }
     return new_ptr;
 }
 
@@ -369,48 +951,44 @@ void *_krealloc_unsafe (void * const ptr, const size_t size)
         _kfree_unsafe (ptr);
         return NULL;
     }
+    else if (km_islarge (ptr))
+    {
+        return km_large_realloc (ptr, size);
+    }
 
-    const size_t target_size = KMALLOC_ALIGN (size + sizeof (km_block_header_t), KMALLOC_ALIGNMENT);
+    const size_t target_size = km_target_size (size);
     km_block_header_t * const block = ((km_block_header_t *) ptr) - 1;
 
-    kernel_assert (km_checkmagic (block), "krealloc() - Bad pointer.");
-    kernel_assert (km_isalloc (block), "krealloc() - Unallocated memory.");
+    KM_CHECK (km_checkmagic (block), "krealloc() - Bad pointer.");
+    KM_CHECK (km_isalloc (block) && !km_iscached (block), "krealloc() - Unallocated memory.");
+    km_redzone_check (block);
 
     /* Check if the original block is large enough. */
     if (km_getsize (block) >= target_size)
     {
         DEBUG ("Reallocating to the same block.\n");
         km_block_header_t * const new_block = km_split (block, target_size);
+        km_redzone_set (new_block, size);
         return (void *) (new_block + 1);
     }
 
-    /* Find adjacent block in memory. */
-    km_block_header_t * const next_block = (km_block_header_t *) (((uintptr_t) block) + km_getsize (block));
-    if ((uintptr_t) next_block < kheap_end && !km_isalloc (next_block) &&
-        km_getsize (block) + km_getsize (next_block) >= target_size)
+    /* Find adjacent block in memory. The epilogue guarantees there is one. Large requests move to the large
+       block path instead. */
+    km_block_header_t * const next_block = km_nextblock (block);
+    if (size <= KMALLOC_LARGE_THRESHOLD && !km_isalloc (next_block)
+        && km_getsize (block) + km_getsize (next_block) >= target_size)
     {
         DEBUG ("Resizing block to include adjacent block.\n");
-        kernel_assert (km_checkmagic (next_block), "krealloc() - Next block corrupted.");
+        KM_CHECK (km_checkmagic (next_block), "krealloc() - Next block corrupted.");
 
-        if (free_list == next_block)
-        {
-            free_list = next_block->next;
-        }
-        else
-        {
-            km_block_header_t *cur = free_list;
-            while (cur && cur->next != next_block)
-            {
-                cur = cur->next;
-            }
-            kernel_assert (cur, "krealloc() - Next block is unallocated but not in free list.");
-
-            cur->next = next_block->next;
-            // TODO: should purposefully corrupt the magic number of all the block headers that are deallocated.
-        }
+        km_list_remove (next_block);
+        kmalloc_stats.coalesce_cnt++;
+        // TODO: should purposefully corrupt the magic number of all the block headers that are deallocated.
 
         km_setsize (block, km_getsize (block) + km_getsize (next_block));
+        km_setprevalloc (km_nextblock (block), true);
         km_split (block, target_size);
+        km_redzone_set (block, size);
         return (void *) (block + 1);
     }
 
@@ -422,7 +1000,8 @@ void *_krealloc_unsafe (void * const ptr, const size_t size)
     }
 
     /* Copy over data to new memory block. */
-    for (size_t i = 0; i < km_getsize (block) - sizeof (km_block_header_t); i++)
+    const size_t old_size = km_getsize (block) - sizeof (km_block_header_t);
+    for (size_t i = 0; i < old_size && i < size; i++)
     {
         new_ptr[i] = ((uint8_t *) ptr)[i];
     }
@@ -432,9 +1011,32 @@ void *_krealloc_unsafe (void * const ptr, const size_t size)
 
 void kfree (void * const ptr)
 {
+    if (!ptr)
+    {
+        return;
+    }
+
+    /* Large blocks have no header. */
+    const bool large = km_islarge (ptr);
+    km_block_header_t * const block = ((km_block_header_t *) ptr) - 1;
+    KM_CHECK (large || km_checkmagic (block), "kfree() - Bad pointer.");
+    KM_CHECK (large || (km_isalloc (block) && !km_iscached (block)), "kfree() - Unallocated memory.");
+
+    KM_TRACE (KMALLOC_TRACE_FREE, __builtin_return_address (0), ptr, km_bodysize (ptr));
+
+    /* Small blocks go to the thread's magazine without the lock. */
+    const uint64_t start = cpu_rdtsc ();
+    if (!large && km_magazine_free (block))
+    {
+        km_record_cycles (kmalloc_stats.free_cycles, start);
+        return;
+    }
+
     mutex_acquire (&free_list_lock);
     _kfree_unsafe (ptr);
     mutex_release (&free_list_lock);
+
+    km_record_cycles (kmalloc_stats.free_cycles, start);
 }
 
 void _kfree_unsafe (void * const ptr)
@@ -443,39 +1045,256 @@ void _kfree_unsafe (void * const ptr)
     {
         return;
     }
+    else if (km_islarge (ptr))
+    {
+        km_large_free (ptr);
+        return;
+    }
 
     km_block_header_t * const block = ((km_block_header_t *) ptr) - 1;
-    kernel_assert (km_checkmagic (block), "kfree() - Bad pointer.");
-    kernel_assert (km_isalloc (block), "kfree() - Unallocated memory.");
+    KM_CHECK (km_checkmagic (block), "kfree() - Bad pointer.");
+    KM_CHECK (km_isalloc (block) && !km_iscached (block), "kfree() - Unallocated memory.");
 
-    kmalloc_stats.free_bytes += km_getsize (block);
-    kmalloc_stats.free_cnt++;
+    km_redzone_check (block);
+    km_poison (block + 1, km_getsize (block) - sizeof (km_block_header_t));
 
-    km_clearalloc (block);
-    km_insert (block);
+    km_count_free (1, km_getsize (block));
+    km_release (block);
 }
 
-void kmalloc_printdebug (void)
+bool kmalloc_bulk (const size_t size, const size_t cnt, void ** const ptrs)
 {
+    const uint64_t start = cpu_rdtsc ();
+
     mutex_acquire (&free_list_lock);
-    DEBUG ("Kernel Heap: %u Allocations, %u Releases\n",
-                      kmalloc_stats.allocation_cnt, kmalloc_stats.free_cnt);
+    bool allocated = _kmalloc_bulk_unsafe (size, cnt, ptrs);
+    mutex_release (&free_list_lock);
+
+    if (!allocated && kmalloc_shrink ())
+    {
+        mutex_acquire (&free_list_lock);
+        allocated = _kmalloc_bulk_unsafe (size, cnt, ptrs);
+        mutex_release (&free_list_lock);
+    }
 
-    DEBUG ("> Total Allocated Bytes: %u\n> Total Freed Bytes: %u\n",
-                      kmalloc_stats.allocation_bytes, kmalloc_stats.free_bytes);
+    km_record_cycles (kmalloc_stats.alloc_cycles, start);
+    for (size_t i = 0; allocated && i < cnt; i++)
+    {
+        KM_TRACE (KMALLOC_TRACE_ALLOC, __builtin_return_address (0), ptrs[i], size);
+    }
+    return allocated;
+}
+
+bool _kmalloc_bulk_unsafe (const size_t size, const size_t cnt, void ** const ptrs)
+{
+    if (cnt == 0)
+    {
+        return true;
+    }
+
+    const size_t target_size = km_target_size (size);
+    kernel_assert (cnt <= UINT32_MAX / target_size, "kmalloc_bulk(): %u blocks of %u bytes is too large", cnt,
+                   size);
+
+    /* One free block large enough for every object is carved into consecutive blocks. The last one keeps
+       whatever km_carve() did not split off. */
+    km_block_header_t *run = (size <= KMALLOC_LARGE_THRESHOLD) ? km_list_find (target_size * cnt) : NULL;
+    if (run)
+    {
+        run = km_carve (run, target_size * cnt);
+        const size_t run_size = km_getsize (run);
+        for (size_t i = 0; i < cnt; i++)
+        {
+            km_block_header_t * const block = (km_block_header_t *) (((uint8_t *) run) + i * target_size);
+            km_initblock (block, (i == cnt - 1) ? run_size - i * target_size : target_size);
+            km_setalloc (block);
+            km_redzone_set (block, size);
+            ptrs[i] = block + 1;
+        }
+
+        km_count_alloc (cnt, run_size);
+        kmalloc_stats.bulk_run_cnt++;
+        DEBUG ("Allocating Bulk Run [%x,%x]\n", (uintptr_t) run, ((uintptr_t) run) + run_size);
+        return true;
+    }
 
-    const km_block_header_t *cur = free_list;
-    while (cur)
+    /* The heap is too fragmented for one run, fall back to a block at a time. Large blocks always come from the
+       page allocator one at a time. */
+    for (size_t i = 0; i < cnt; i++)
     {
-        DEBUG ("> [%x,%x]\n", (uintptr_t) cur, ((uintptr_t) cur) + km_getsize (cur));
-        DEBUG ("\t> Allocated:%b, Valid Magic: %b, Size: %x\n",
-              km_isalloc (cur), km_checkmagic (cur), km_getsize (cur));
-        cur = cur->next;
+        ptrs[i] = _kmalloc_unsafe (size);
+        if (!ptrs[i])
+        {
+            _kfree_bulk_unsafe (ptrs, i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void kfree_bulk (void ** const ptrs, const size_t cnt)
+{
+    const uint64_t start = cpu_rdtsc ();
+    for (size_t i = 0; i < cnt; i++)
+    {
+        if (ptrs[i])
+        {
+            KM_CHECK (km_islarge (ptrs[i]) || km_checkmagic (((km_block_header_t *) ptrs[i]) - 1),
+                      "kfree_bulk() - Bad pointer.");
+            KM_TRACE (KMALLOC_TRACE_FREE, __builtin_return_address (0), ptrs[i], km_bodysize (ptrs[i]));
+        }
+    }
+
+    mutex_acquire (&free_list_lock);
+    _kfree_bulk_unsafe (ptrs, cnt);
+    mutex_release (&free_list_lock);
+
+    km_record_cycles (kmalloc_stats.free_cycles, start);
+}
+
+void _kfree_bulk_unsafe (void ** const ptrs, const size_t cnt)
+{
+    /* Large blocks go straight back to the page allocator. */
+    for (size_t i = 0; i < cnt; i++)
+    {
+        if (ptrs[i] && km_islarge (ptrs[i]))
+        {
+            km_large_free (ptrs[i]);
+            ptrs[i] = NULL;
+        }
+    }
+
+    /* Sort by address, an insertion sort since blocks from kmalloc_bulk() are usually in order already. */
+    for (size_t i = 1; i < cnt; i++)
+    {
+        void * const ptr = ptrs[i];
+        size_t j = i;
+        while (j > 0 && (uintptr_t) ptrs[j - 1] > (uintptr_t) ptr)
+        {
+            ptrs[j] = ptrs[j - 1];
+            j--;
+        }
+        ptrs[j] = ptr;
+    }
+
+    size_t i = 0;
+    while (i < cnt && !ptrs[i])
+    {
+        i++;
+    }
+
+    while (i < cnt)
+    {
+        km_block_header_t * const run = ((km_block_header_t *) ptrs[i]) - 1;
+        KM_CHECK (km_checkmagic (run), "kfree_bulk() - Bad pointer.");
+        KM_CHECK (km_isalloc (run) && !km_iscached (run), "kfree_bulk() - Unallocated memory.");
+        km_redzone_check (run);
+
+        /* Physically adjacent blocks are merged here, so the run is added to the free lists once. */
+        size_t run_size = km_getsize (run);
+        uint32_t run_cnt = 1;
+        for (i++; i < cnt && ptrs[i] == (void *) (km_nextblock (run) + 1); i++)
+        {
+            const km_block_header_t * const block = ((km_block_header_t *) ptrs[i]) - 1;
+            KM_CHECK (km_checkmagic (block), "kfree_bulk() - Bad pointer.");
+            KM_CHECK (km_isalloc (block) && !km_iscached (block), "kfree_bulk() - Unallocated memory.");
+            km_redzone_check (block);
+            run_size += km_getsize (block);
+            km_setsize (run, run_size);
+            run_cnt++;
+        }
+        KM_CHECK (i == cnt || ptrs[i] != ptrs[i - 1], "kfree_bulk() - Pointer passed twice.");
+        km_poison (run + 1, run_size - sizeof (km_block_header_t));
+
+        km_count_free (run_cnt, run_size);
+        km_release (run);
+    }
+}
+
+size_t kmalloc_trim (void)
+{
+    mutex_acquire (&free_list_lock);
+    const size_t released = km_trim_all (0);
+    mutex_release (&free_list_lock);
+    return released;
+}
+
+/* Print a latency histogram as one dump line. */
+static void km_dump_cycles (const char * const op, const uint32_t * const histogram)
+{
+    printf ("kmalloc_cycles op=%s", op);
+    for (int i = 0; i < KMALLOC_CYCLE_BUCKETS; i++)
+    {
+        printf (" %u", histogram[i]);
+    }
+    printf ("\n");
+}
+
+void kmalloc_dump (const bool blocks)
+{
+    const struct KMStats stats = kmalloc_getstats ();
+
+    printf ("kmalloc policy=%s hardening=%s allocation_cnt=%u allocation_bytes=%u free_cnt=%u free_bytes=%u\n",
+            KMALLOC_POLICY_NAME, KMALLOC_HARDENING_NAME, stats.allocation_cnt, stats.allocation_bytes, stats.free_cnt, stats.free_bytes);
+    printf ("kmalloc_heap heap_bytes=%u heap_peak_bytes=%u trimmed_bytes=%u free_block_cnt=%u "
+            "free_block_bytes=%u largest_free_block=%u fragmentation=%u split_cnt=%u coalesce_cnt=%u\n",
+            stats.heap_bytes, stats.heap_peak_bytes, stats.trimmed_bytes, stats.free_block_cnt,
+            stats.free_block_bytes, stats.largest_free_block, stats.fragmentation, stats.split_cnt,
+            stats.coalesce_cnt);
+    printf ("kmalloc_magazines hits=%u refills=%u drains=%u\n", stats.magazine_hits, stats.magazine_refills,
+            stats.magazine_drains);
+    printf ("kmalloc_atomic allocation_cnt=%u failed_cnt=%u free_cnt=%u refill_cnt=%u\n",
+            stats.atomic_allocation_cnt, stats.atomic_failed_cnt, stats.atomic_free_cnt, stats.atomic_refill_cnt);
+    printf ("kmalloc_zeroed hits=%u misses=%u fill_cnt=%u\n", stats.zeroed_hits, stats.zeroed_misses,
+            stats.zeroed_fill_cnt);
+    printf ("kmalloc_bulk run_cnt=%u\n", stats.bulk_run_cnt);
+    printf ("kmalloc_large allocation_cnt=%u free_cnt=%u bytes=%u peak_bytes=%u\n", stats.large_allocation_cnt,
+            stats.large_free_cnt, stats.large_bytes, stats.large_peak_bytes);
+    printf ("kmalloc_shrink shrink_cnt=%u shrink_bytes=%u\n", stats.shrink_cnt, stats.shrink_bytes);
+    km_shrinker_dump ();
+
+#ifdef KMALLOC_POLICY_FIRSTFIT
+    for (int i = 0; i < KMALLOC_BIN_COUNT; i++)
+    {
+        printf ("kmalloc_bin bin=%u max_size=%u hits=%u misses=%u\n", i, KMALLOC_BIN_MIN << i,
+                stats.bin_hits[i], stats.bin_misses[i]);
+    }
+#endif
+
+    km_dump_cycles ("alloc", stats.alloc_cycles);
+    km_dump_cycles ("free", stats.free_cycles);
+    km_dump_cycles ("realloc", stats.realloc_cycles);
+
+    /* Walk each segment physically, the epilogue has size 0. */
+    mutex_acquire (&free_list_lock);
+    for (const km_segment_t *segment = kheap_segments; segment; segment = segment->next)
+    {
+        printf ("kmalloc_segment addr=%x size=%x\n", (uintptr_t) segment, segment->size);
+        const km_block_header_t *cur = (const km_block_header_t *) (segment + 1);
+        while (blocks && km_getsize (cur))
+        {
+            printf ("kmalloc_block addr=%x size=%x alloc=%u cached=%u magic=%u\n", (uintptr_t) cur,
+                    km_getsize (cur), km_isalloc (cur), km_iscached (cur), km_checkmagic (cur));
+            cur = km_nextblock (cur);
+        }
     }
     mutex_release (&free_list_lock);
 }
 
 struct KMStats kmalloc_getstats (void)
 {
-    return kmalloc_stats;
+    mutex_acquire (&free_list_lock);
+    const bool interrupts = interrupt_disable ();
+    struct KMStats stats = kmalloc_stats;
+    interrupt_restore (interrupts);
+
+    /* The policies keep the free block count and bytes up to date. The largest block is looked up in their
+       index, which is why the lock is needed. */
+    stats.largest_free_block = km_list_largest ();
+    mutex_release (&free_list_lock);
+
+    stats.fragmentation = stats.free_block_bytes
+        ? 1000 - (uint32_t) (((uint64_t) stats.largest_free_block * 1000) / stats.free_block_bytes) : 0;
+    return stats;
 }
\ No newline at end of file
@@ -0,0 +1,202 @@
+/* Interrupt context allocation. kmalloc_atomic() and kfree_atomic() never take free_list_lock, they only
+   disable interrupts while touching a pool of blocks reserved from the kernel heap in advance. A background
+   thread tops the pool up and kfree()s blocks the pool has no room for. */
+
+#include "alienos/mem/kmalloc_internal.h"
+#include "alienos/kernel/kernel.h"
+#include "alienos/kernel/thread.h"
+#include "alienos/kernel/synch.h"
+#include "alienos/io/interrupt.h"
+
+/* Body size of the blocks in pool class i. */
+#define KMALLOC_ATOMIC_CLASS_SIZE(i) (64u << (2 * (i)))
+
+/* Reserved blocks of each class. */
+static void *atomic_pool[KMALLOC_ATOMIC_CLASSES][KMALLOC_ATOMIC_POOL_SIZE];
+static uint32_t atomic_pool_cnt[KMALLOC_ATOMIC_CLASSES] = {0};
+
+/* Singly linked list of blocks freed by kfree_atomic() that did not fit back in the pool, see
+   kmalloc_atomic_setlink(). */
+static void *atomic_deferred = NULL;
+
+/* Refill thread waits on this. */
+static semaphore_t atomic_refill_sem;
+static bool atomic_refill_pending = false;
+static thread_t *atomic_refill_thread = NULL;
+
+/* Set the deferred list link of a block. Heap blocks keep it in their header's list link, which is unused
+   while they are allocated, so the body and it's redzone are left for kfree() to check. Large blocks have no
+   header and keep it in their body. */
+static inline void kmalloc_atomic_setlink (void * const ptr, void * const next)
+{
+    if (km_islarge (ptr))
+    {
+        *((void **) ptr) = next;
+    }
+    else
+    {
+        (((km_block_header_t *) ptr) - 1)->next = next;
+    }
+}
+
+/* Get the deferred list link of a block. */
+static inline void *kmalloc_atomic_getlink (void * const ptr)
+{
+    return km_islarge (ptr) ? *((void **) ptr) : (void *) (((km_block_header_t *) ptr) - 1)->next;
+}
+
+/* Wake up the refill thread if it is not already woken. Interrupts must be disabled. */
+static void kmalloc_atomic_wake (void)
+{
+    if (atomic_refill_thread && !atomic_refill_pending)
+    {
+        atomic_refill_pending = true;
+        semaphore_up (&atomic_refill_sem);
+    }
+}
+
+/* Fill every pool class up with blocks from the kernel heap. Blocks are allocated with interrupts enabled
+   and only pushed with them disabled. */
+static void kmalloc_atomic_topup (void)
+{
+    for (uint32_t class = 0; class < KMALLOC_ATOMIC_CLASSES; class++)
+    {
+        while (atomic_pool_cnt[class] < KMALLOC_ATOMIC_POOL_SIZE)
+        {
+            void *block = kmalloc (KMALLOC_ATOMIC_CLASS_SIZE (class));
+            if (!block)
+            {
+                return;
+            }
+
+            const bool interrupts = interrupt_disable ();
+            if (atomic_pool_cnt[class] < KMALLOC_ATOMIC_POOL_SIZE)
+            {
+                atomic_pool[class][atomic_pool_cnt[class]++] = block;
+                block = NULL;
+            }
+            interrupt_restore (interrupts);
+
+            /* Filled by kfree_atomic() in the meantime. */
+            kfree (block);
+        }
+    }
+}
+
+/* Refill thread. Sleeps until the pool runs low or blocks are deferred. */
+static void kmalloc_atomic_refill (void)
+{
+    while (true)
+    {
+        semaphore_down (&atomic_refill_sem);
+
+        bool interrupts = interrupt_disable ();
+        void *deferred = atomic_deferred;
+        atomic_deferred = NULL;
+        atomic_refill_pending = false;
+        interrupt_restore (interrupts);
+
+        while (deferred)
+        {
+            void * const next = kmalloc_atomic_getlink (deferred);
+            kfree (deferred);
+            deferred = next;
+        }
+
+        kmalloc_atomic_topup ();
+
+        interrupts = interrupt_disable ();
+        kmalloc_stats.atomic_refill_cnt++;
+        interrupt_restore (interrupts);
+    }
+}
+
+void kmalloc_atomic_init (void)
+{
+    static bool init = false;
+    kernel_assert (!init, "kmalloc_atomic_init(): already initialized");
+    init = true;
+
+    semaphore_init (&atomic_refill_sem, 0);
+    kmalloc_atomic_topup ();
+
+    atomic_refill_thread = thread_create (kmalloc_atomic_refill);
+    kernel_assert (atomic_refill_thread, "kmalloc_atomic_init(): failed to create refill thread");
+}
+
+void *kmalloc_atomic (const size_t size)
+{
+    const bool interrupts = interrupt_disable ();
+
+    /* Smallest class that fits with blocks left, falling back to larger classes. */
+    void *ptr = NULL;
+    for (uint32_t class = 0; class < KMALLOC_ATOMIC_CLASSES; class++)
+    {
+        if (size <= KMALLOC_ATOMIC_CLASS_SIZE (class) && atomic_pool_cnt[class] > 0)
+        {
+            ptr = atomic_pool[class][--atomic_pool_cnt[class]];
+            if (atomic_pool_cnt[class] < KMALLOC_ATOMIC_POOL_SIZE / 2)
+            {
+                kmalloc_atomic_wake ();
+            }
+            break;
+        }
+    }
+
+    if (ptr)
+    {
+        km_redzone_set (((km_block_header_t *) ptr) - 1, size);
+        kmalloc_stats.atomic_allocation_cnt++;
+        KM_TRACE (KMALLOC_TRACE_ALLOC, __builtin_return_address (0), ptr, size);
+    }
+    else if (size <= KMALLOC_ATOMIC_CLASS_SIZE (KMALLOC_ATOMIC_CLASSES - 1))
+    {
+        kmalloc_stats.atomic_failed_cnt++;
+        kmalloc_atomic_wake ();
+    }
+
+    interrupt_restore (interrupts);
+    return ptr;
+}
+
+void kfree_atomic (void * const ptr)
+{
+    if (!ptr)
+    {
+        return;
+    }
+
+    /* Large blocks have no header, they are always handed to the refill thread. */
+    const bool large = km_islarge (ptr);
+    km_block_header_t * const block = ((km_block_header_t *) ptr) - 1;
+    KM_CHECK (large || km_checkmagic (block), "kfree_atomic() - Bad pointer.");
+    KM_CHECK (large || (km_isalloc (block) && !km_iscached (block)), "kfree_atomic() - Unallocated memory.");
+
+    const bool interrupts = interrupt_disable ();
+
+    /* Largest class the block can serve, leaving room for the redzone. */
+    const size_t body = large ? ((size_t) PAGE_SIZE << page_getorder (ptr))
+                              : km_getsize (block) - sizeof (km_block_header_t);
+    int class = large ? -1 : KMALLOC_ATOMIC_CLASSES - 1;
+    while (class >= 0 && body < KMALLOC_ATOMIC_CLASS_SIZE (class) + KMALLOC_REDZONE_SIZE)
+    {
+        class--;
+    }
+
+    if (class >= 0 && atomic_pool_cnt[class] < KMALLOC_ATOMIC_POOL_SIZE)
+    {
+        km_redzone_check (block);
+        km_poison (ptr, body);
+        atomic_pool[class][atomic_pool_cnt[class]++] = ptr;
+    }
+    else
+    {
+        kmalloc_atomic_setlink (ptr, atomic_deferred);
+        atomic_deferred = ptr;
+        kmalloc_atomic_wake ();
+    }
+
+    kmalloc_stats.atomic_free_cnt++;
+    KM_TRACE (KMALLOC_TRACE_FREE, __builtin_return_address (0), ptr, body);
+    interrupt_restore (interrupts);
+}
\ No newline at end of file
@@ -0,0 +1,400 @@
+/* Best fit free block policy. Free blocks are kept in a red-black tree ordered by size, ties broken by
+   address, so the smallest block that fits (the lowest one of that size) is found in O(log n) without
+   scanning. The tree links live in the body of each free block, coalescing is left to kmalloc.c as with
+   every policy.
+
+   Introduction to Algorithms (Cormen et al.), chapter 13. */
+
+#include "alienos/mem/kmalloc_internal.h"
+#include "alienos/kernel/kernel.h"
+
+#ifdef KMALLOC_POLICY_BESTFIT
+
+/* Tree links of a free block, stored at the start of it's body. */
+typedef struct KMTreeNode
+{
+    km_block_header_t *left;            /* Smaller blocks. */
+    km_block_header_t *right;           /* Larger blocks. */
+    uintptr_t parent;                   /* Parent block, the lowest bit is set if the node is red. */
+} km_tree_node_t;
+
+_Static_assert (sizeof (km_tree_node_t) <= KMALLOC_MIN_BLOCK_SIZE - sizeof (km_block_header_t) - sizeof (uint32_t),
+                "tree node does not fit between the header and footer of the smallest block");
+
+#define BESTFIT_RED 1u
+
+/* Every free block. */
+static km_block_header_t *tree_root = NULL;
+
+static inline km_tree_node_t *bf_node (const km_block_header_t * const block)
+{
+    return (km_tree_node_t *) (block + 1);
+}
+
+static inline km_block_header_t *bf_parent (const km_block_header_t * const block)
+{
+    return (km_block_header_t *) (bf_node (block)->parent & ~BESTFIT_RED);
+}
+
+static inline void bf_setparent (km_block_header_t * const block, const km_block_header_t * const parent)
+{
+    bf_node (block)->parent = ((uintptr_t) parent) | (bf_node (block)->parent & BESTFIT_RED);
+}
+
+/* Missing children are black. */
+static inline bool bf_isred (const km_block_header_t * const block)
+{
+    return block && (bf_node (block)->parent & BESTFIT_RED);
+}
+
+static inline void bf_setred (km_block_header_t * const block, const bool red)
+{
+    bf_node (block)->parent = (bf_node (block)->parent & ~BESTFIT_RED) | (red ? BESTFIT_RED : 0);
+}
+
+/* Tree order, by size then by address. */
+static inline bool bf_less (const km_block_header_t * const a, const km_block_header_t * const b)
+{
+    return km_getsize (a) < km_getsize (b) || (km_getsize (a) == km_getsize (b) && a < b);
+}
+
+/* Point the link to 'old' in 'parent' (or the root if there is no parent) at 'new'. */
+static void bf_relink (km_block_header_t * const parent, const km_block_header_t * const old,
+                       km_block_header_t * const new)
+{
+    if (!parent)
+    {
+        tree_root = new;
+    }
+    else if (bf_node (parent)->left == old)
+    {
+        bf_node (parent)->left = new;
+    }
+    else
+    {
+        bf_node (parent)->right = new;
+    }
+}
+
+/* Rotate 'block' down to the left, it's right child takes it's place. */
+static void bf_rotate_left (km_block_header_t * const block)
+{
+    km_block_header_t * const child = bf_node (block)->right;
+    bf_node (block)->right = bf_node (child)->left;
+    if (bf_node (child)->left)
+    {
+        bf_setparent (bf_node (child)->left, block);
+    }
+
+    bf_setparent (child, bf_parent (block));
+    bf_relink (bf_parent (block), block, child);
+    bf_node (child)->left = block;
+    bf_setparent (block, child);
+}
+
+/* Rotate 'block' down to the right, it's left child takes it's place. */
+static void bf_rotate_right (km_block_header_t * const block)
+{
+    km_block_header_t * const child = bf_node (block)->left;
+    bf_node (block)->left = bf_node (child)->right;
+    if (bf_node (child)->right)
+    {
+        bf_setparent (bf_node (child)->right, block);
+    }
+
+    bf_setparent (child, bf_parent (block));
+    bf_relink (bf_parent (block), block, child);
+    bf_node (child)->right = block;
+    bf_setparent (block, child);
+}
+
+/* Put 'new' (which may be NULL) in the place of 'old' in the tree. */
+static void bf_transplant (const km_block_header_t * const old, km_block_header_t * const new)
+{
+    bf_relink (bf_parent (old), old, new);
+    if (new)
+    {
+        bf_setparent (new, bf_parent (old));
+    }
+}
+
+/* Insert free block into the tree. */
+void km_list_add (km_block_header_t * const block)
+{
+    km_block_header_t *parent = NULL;
+    km_block_header_t **link = &tree_root;
+    while (*link)
+    {
+        parent = *link;
+        link = bf_less (block, parent) ? &bf_node (parent)->left : &bf_node (parent)->right;
+    }
+
+    bf_node (block)->left = NULL;
+    bf_node (block)->right = NULL;
+    bf_node (block)->parent = ((uintptr_t) parent) | BESTFIT_RED;
+    *link = block;
+
+    /* Fix two reds in a row. A red parent is never the root, so there is a grandparent. */
+    km_block_header_t *cur = block;
+    while (bf_isred (bf_parent (cur)))
+    {
+        parent = bf_parent (cur);
+        km_block_header_t * const grandparent = bf_parent (parent);
+        if (parent == bf_node (grandparent)->left)
+        {
+            km_block_header_t * const uncle = bf_node (grandparent)->right;
+            if (bf_isred (uncle))
+            {
+                bf_setred (parent, false);
+                bf_setred (uncle, false);
+                bf_setred (grandparent, true);
+                cur = grandparent;
+                continue;
+            }
+
+            if (cur == bf_node (parent)->right)
+            {
+                cur = parent;
+                bf_rotate_left (cur);
+                parent = bf_parent (cur);
+            }
+            bf_setred (parent, false);
+            bf_setred (grandparent, true);
+            bf_rotate_right (grandparent);
+        }
+        else
+        {
+            km_block_header_t * const uncle = bf_node (grandparent)->left;
+            if (bf_isred (uncle))
+            {
+                bf_setred (parent, false);
+                bf_setred (uncle, false);
+                bf_setred (grandparent, true);
+                cur = grandparent;
+                continue;
+            }
+
+            if (cur == bf_node (parent)->left)
+            {
+                cur = parent;
+                bf_rotate_right (cur);
+                parent = bf_parent (cur);
+            }
+            bf_setred (parent, false);
+            bf_setred (grandparent, true);
+            bf_rotate_left (grandparent);
+        }
+    }
+
+    bf_setred (tree_root, false);
+    kmalloc_stats.free_block_cnt++;
+    kmalloc_stats.free_block_bytes += km_getsize (block);
+}
+
+/* Restore the black height after a black node was taken out above 'cur' (which may be NULL, so it's
+   parent is passed along). */
+static void bf_remove_fixup (km_block_header_t *cur, km_block_header_t *parent)
+{
+    /* The sibling of a node missing a black is never NULL. */
+    while (cur != tree_root && !bf_isred (cur))
+    {
+        if (cur == bf_node (parent)->left)
+        {
+            km_block_header_t *sibling = bf_node (parent)->right;
+            if (bf_isred (sibling))
+            {
+                bf_setred (sibling, false);
+                bf_setred (parent, true);
+                bf_rotate_left (parent);
+                sibling = bf_node (parent)->right;
+            }
+
+            if (!bf_isred (bf_node (sibling)->left) && !bf_isred (bf_node (sibling)->right))
+            {
+                bf_setred (sibling, true);
+                cur = parent;
+                parent = bf_parent (cur);
+                continue;
+            }
+
+            if (!bf_isred (bf_node (sibling)->right))
+            {
+                bf_setred (bf_node (sibling)->left, false);
+                bf_setred (sibling, true);
+                bf_rotate_right (sibling);
+                sibling = bf_node (parent)->right;
+            }
+            bf_setred (sibling, bf_isred (parent));
+            bf_setred (parent, false);
+            bf_setred (bf_node (sibling)->right, false);
+            bf_rotate_left (parent);
+        }
+        else
+        {
+            km_block_header_t *sibling = bf_node (parent)->left;
+            if (bf_isred (sibling))
+            {
+                bf_setred (sibling, false);
+                bf_setred (parent, true);
+                bf_rotate_right (parent);
+                sibling = bf_node (parent)->left;
+            }
+
+            if (!bf_isred (bf_node (sibling)->left) && !bf_isred (bf_node (sibling)->right))
+            {
+                bf_setred (sibling, true);
+                cur = parent;
+                parent = bf_parent (cur);
+                continue;
+            }
+
+            if (!bf_isred (bf_node (sibling)->left))
+            {
+                bf_setred (bf_node (sibling)->right, false);
+                bf_setred (sibling, true);
+                bf_rotate_left (sibling);
+                sibling = bf_node (parent)->left;
+            }
+            bf_setred (sibling, bf_isred (parent));
+            bf_setred (parent, false);
+            bf_setred (bf_node (sibling)->left, false);
+            bf_rotate_right (parent);
+        }
+
+        cur = tree_root;
+    }
+
+    if (cur)
+    {
+        bf_setred (cur, false);
+    }
+}
+
+/* Remove free block from the tree. */
+void km_list_remove (km_block_header_t * const block)
+{
+    km_block_header_t * const left = bf_node (block)->left;
+    km_block_header_t * const right = bf_node (block)->right;
+    KM_CHECK (block == tree_root || bf_parent (block), "km_list_remove(): block without parent is not root");
+
+    km_block_header_t *cur;
+    km_block_header_t *parent;
+    bool removed_red = bf_isred (block);
+    if (!left || !right)
+    {
+        /* At most one child, it takes the block's place. */
+        cur = left ? left : right;
+        parent = bf_parent (block);
+        bf_transplant (block, cur);
+    }
+    else
+    {
+        /* Two children, the next larger block (leftmost of the right subtree) takes the block's place. */
+        km_block_header_t *successor = right;
+        while (bf_node (successor)->left)
+        {
+            successor = bf_node (successor)->left;
+        }
+
+        removed_red = bf_isred (successor);
+        cur = bf_node (successor)->right;
+        if (successor == right)
+        {
+            parent = successor;
+        }
+        else
+        {
+            parent = bf_parent (successor);
+            bf_transplant (successor, cur);
+            bf_node (successor)->right = right;
+            bf_setparent (right, successor);
+        }
+
+        bf_transplant (block, successor);
+        bf_node (successor)->left = left;
+        bf_setparent (left, successor);
+        bf_setred (successor, bf_isred (block));
+    }
+
+    if (!removed_red)
+    {
+        bf_remove_fixup (cur, parent);
+    }
+
+    bf_node (block)->left = NULL;
+    bf_node (block)->right = NULL;
+    bf_node (block)->parent = 0;
+    kmalloc_stats.free_block_cnt--;
+    kmalloc_stats.free_block_bytes -= km_getsize (block);
+}
+
+/* Takes the smallest block that fits, the lowest one if there are several of that size. */
+km_block_header_t *km_list_find (const size_t size)
+{
+    km_block_header_t *best = NULL;
+    km_block_header_t *cur = tree_root;
+    while (cur)
+    {
+        if (km_getsize (cur) >= size)
+        {
+            best = cur;
+            cur = bf_node (cur)->left;
+        }
+        else
+        {
+            cur = bf_node (cur)->right;
+        }
+    }
+
+    return best;
+}
+
+/* The largest block is the rightmost one in the tree. */
+size_t km_list_largest (void)
+{
+    const km_block_header_t *cur = tree_root;
+    while (cur && bf_node (cur)->right)
+    {
+        cur = bf_node (cur)->right;
+    }
+
+    return cur ? km_getsize (cur) : 0;
+}
+
+/* Checks the subtree under 'block' is ordered and balanced. Adds it's size to 'cnt' and returns it's black
+   height. */
+static uint32_t bf_validate (const km_block_header_t * const block, const km_block_header_t * const parent,
+                             size_t * const cnt)
+{
+    if (!block)
+    {
+        return 1;
+    }
+
+    const km_block_header_t * const left = bf_node (block)->left;
+    const km_block_header_t * const right = bf_node (block)->right;
+    kernel_assert (km_checkmagic (block) && !km_isalloc (block), "km_list_validate(): bad free block (%x)",
+                   (uintptr_t) block);
+    kernel_assert (bf_parent (block) == parent, "km_list_validate(): broken parent link (%x)", (uintptr_t) block);
+    kernel_assert ((!left || bf_less (left, block)) && (!right || bf_less (block, right)),
+                   "km_list_validate(): tree out of order (%x)", (uintptr_t) block);
+    kernel_assert (!bf_isred (block) || (!bf_isred (left) && !bf_isred (right)),
+                   "km_list_validate(): red block with red child (%x)", (uintptr_t) block);
+
+    const uint32_t height = bf_validate (left, block, cnt);
+    kernel_assert (bf_validate (right, block, cnt) == height, "km_list_validate(): unbalanced (%x)",
+                   (uintptr_t) block);
+    (*cnt)++;
+    return height + (bf_isred (block) ? 0 : 1);
+}
+
+size_t km_list_validate (void)
+{
+    kernel_assert (!bf_isred (tree_root), "km_list_validate(): root is red");
+
+    size_t cnt = 0;
+    bf_validate (tree_root, NULL, &cnt);
+    return cnt;
+}
+
+#endif /* KMALLOC_POLICY_BESTFIT */
\ No newline at end of file
@@ -0,0 +1,185 @@
+/* First fit free block policy. Small free blocks are kept in size class bins, the rest in an unordered
+   list searched first fit. */
+
+#include "alienos/mem/kmalloc_internal.h"
+#include "alienos/kernel/kernel.h"
+
+#ifdef KMALLOC_POLICY_FIRSTFIT
+
+/* List of large free (unallocated) blocks in heap, the ones too large for a bin. Not ordered. */
+static km_block_header_t *free_list = NULL;
+
+/* Size class bins of small free blocks. Bin i holds the free blocks with a body of
+   [KMALLOC_BIN_MIN << i, KMALLOC_BIN_MIN << (i + 1)) bytes, so any block in bin i or higher can
+   serve a request of class i. */
+static km_block_header_t *bins[KMALLOC_BIN_COUNT] = {0};
+
+/* Bit i is set if bins[i] is nonempty. */
+static uint32_t bins_nonempty = 0;
+_Static_assert (KMALLOC_BIN_COUNT <= 32, "too many bins for bins_nonempty bitmap");
+
+/* Get the size class bin a free block belongs in, or -1 if the block is too large to be binned. */
+static inline int km_bin_index (const size_t size)
+{
+    const size_t body = (size - sizeof (km_block_header_t)) / KMALLOC_BIN_MIN;
+    const int index = 31 - __builtin_clz (body);
+    return (index < KMALLOC_BIN_COUNT) ? index : -1;
+}
+
+/* Get the size class of a request of 'size' bytes (including header), or -1 if the request is not
+   small. Rounds up so every block in the class's bin can satisfy the request. */
+static inline int km_bin_class (const size_t size)
+{
+    const size_t body = (size - sizeof (km_block_header_t) + KMALLOC_BIN_MIN - 1) / KMALLOC_BIN_MIN;
+    const int index = (body <= 1) ? 0 : 32 - __builtin_clz (body - 1);
+    return (index < KMALLOC_BIN_COUNT) ? index : -1;
+}
+
+/* Push free block onto the front of it's list. */
+void km_list_add (km_block_header_t * const block)
+{
+    const int index = km_bin_index (km_getsize (block));
+    km_block_header_t ** const head = (index < 0) ? &free_list : &bins[index];
+
+    block->prev = NULL;
+    block->next = *head;
+    if (*head)
+    {
+        (*head)->prev = block;
+    }
+    *head = block;
+
+    if (index >= 0)
+    {
+        bins_nonempty |= 1u << index;
+    }
+    kmalloc_stats.free_block_cnt++;
+    kmalloc_stats.free_block_bytes += km_getsize (block);
+}
+
+/* Remove free block from it's list. */
+void km_list_remove (km_block_header_t * const block)
+{
+    const int index = km_bin_index (km_getsize (block));
+    km_block_header_t ** const head = (index < 0) ? &free_list : &bins[index];
+
+    if (block->prev)
+    {
+        block->prev->next = block->next;
+    }
+    else
+    {
+        KM_CHECK (*head == block, "km_list_remove(): block without prev is not head of list");
+        *head = block->next;
+        if (!*head && index >= 0)
+        {
+            bins_nonempty &= ~(1u << index);
+        }
+    }
+
+    if (block->next)
+    {
+        block->next->prev = block->prev;
+    }
+
+    block->next = NULL;
+    block->prev = NULL;
+    kmalloc_stats.free_block_cnt--;
+    kmalloc_stats.free_block_bytes -= km_getsize (block);
+}
+
+/* Checks the size class bins first, falling back to the first fit in the large block list. Requests too large
+   for a class that the blocks of the last bin may still hold take the first fit in that bin before the large
+   block list. */
+km_block_header_t *km_list_find (const size_t size)
+{
+    /* Small requests pop the first block from the smallest nonempty bin that is large enough. */
+    const int class = km_bin_class (size);
+    if (class >= 0)
+    {
+        const uint32_t candidates = bins_nonempty & ~((1u << class) - 1);
+        if (candidates & (1u << class))
+        {
+            kmalloc_stats.bin_hits[class]++;
+        }
+        else
+        {
+            kmalloc_stats.bin_misses[class]++;
+        }
+
+        if (candidates)
+        {
+            return bins[__builtin_ctz (candidates)];
+        }
+    }
+    else if (size - sizeof (km_block_header_t) < (KMALLOC_BIN_MIN << KMALLOC_BIN_COUNT))
+    {
+        for (km_block_header_t *cur = bins[KMALLOC_BIN_COUNT - 1]; cur; cur = cur->next)
+        {
+            if (km_getsize (cur) >= size)
+            {
+                return cur;
+            }
+        }
+    }
+
+    km_block_header_t *cur = free_list;
+    while (cur && km_getsize (cur) < size)
+    {
+        cur = cur->next;
+    }
+
+    return cur;
+}
+
+/* The large block list is not ordered, so it is walked in full. Failing that, the largest block is in the
+   highest nonempty bin, which is walked instead. */
+size_t km_list_largest (void)
+{
+    const km_block_header_t *cur = free_list;
+    if (!cur && bins_nonempty)
+    {
+        cur = bins[31 - __builtin_clz (bins_nonempty)];
+    }
+
+    size_t largest = 0;
+    for (; cur; cur = cur->next)
+    {
+        largest = (km_getsize (cur) > largest) ? km_getsize (cur) : largest;
+    }
+
+    return largest;
+}
+
+/* Walks one list, checking the links and that every block belongs in it. Returns the list's length. */
+static size_t km_list_validate_one (const km_block_header_t *head, const int index)
+{
+    size_t cnt = 0;
+    for (const km_block_header_t *cur = head; cur; cur = cur->next)
+    {
+        kernel_assert (km_checkmagic (cur) && !km_isalloc (cur), "km_list_validate(): bad free block (%x)",
+                       (uintptr_t) cur);
+        kernel_assert (km_bin_index (km_getsize (cur)) == index, "km_list_validate(): block in wrong list (%x)",
+                       (uintptr_t) cur);
+        kernel_assert (cur->prev ? cur->prev->next == cur : cur == head,
+                       "km_list_validate(): broken prev link (%x)", (uintptr_t) cur);
+        cnt++;
+    }
+
+    return cnt;
+}
+
+size_t km_list_validate (void)
+{
+    size_t cnt = km_list_validate_one (free_list, -1);
+    for (int i = 0; i < KMALLOC_BIN_COUNT; i++)
+    {
+        kernel_assert (!bins[i] == !(bins_nonempty & (1u << i)), "km_list_validate(): bin %u bitmap bit is wrong",
+                       i);
+        cnt += km_list_validate_one (bins[i], i);
+    }
+
+    return cnt;
+}
+
+#endif /* KMALLOC_POLICY_FIRSTFIT */
\ No newline at end of file
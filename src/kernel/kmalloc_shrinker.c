@@ -0,0 +1,112 @@
+/* Memory pressure shrinkers. Subsystems that hold on to memory they can do without, like caches, register a
+   callback that gives it back. When the heap runs out of pages, the synchronized allocation functions call
+   every shrinker in priority order and retry, rather than failing while memory sits unused in a cache. */
+
+#include "alienos/mem/kmalloc_internal.h"
+#include "alienos/kernel/kernel.h"
+#include "alienos/kernel/synch.h"
+#include "alienos/kernel/thread.h"
+#include "alienos/io/io.h"
+#include "alienos/io/interrupt.h"
+
+/* Registered shrinkers, lowest priority value first. */
+static kmalloc_shrinker_t *shrinkers = NULL;
+
+/* Held while the list is changed or walked, including while the callbacks run. */
+static mutex_t shrinker_lock;
+
+/* Insert a shrinker after every shrinker with the same or a lower priority. Must be synchronized
+   externally. */
+static void km_shrinker_insert (kmalloc_shrinker_t * const shrinker)
+{
+    kmalloc_shrinker_t **link = &shrinkers;
+    while (*link && (*link)->priority <= shrinker->priority)
+    {
+        link = &(*link)->next;
+    }
+
+    shrinker->next = *link;
+    *link = shrinker;
+}
+
+void km_shrinker_init (void)
+{
+    /* Pre-zeroed blocks are the cheapest to give up, the fill thread makes more. Magazines are refilled on the
+       next small allocation. */
+    static kmalloc_shrinker_t zeroed_shrinker = {"zeroed", km_zeroed_shrink, NULL, 0, 0, 0, NULL};
+    static kmalloc_shrinker_t magazines_shrinker = {"magazines", km_magazines_shrink, NULL, 0, 0, 0, NULL};
+
+    /* Threads do not exist yet, so the lock can not be taken. */
+    mutex_init (&shrinker_lock);
+    km_shrinker_insert (&zeroed_shrinker);
+    km_shrinker_insert (&magazines_shrinker);
+}
+
+void kmalloc_register_shrinker (kmalloc_shrinker_t * const shrinker, const char * const name,
+                                const uint32_t priority, const kmalloc_shrink_t shrink, void * const arg)
+{
+    kernel_assert (shrink, "kmalloc_register_shrinker(): shrinker '%s' has no callback", name);
+
+    shrinker->name = name;
+    shrinker->shrink = shrink;
+    shrinker->arg = arg;
+    shrinker->priority = priority;
+    shrinker->call_cnt = 0;
+    shrinker->reclaimed_bytes = 0;
+
+    mutex_acquire (&shrinker_lock);
+    km_shrinker_insert (shrinker);
+    mutex_release (&shrinker_lock);
+}
+
+void kmalloc_unregister_shrinker (kmalloc_shrinker_t * const shrinker)
+{
+    mutex_acquire (&shrinker_lock);
+    kmalloc_shrinker_t **link = &shrinkers;
+    while (*link && *link != shrinker)
+    {
+        link = &(*link)->next;
+    }
+    kernel_assert (*link, "kmalloc_unregister_shrinker(): shrinker '%s' is not registered", shrinker->name);
+
+    *link = shrinker->next;
+    shrinker->next = NULL;
+    mutex_release (&shrinker_lock);
+}
+
+size_t kmalloc_shrink (void)
+{
+    /* A shrinker that allocates would end up back here with the lock held. */
+    if (shrinker_lock.holder == current_thread)
+    {
+        return 0;
+    }
+
+    mutex_acquire (&shrinker_lock);
+    size_t reclaimed = 0;
+    for (kmalloc_shrinker_t *shrinker = shrinkers; shrinker; shrinker = shrinker->next)
+    {
+        const size_t bytes = shrinker->shrink (shrinker->arg);
+        shrinker->call_cnt++;
+        shrinker->reclaimed_bytes += bytes;
+        reclaimed += bytes;
+    }
+    mutex_release (&shrinker_lock);
+
+    const bool interrupts = interrupt_disable ();
+    kmalloc_stats.shrink_cnt++;
+    kmalloc_stats.shrink_bytes += reclaimed;
+    interrupt_restore (interrupts);
+    return reclaimed;
+}
+
+void km_shrinker_dump (void)
+{
+    mutex_acquire (&shrinker_lock);
+    for (const kmalloc_shrinker_t *shrinker = shrinkers; shrinker; shrinker = shrinker->next)
+    {
+        printf ("kmalloc_shrinker name=%s priority=%u call_cnt=%u reclaimed_bytes=%u\n", shrinker->name,
+                shrinker->priority, shrinker->call_cnt, shrinker->reclaimed_bytes);
+    }
+    mutex_release (&shrinker_lock);
+}
\ No newline at end of file
@@ -0,0 +1,199 @@
+/* Two level segregated fit (TLSF) free block policy. Free blocks are kept in lists indexed by a first
+   level power of 2 size class and a second level linear subdivision of it. Two bitmaps track which lists
+   are nonempty, so finding a block is a couple of bit scans with no list walk, bounding the worst case.
+
+   http://www.gii.upv.es/tlsf/files/papers/ecrts04_tlsf.pdf */
+
+#include "alienos/mem/kmalloc_internal.h"
+#include "alienos/kernel/kernel.h"
+
+#ifdef KMALLOC_POLICY_TLSF
+
+/* Each first level class is split into (1 << TLSF_SL_LOG2) second level lists. */
+#define TLSF_SL_LOG2 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+
+/* Blocks smaller than TLSF_SMALL_SIZE all go in first level 0, split linearly by the alignment. */
+#define TLSF_ALIGN_LOG2 4
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + TLSF_ALIGN_LOG2)
+#define TLSF_SMALL_SIZE (1 << TLSF_FL_SHIFT)
+
+/* Enough first level classes for blocks of up to 2 GiB. */
+#define TLSF_FL_COUNT (31 - TLSF_FL_SHIFT + 1)
+
+/* Bit i is set if first level class i has a nonempty list. */
+static uint32_t fl_bitmap = 0;
+
+/* Bit j of sl_bitmap[i] is set if blocks[i][j] is nonempty. */
+static uint32_t sl_bitmap[TLSF_FL_COUNT] = {0};
+
+/* Free lists, not ordered. */
+static km_block_header_t *blocks[TLSF_FL_COUNT][TLSF_SL_COUNT] = {{0}};
+
+/* Index of the most significant set bit. */
+static inline int tlsf_fls (const size_t x)
+{
+    return 31 - __builtin_clz (x);
+}
+
+/* Get the list a free block of 'size' bytes belongs in. */
+static inline void tlsf_mapping_insert (const size_t size, int * const fl, int * const sl)
+{
+    if (size < TLSF_SMALL_SIZE)
+    {
+        *fl = 0;
+        *sl = size >> TLSF_ALIGN_LOG2;
+    }
+    else
+    {
+        const int msb = tlsf_fls (size);
+        *fl = msb - TLSF_FL_SHIFT + 1;
+        *sl = (size >> (msb - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+    }
+}
+
+/* Get the first list where every block can serve a request of 'size' bytes. Rounds the size up to the
+   next list boundary. Returns false if no list is large enough. */
+static inline bool tlsf_mapping_search (size_t size, int * const fl, int * const sl)
+{
+    if (size >= TLSF_SMALL_SIZE)
+    {
+        size += (1u << (tlsf_fls (size) - TLSF_SL_LOG2)) - 1;
+    }
+
+    tlsf_mapping_insert (size, fl, sl);
+    return *fl < TLSF_FL_COUNT;
+}
+
+/* Push free block onto the front of it's list. */
+void km_list_add (km_block_header_t * const block)
+{
+    int fl, sl;
+    tlsf_mapping_insert (km_getsize (block), &fl, &sl);
+    kernel_assert (fl < TLSF_FL_COUNT, "km_list_add(): block too large (%x)", km_getsize (block));
+
+    km_block_header_t ** const head = &blocks[fl][sl];
+    block->prev = NULL;
+    block->next = *head;
+    if (*head)
+    {
+        (*head)->prev = block;
+    }
+    *head = block;
+
+    fl_bitmap |= 1u << fl;
+    sl_bitmap[fl] |= 1u << sl;
+    kmalloc_stats.free_block_cnt++;
+    kmalloc_stats.free_block_bytes += km_getsize (block);
+}
+
+/* Remove free block from it's list. */
+void km_list_remove (km_block_header_t * const block)
+{
+    int fl, sl;
+    tlsf_mapping_insert (km_getsize (block), &fl, &sl);
+    km_block_header_t ** const head = &blocks[fl][sl];
+
+    if (block->prev)
+    {
+        block->prev->next = block->next;
+    }
+    else
+    {
+        KM_CHECK (*head == block, "km_list_remove(): block without prev is not head of list");
+        *head = block->next;
+        if (!*head)
+        {
+            sl_bitmap[fl] &= ~(1u << sl);
+            if (!sl_bitmap[fl])
+            {
+                fl_bitmap &= ~(1u << fl);
+            }
+        }
+    }
+
+    if (block->next)
+    {
+        block->next->prev = block->prev;
+    }
+
+    block->next = NULL;
+    block->prev = NULL;
+    kmalloc_stats.free_block_cnt--;
+    kmalloc_stats.free_block_bytes -= km_getsize (block);
+}
+
+/* Takes the head of the first nonempty list at or above the request's list. */
+km_block_header_t *km_list_find (const size_t size)
+{
+    int fl, sl;
+    if (!tlsf_mapping_search (size, &fl, &sl))
+    {
+        return NULL;
+    }
+
+    /* Look for a larger list in the same first level class, then in the larger classes. */
+    uint32_t sl_map = sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map)
+    {
+        const uint32_t fl_map = fl_bitmap & (~0u << (fl + 1));
+        if (!fl_map)
+        {
+            return NULL;
+        }
+
+        fl = __builtin_ctz (fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+
+    return blocks[fl][__builtin_ctz (sl_map)];
+}
+
+/* The largest block is in the highest nonempty list, which only holds blocks of one second level class. */
+size_t km_list_largest (void)
+{
+    if (!fl_bitmap)
+    {
+        return 0;
+    }
+
+    const int fl = tlsf_fls (fl_bitmap);
+    size_t largest = 0;
+    for (const km_block_header_t *cur = blocks[fl][tlsf_fls (sl_bitmap[fl])]; cur; cur = cur->next)
+    {
+        largest = (km_getsize (cur) > largest) ? km_getsize (cur) : largest;
+    }
+
+    return largest;
+}
+
+size_t km_list_validate (void)
+{
+    size_t cnt = 0;
+    for (int fl = 0; fl < TLSF_FL_COUNT; fl++)
+    {
+        kernel_assert (!sl_bitmap[fl] == !(fl_bitmap & (1u << fl)), "km_list_validate(): fl_bitmap bit %u is wrong",
+                       fl);
+        for (int sl = 0; sl < TLSF_SL_COUNT; sl++)
+        {
+            kernel_assert (!blocks[fl][sl] == !(sl_bitmap[fl] & (1u << sl)),
+                           "km_list_validate(): sl_bitmap bit %u,%u is wrong", fl, sl);
+            for (const km_block_header_t *cur = blocks[fl][sl]; cur; cur = cur->next)
+            {
+                int block_fl, block_sl;
+                tlsf_mapping_insert (km_getsize (cur), &block_fl, &block_sl);
+                kernel_assert (km_checkmagic (cur) && !km_isalloc (cur), "km_list_validate(): bad free block (%x)",
+                               (uintptr_t) cur);
+                kernel_assert (block_fl == fl && block_sl == sl, "km_list_validate(): block in wrong list (%x)",
+                               (uintptr_t) cur);
+                kernel_assert (cur->prev ? cur->prev->next == cur : cur == blocks[fl][sl],
+                               "km_list_validate(): broken prev link (%x)", (uintptr_t) cur);
+                cnt++;
+            }
+        }
+    }
+
+    return cnt;
+}
+
+#endif /* KMALLOC_POLICY_TLSF */
\ No newline at end of file
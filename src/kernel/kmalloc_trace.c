@@ -0,0 +1,77 @@
+/* Call site tracing. When the kernel is built with KMALLOC_TRACE (make KMALLOC_TRACE=1), every allocation
+   and free through the public API is recorded in a ring buffer with the address it was called from. The
+   ring is dumped over serial by kmalloc_trace_dump(), scripts/kmalloc_trace.py turns the dump into bytes
+   and hold times per call site. */
+
+#include "alienos/mem/kmalloc_internal.h"
+#include "alienos/kernel/kernel.h"
+#include "alienos/io/io.h"
+#include "alienos/io/interrupt.h"
+#include "alienos/cpu/cpu.h"
+
+#ifdef KMALLOC_TRACE
+
+struct KMTraceRecord
+{
+    uint64_t tsc;                       /* Time stamp counter when the operation finished. */
+    const void *caller;                 /* Return address into the caller. */
+    const void *ptr;                    /* Memory allocated or freed. */
+    uint32_t size;                      /* Bytes requested, or the body size of the freed block. */
+    uint32_t op;                        /* KMALLOC_TRACE_ALLOC or KMALLOC_TRACE_FREE. */
+};
+
+/* Oldest records are overwritten once the ring is full. */
+static struct KMTraceRecord trace_ring[KMALLOC_TRACE_SIZE];
+
+/* How many records were ever written, the next one goes at trace_cnt % KMALLOC_TRACE_SIZE. */
+static uint32_t trace_cnt = 0;
+
+void km_trace (const uint32_t op, const void * const caller, const void * const ptr, const size_t size)
+{
+    if (!ptr)
+    {
+        return;
+    }
+
+    const uint64_t tsc = cpu_rdtsc ();
+    const bool interrupts = interrupt_disable ();
+    struct KMTraceRecord * const record = &trace_ring[trace_cnt++ % KMALLOC_TRACE_SIZE];
+    record->tsc = tsc;
+    record->caller = caller;
+    record->ptr = ptr;
+    record->size = size;
+    record->op = op;
+    interrupt_restore (interrupts);
+}
+
+void kmalloc_trace_dump (void)
+{
+    /* Copy records out one at a time, so the ring can keep filling while the dump is printed. Records
+       written during the dump may show up out of order. */
+    bool interrupts = interrupt_disable ();
+    const uint32_t end = trace_cnt;
+    interrupt_restore (interrupts);
+
+    const uint32_t begin = (end > KMALLOC_TRACE_SIZE) ? end - KMALLOC_TRACE_SIZE : 0;
+    printf ("kmalloc_trace_info enabled=1 records=%u dropped=%u\n", end - begin, begin);
+
+    for (uint32_t i = begin; i < end; i++)
+    {
+        interrupts = interrupt_disable ();
+        const struct KMTraceRecord record = trace_ring[i % KMALLOC_TRACE_SIZE];
+        interrupt_restore (interrupts);
+
+        printf ("kmalloc_trace op=%s caller=%x ptr=%x size=%u tsc_hi=%x tsc_lo=%x\n",
+                (record.op == KMALLOC_TRACE_ALLOC) ? "alloc" : "free", (uintptr_t) record.caller,
+                (uintptr_t) record.ptr, record.size, (uint32_t) (record.tsc >> 32), (uint32_t) record.tsc);
+    }
+}
+
+#else
+
+void kmalloc_trace_dump (void)
+{
+    printf ("kmalloc_trace_info enabled=0 records=0 dropped=0\n");
+}
+
+#endif /* KMALLOC_TRACE */
\ No newline at end of file
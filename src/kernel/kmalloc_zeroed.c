@@ -0,0 +1,165 @@
+/* Pre-zeroed blocks for kcalloc(). A fill thread of the lowest priority allocates blocks from the kernel heap
+   and zeros them while nothing else needs the CPU, so kcalloc() can hand them out without clearing memory
+   itself. It is an ordinary thread rather than the idle loop, so it can block on the heap lock and receive
+   priority donations while holding it. The pool is only touched with interrupts disabled. */
+
+#include "alienos/mem/kmalloc_internal.h"
+#include "alienos/kernel/kernel.h"
+#include "alienos/kernel/thread.h"
+#include "alienos/kernel/synch.h"
+#include "alienos/io/interrupt.h"
+
+/* Body size of the blocks in pool class i. */
+#define KMALLOC_ZEROED_CLASS_SIZE(i) (1024u << (2 * (i)))
+
+/* Requests smaller than this are cheap enough to zero directly. */
+#define KMALLOC_ZEROED_MIN (KMALLOC_ZEROED_CLASS_SIZE (0) / 4)
+
+/* Zeroed blocks of each class. */
+static void *zeroed_pool[KMALLOC_ZEROED_CLASSES][KMALLOC_ZEROED_POOL_SIZE];
+static uint32_t zeroed_pool_cnt[KMALLOC_ZEROED_CLASSES] = {0};
+
+/* Slots reserved by a fill in progress, so concurrent fills never overflow the pool. */
+static uint32_t zeroed_pending[KMALLOC_ZEROED_CLASSES] = {0};
+
+/* Fill thread waits on this. */
+static semaphore_t zeroed_fill_sem;
+static bool zeroed_fill_wakeup = false;
+static thread_t *zeroed_fill_thread = NULL;
+
+/* Wake up the fill thread if it is not already woken. Interrupts must be disabled. */
+static void kmalloc_zeroed_wake (void)
+{
+    if (zeroed_fill_thread && !zeroed_fill_wakeup)
+    {
+        zeroed_fill_wakeup = true;
+        semaphore_up (&zeroed_fill_sem);
+    }
+}
+
+/* Fill thread. Sleeps until blocks are taken from the pool. */
+static void kmalloc_zeroed_refill (void)
+{
+    while (true)
+    {
+        semaphore_down (&zeroed_fill_sem);
+
+        const bool interrupts = interrupt_disable ();
+        zeroed_fill_wakeup = false;
+        interrupt_restore (interrupts);
+
+        while (kmalloc_zeroed_fill ());
+    }
+}
+
+void kmalloc_zeroed_init (void)
+{
+    static bool init = false;
+    kernel_assert (!init, "kmalloc_zeroed_init(): already initialized");
+    init = true;
+
+    semaphore_init (&zeroed_fill_sem, 0);
+    zeroed_fill_thread = thread_create_ex ((void (*)(void *)) kmalloc_zeroed_refill, NULL, THREAD_PRIORITY_MIN);
+    kernel_assert (zeroed_fill_thread, "kmalloc_zeroed_init(): failed to create fill thread");
+
+    const bool interrupts = interrupt_disable ();
+    kmalloc_zeroed_wake ();
+    interrupt_restore (interrupts);
+}
+
+bool kmalloc_zeroed_fill (void)
+{
+    /* Reserve a slot in the smallest class that is not full. */
+    bool interrupts = interrupt_disable ();
+    int class = -1;
+    for (int i = 0; i < KMALLOC_ZEROED_CLASSES; i++)
+    {
+        if (zeroed_pool_cnt[i] + zeroed_pending[i] < KMALLOC_ZEROED_POOL_SIZE)
+        {
+            zeroed_pending[i]++;
+            class = i;
+            break;
+        }
+    }
+    interrupt_restore (interrupts);
+
+    if (class < 0)
+    {
+        return false;
+    }
+
+    /* Zeroing is done with the caller's interrupt state, so the fill thread can be preempted. */
+    void * const ptr = km_alloc_block (KMALLOC_ZEROED_CLASS_SIZE (class));
+    if (ptr)
+    {
+        km_zero (ptr, KMALLOC_ZEROED_CLASS_SIZE (class));
+    }
+
+    interrupts = interrupt_disable ();
+    zeroed_pending[class]--;
+    if (ptr)
+    {
+        zeroed_pool[class][zeroed_pool_cnt[class]++] = ptr;
+        kmalloc_stats.zeroed_fill_cnt++;
+    }
+    interrupt_restore (interrupts);
+
+    return ptr != NULL;
+}
+
+km_block_header_t *km_zeroed_take (const size_t size)
+{
+    if (size < KMALLOC_ZEROED_MIN || size > KMALLOC_ZEROED_CLASS_SIZE (KMALLOC_ZEROED_CLASSES - 1))
+    {
+        return NULL;
+    }
+
+    /* Only the smallest class that fits, larger blocks would waste the zeroing done on them. */
+    int class = 0;
+    while (size > KMALLOC_ZEROED_CLASS_SIZE (class))
+    {
+        class++;
+    }
+
+    const bool interrupts = interrupt_disable ();
+    void * const ptr = (zeroed_pool_cnt[class] > 0) ? zeroed_pool[class][--zeroed_pool_cnt[class]] : NULL;
+    if (ptr)
+    {
+        kmalloc_stats.zeroed_hits++;
+    }
+    else
+    {
+        kmalloc_stats.zeroed_misses++;
+    }
+    kmalloc_zeroed_wake ();
+    interrupt_restore (interrupts);
+
+    return ptr ? ((km_block_header_t *) ptr) - 1 : NULL;
+}
+
+size_t km_zeroed_shrink (void * const arg)
+{
+    (void) arg;
+
+    /* Empty the pool with interrupts disabled, the blocks are freed after. */
+    void *blocks[KMALLOC_ZEROED_CLASSES * KMALLOC_ZEROED_POOL_SIZE];
+    uint32_t cnt = 0;
+    const bool interrupts = interrupt_disable ();
+    for (int class = 0; class < KMALLOC_ZEROED_CLASSES; class++)
+    {
+        while (zeroed_pool_cnt[class] > 0)
+        {
+            blocks[cnt++] = zeroed_pool[class][--zeroed_pool_cnt[class]];
+        }
+    }
+    interrupt_restore (interrupts);
+
+    size_t bytes = 0;
+    for (uint32_t i = 0; i < cnt; i++)
+    {
+        bytes += km_getsize (((km_block_header_t *) blocks[i]) - 1);
+        kfree (blocks[i]);
+    }
+
+    return bytes;
+}
\ No newline at end of file
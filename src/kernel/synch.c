@@ -26,31 +26,88 @@ static void wait_queue_append (tlistnode_t ** const head, tlistnode_t ** const t
     *tail = thread;
 }
 
-/* Removes from the beginning of doubly linked list. Must be synchronized externally. */
-static thread_t *wait_queue_popfront (tlistnode_t ** const head, tlistnode_t ** const tail)
+/* Removes the highest priority thread from the doubly linked list, the one closest to the head if several
+   share it. Must be synchronized externally. */
+static thread_t *wait_queue_popmax (tlistnode_t ** const head, tlistnode_t ** const tail)
 {
-    kernel_assert (*head, "wait_queue_popfront(): Expected nonempty lists");
-    kernel_assert (!(*head)->prev, "wait_queue_popfront(): Expected head to have no previous node");
+    kernel_assert (*head, "wait_queue_popmax(): Expected nonempty lists");
+    kernel_assert (!(*head)->prev, "wait_queue_popmax(): Expected head to have no previous node");
 
-    tlistnode_t * const unblocked = *head;
+    tlistnode_t *unblocked = *head;
+    for (tlistnode_t *node = unblocked->next; node; node = node->next)
+    {
+        if (node->thread->priority > unblocked->thread->priority)
+        {
+            unblocked = node;
+        }
+    }
 
-    /* Move head over. */
-    *head = (*head)->next;
-    if (!*head)
+    /* Jump over the node in both directions. */
+    if (unblocked->prev)
     {
-        /* List is empty. */
-        *tail = NULL;
+        unblocked->prev->next = unblocked->next;
     }
     else
     {
-        /* Remove backwards edge. */
-        (*head)->prev = NULL;
+        *head = unblocked->next;
+    }
+
+    if (unblocked->next)
+    {
+        unblocked->next->prev = unblocked->prev;
+    }
+    else
+    {
+        *tail = unblocked->prev;
     }
 
     unblocked->next = NULL;
+    unblocked->prev = NULL;
     return unblocked->thread;
 }
 
+/* Donate 'priority' to the holder of mutex, and on down the chain while holders are blocked on mutexes
+   themselves. Must be synchronized externally. */
+static void mutex_donate_chain (mutex_t *mutex, const uint32_t priority)
+{
+    for (uint32_t depth = 0; depth < MUTEX_DONATION_DEPTH; depth++)
+    {
+        thread_t * const holder = mutex->holder;
+        if (!holder || holder->priority >= priority)
+        {
+            return;
+        }
+
+        thread_update_priority (holder, priority);
+        if (holder->status != ThreadStatus_Blocked || holder->blocker_type != BlockerType_Mutex)
+        {
+            return;
+        }
+        mutex = (mutex_t *) holder->blocked_on;
+    }
+}
+
+/* Add mutex to the current thread's held list. Must be synchronized externally. */
+static void mutex_held_add (mutex_t * const mutex)
+{
+    mutex->held_next = current_thread->held_mutexes;
+    current_thread->held_mutexes = mutex;
+}
+
+/* Remove mutex from the current thread's held list. Must be synchronized externally. */
+static void mutex_held_remove (mutex_t * const mutex)
+{
+    mutex_t **link = &current_thread->held_mutexes;
+    while (*link != mutex)
+    {
+        kernel_assert (*link, "mutex_held_remove(): Mutex not in held list");
+        link = &(*link)->held_next;
+    }
+
+    *link = mutex->held_next;
+    mutex->held_next = NULL;
+}
+
 void semaphore_init (semaphore_t * const sem, const int32_t initial_count)
 {
     sem->count = initial_count;
@@ -114,7 +171,7 @@ void semaphore_up (semaphore_t * const sem)
     /* Check if we can unblock a waiting thread. */
     if (sem->wait_queue_head)
     {
-        thread_t * const wake_thread = wait_queue_popfront (&sem->wait_queue_head, &sem->wait_queue_tail);
+        thread_t * const wake_thread = wait_queue_popmax (&sem->wait_queue_head, &sem->wait_queue_tail);
         thread_unblock (wake_thread);
     }
 
@@ -127,6 +184,7 @@ void mutex_init (mutex_t * const mutex)
     semaphore_init (&mutex->sem, 1);
     mutex->holder = NULL;
     mutex->recursion_count = 0;
+    mutex->held_next = NULL;
 }
 
 void mutex_acquire (mutex_t * const mutex)
@@ -148,9 +206,28 @@ void mutex_acquire (mutex_t * const mutex)
         current_thread->blocker_type = BlockerType_Mutex;
     }
 
+    /* Lend our priority to the holder while we wait, it is given back in mutex_release(). */
+    if (mutex->sem.count <= 0)
+    {
+        mutex_donate_chain (mutex, current_thread->priority);
+    }
+
     semaphore_down (&mutex->sem);
     mutex->holder = current_thread;
     mutex->recursion_count = 1;
+    mutex_held_add (mutex);
+
+    /* Waiters that came between mutex_release() waking us and us running found no holder to donate to, take
+       their priority now. */
+    const uint32_t donated = mutex_donated_priority (current_thread);
+    if (donated > current_thread->priority)
+    {
+        thread_update_priority (current_thread, donated);
+    }
+
+    /* Not blocked on it anymore, semaphore_down() only clears these if it blocked. */
+    current_thread->blocked_on = NULL;
+    current_thread->blocker_type = BlockerType_None;
     interrupt_restore (interrupts);
 }
 
@@ -166,14 +243,17 @@ bool mutex_try_acquire (mutex_t * const mutex)
     }
 
     /* Try to acquire it. */
-    if (semaphore_try_down (&mutex->sem))
+    const bool interrupts = interrupt_disable ();
+    const bool success = semaphore_try_down (&mutex->sem);
+    if (success)
     {
         mutex->holder = current_thread;
         mutex->recursion_count = 1;
-        return true;
+        mutex_held_add (mutex);
     }
 
-    return false;
+    interrupt_restore (interrupts);
+    return success;
 }
 
 void mutex_release (mutex_t * const mutex)
@@ -187,14 +267,49 @@ void mutex_release (mutex_t * const mutex)
     mutex->recursion_count--;
     kernel_assert (mutex->recursion_count != ~0UL, "mutex_release(): Overflow");
 
-    /* If we have released the same number of times we have acquired, fully release lock. */
-    if (mutex->recursion_count == 0)
+    /* If we have released the same number of times we have acquired, fully release lock. Priorities donated
+       through it are given back, the highest priority waiter gets it next. */
+    const bool released = mutex->recursion_count == 0;
+    if (released)
     {
         mutex->holder = NULL;
+        mutex_held_remove (mutex);
+
+        const uint32_t donated = mutex_donated_priority (current_thread);
+        thread_update_priority (current_thread, (donated > current_thread->base_priority)
+                                                ? donated : current_thread->base_priority);
         semaphore_up (&mutex->sem);
     }
 
     interrupt_restore (interrupts);
+
+    /* Run a waiter we woke or a donor we stopped standing in for right away. Not from interrupt handlers,
+       which release locks with interrupts disabled. */
+    if (released && interrupts)
+    {
+        thread_preempt ();
+    }
+}
+
+uint32_t mutex_donated_priority (const thread_t * const thread)
+{
+    uint32_t priority = THREAD_PRIORITY_MIN;
+    for (const mutex_t *mutex = thread->held_mutexes; mutex; mutex = mutex->held_next)
+    {
+        for (const tlistnode_t *node = mutex->sem.wait_queue_head; node; node = node->next)
+        {
+            priority = (node->thread->priority > priority) ? node->thread->priority : priority;
+        }
+    }
+    return priority;
+}
+
+void mutex_donate (const thread_t * const thread)
+{
+    if (thread->status == ThreadStatus_Blocked && thread->blocker_type == BlockerType_Mutex)
+    {
+        mutex_donate_chain ((mutex_t *) thread->blocked_on, thread->priority);
+    }
 }
 
 void condvar_init (condvar_t * const condvar)
@@ -232,7 +347,7 @@ void condvar_signal (condvar_t * const cond)
     /* Unblock the first in the queue. */
     if (cond->wait_queue_head)
     {
-        thread_t * const wake_thread = wait_queue_popfront (&cond->wait_queue_head, &cond->wait_queue_tail);
+        thread_t * const wake_thread = wait_queue_popmax (&cond->wait_queue_head, &cond->wait_queue_tail);
         thread_unblock (wake_thread);
     }
 
@@ -248,7 +363,7 @@ void condvar_broadcast (condvar_t * const cond)
     /* Unlock all in the queue. */
     while (cond->wait_queue_head)
     {
-        thread_t * const wake_thread = wait_queue_popfront (&cond->wait_queue_head, &cond->wait_queue_tail);
+        thread_t * const wake_thread = wait_queue_popmax (&cond->wait_queue_head, &cond->wait_queue_tail);
         thread_unblock (wake_thread);
     }
 
@@ -1,6 +1,7 @@
-#include "alienos/kernel/thread.h"
+#include "alienos/kernel/thread_internal.h"
 #include "alienos/kernel/kernel.h"
 #include "alienos/mem/kmalloc.h"
+#include "alienos/mem/slab.h"
 #include "alienos/io/interrupt.h"
 #include "alienos/mem/gdt.h"
 #include "alienos/kernel/eflags.h"
@@ -9,32 +10,44 @@
 #include "alienos/io/timer.h"
 #include "alienos/kernel/synch.h"
 
-/* TODO: for performance we should add a simple free list allocator for allocating space for threads. */
+/* Thread control blocks of created threads are allocated from here. */
+static kmem_cache_t thread_cache;
 
 /* All allocated threads (including idle and main threads) will sit here until deallocated when cleaned up. */
 static tlistnode_t *all_threads = NULL;
 static mutex_t all_threads_lock;
 
-/* Lock thread lists. Blocked threads will sit in a separate queue defined in the synchronization primitive. */
-static tlistnode_t  *ready_threads = NULL;      /* TODO: We need this list to be double ended */
+/* Lock thread lists. Blocked threads will sit in a separate queue defined in the synchronization primitive.
+   Ready threads are kept by the scheduling policy, see thread_internal.h. */
+static uint32_t ready_cnt = 0;
+
+/* Set by thread_yield(), so the scheduler can tell a yield from a timer tick. */
+static volatile bool thread_yielding = false;
+
 static tlistnode_t *sleeping_threads = NULL;
 static tlistnode_t *zombie_threads = NULL;
 static mutex_t local_threads_lock;
 
+/* Reaper thread deallocating zombie threads, thread_exit() wakes it up. */
+static semaphore_t reaper_sem;
+static thread_t *reaper_thread = NULL;
+
 thread_t *current_thread = NULL;
 static thread_t _idle_thread = {0};
 static uint8_t _idle_thread_stack[THREAD_STACK_SPACE] = {0};
 static thread_t *idle_thread = &_idle_thread;
 
+/* Stacks of cleaned up threads waiting to be reused. Interrupts must be disabled while touching it. */
+static void *stack_pool[THREAD_STACK_POOL_SIZE];
+static uint32_t stack_pool_cnt = 0;
+static uint32_t stack_pool_size = THREAD_STACK_POOL_SIZE;
+static struct ThreadStackStats stack_stats = {0};
+
 /* Print threads in list. Must be synchronized externally. */
 static void print_threads (const tlistnode_t *head)
 {
-    /* Useful headers if we detect them. Blocked lists will not be detected. */
-    if (head == ready_threads)
-    {
-        printf ("ready threads: ");
-    }
-    else if (head == sleeping_threads)
+    /* Useful headers if we detect them. Blocked and ready lists will not be detected. */
+    if (head == sleeping_threads)
     {
         printf ("sleeping threads: ");
     }
@@ -120,56 +133,144 @@ static void thread_list_remove (tlistnode_t ** const head, tlistnode_t * const n
     node->prev = NULL;
 }
 
-/* Deallocates all threads in the zombie list. Must be synchronized externally. */
-static void clean_zombies ()
+/* Panic if a thread ran past the bottom of it's stack. The main thread runs on the boot stack, which has no
+   canary. */
+static void thread_stack_check (const thread_t * const thread)
+{
+    kernel_assert (!thread->stack_base || *((const uint32_t *) thread->stack_base) == THREAD_STACK_CANARY,
+                   "thread_stack_check(): Thread %u overflowed it's stack", thread->tid);
+}
+
+/* Take a stack from the pool, or the kernel heap if the pool is empty. Returns NULL if out of memory. */
+static void *thread_stack_alloc (void)
+{
+    const bool interrupts = interrupt_disable ();
+    void *stack_base = NULL;
+    if (stack_pool_cnt > 0)
+    {
+        stack_base = stack_pool[--stack_pool_cnt];
+        stack_stats.pool_hit_cnt++;
+    }
+    else
+    {
+        stack_stats.pool_miss_cnt++;
+    }
+    interrupt_restore (interrupts);
+
+    if (!stack_base)
+    {
+        stack_base = kpage_alloc (THREAD_STACK_SPACE);
+    }
+    if (stack_base)
+    {
+        *((uint32_t *) stack_base) = THREAD_STACK_CANARY;
+    }
+    return stack_base;
+}
+
+/* Give a stack back to the pool, or the kernel heap if the pool is full. Interrupts must be enabled, kfree()
+   can block on the kernel heap lock. */
+static void thread_stack_free (void * const stack_base)
+{
+    const bool interrupts = interrupt_disable ();
+    const bool pooled = stack_pool_cnt < stack_pool_size;
+    if (pooled)
+    {
+        stack_pool[stack_pool_cnt++] = stack_base;
+    }
+    else
+    {
+        stack_stats.pool_free_cnt++;
+    }
+    interrupt_restore (interrupts);
+
+    if (!pooled)
+    {
+        kfree (stack_base);
+    }
+}
+
+/* Hand a thread that became ready to the scheduling policy. Must be synchronized externally. */
+static void thread_ready_push (thread_t * const thread)
+{
+    sched_enqueue (thread);
+    ready_cnt++;
+}
+
+/* Take a ready thread back from the scheduling policy. Must be synchronized externally. */
+static void thread_ready_remove (thread_t * const thread)
 {
+    sched_dequeue (thread);
+    ready_cnt--;
+}
+
+/* Deallocates all threads in the zombie list. Only the reaper thread may call this, freeing a thread takes the
+   kernel heap lock, which the timer interrupt must never do. Synchronized internally. */
+static void clean_zombies (void)
+{
+    /* Take the whole list, the timer interrupt adds exiting threads to it. A thread is only added once it has
+       been switched away from, so none of them is running. */
+    mutex_acquire (&local_threads_lock);
+    const bool interrupts = interrupt_disable ();
     tlistnode_t *zombie = zombie_threads;
+    zombie_threads = NULL;
+    interrupt_restore (interrupts);
+    mutex_release (&local_threads_lock);
+
     while (zombie)
     {
         thread_t * const thread = zombie->thread;
         zombie = zombie->next;
         kernel_assert (thread->status == ThreadStatus_Zombie,
                        "clean_zombies(): Expected thread in zombie list to be a zombie thread");
-        kernel_assert (thread != idle_thread, "clean_zombies(): trying to deallocate the idle thread");
-
-        /* We must never deallocate the current thread. */
-        if (thread != current_thread)
-        {
-            /* Free up space. */
-            unsafe_printf ("Cleaning up Thread %u\n", thread->tid);
-            thread_list_remove (&zombie_threads, &thread->local_list);
-            thread_list_remove (&all_threads, &thread->all_list);
-            kfree (thread->stack_base);
-            kfree (thread);
-        }
+        kernel_assert (thread != idle_thread && thread != current_thread,
+                       "clean_zombies(): trying to deallocate the idle or current thread");
+
+        /* Free up space. The thread stays counted until it's stack is back in the pool. */
+        printf ("Cleaning up Thread %u\n", thread->tid);
+        kmalloc_magazines_flush (&thread->kmalloc_magazines);
+        thread_stack_check (thread);
+        thread_stack_free (thread->stack_base);
+
+        mutex_acquire (&all_threads_lock);
+        thread_list_remove (&all_threads, &thread->all_list);
+        mutex_release (&all_threads_lock);
+        kmem_cache_free (&thread_cache, thread);
     }
 }
 
-/* Finds and removes a thread from the ready list. Must be synchronized externally. */
-static thread_t *find_ready_thread ()
+/* Reaper thread. Sleeps until a thread exits. */
+static void thread_reaper (void)
 {
-    /* Take care of any dead threads and deallocate resources. */
-    clean_zombies ();
+    while (true)
+    {
+        semaphore_down (&reaper_sem);
+        clean_zombies ();
+    }
+}
 
-    /* No threads in ready list, so we must either stay on current thread if possible or switch to
-       the idle thread as backup. */
-    if (!ready_threads)
+/* Finds and removes a thread from the ready list. 'ticked' is true if a timer tick rather than a yield
+   got here. Must be synchronized externally. */
+static thread_t *find_ready_thread (const bool ticked)
+{
+    /* The policy charges the current thread for the tick, a yield gives up the rest of the time slice. */
+    const bool running = current_thread->status == ThreadStatus_Running && current_thread != idle_thread;
+    const bool slice_left = ticked && sched_tick (running ? current_thread : NULL);
+    if (running && !sched_preempts (current_thread, slice_left))
     {
-        return (current_thread->status == ThreadStatus_Running) ? current_thread : idle_thread;
+        return current_thread;
     }
 
-    /* Search for the last thread in the ready list. Since we insert threads at the front,
-       we must remove from the end. */
-    tlistnode_t *ready = ready_threads;
-    while (ready->next)
+    /* If no thread is ready, we must either stay on current thread if possible or switch to the idle thread
+       as backup. */
+    thread_t * const thread = sched_pick_next ();
+    if (!thread)
     {
-        kernel_assert (ready->next->prev == ready, "find_ready_thread(): linked list broken");
-        ready = ready->next;
+        return (current_thread->status == ThreadStatus_Running) ? current_thread : idle_thread;
     }
 
-    /* Remove from ready lists. */
-    thread_list_remove (&ready_threads, ready);
-    return ready->thread;
+    ready_cnt--;
+    return thread;
 }
 
 /* Synchronized externally (interrupt disabled since timer IRQ handles it). Do not call this outside
@@ -185,6 +286,7 @@ static void schedule (thread_t * const next_thread)
     }
 
     thread_t * const old_thread = current_thread;
+    thread_stack_check (old_thread);
 
     /* If old thread is the idle thread, we don't want to add to any of the local lists. */
     if (old_thread == idle_thread)
@@ -199,7 +301,7 @@ static void schedule (thread_t * const next_thread)
         {
             case ThreadStatus_Running:
                 old_thread->status = ThreadStatus_Ready;
-                thread_list_add (&ready_threads, &old_thread->local_list);
+                thread_ready_push (old_thread);
                 break;
             case ThreadStatus_Sleeping:
                 thread_list_add (&sleeping_threads, &old_thread->local_list);
@@ -229,7 +331,10 @@ static void schedule (thread_t * const next_thread)
 /* Only the timer interrupt handler/s may call this. */
 void scheduler_next (void)
 {
-    schedule (find_ready_thread ());
+    /* A yield gives up the rest of the time slice, a timer tick only ends it once it is used up. */
+    const bool yielded = thread_yielding;
+    thread_yielding = false;
+    schedule (find_ready_thread (!yielded));
 }
 
 /* Returned to implicitly by the thread. */
@@ -240,6 +345,7 @@ static void thread_exit (void)
     kernel_assert (current_thread != idle_thread, "thread_exit: idle thread exiting");
 
     unsafe_printf ("Thread %u exiting\n", current_thread->tid);
+    semaphore_up (&reaper_sem);
     current_thread->status = ThreadStatus_Zombie;
     thread_yield ();
 
@@ -249,7 +355,8 @@ static void thread_exit (void)
 
 /* Allocate and initialize a thread. */
 static void internal_thread_init (void (* const entry_point) (void *arg), void * const arg,
-                                  void * const stack_base, void *stackptr, thread_t * const thread)
+                                  void * const stack_base, void *stackptr, const uint32_t priority,
+                                  thread_t * const thread)
 {
     /* TID 0 reserved for initial main thread. */
     static uint32_t next_tid = 1;
@@ -290,10 +397,19 @@ static void internal_thread_init (void (* const entry_point) (void *arg), void *
     thread->tid = next_tid++;
     thread->esp = (uintptr_t) stack;
     thread->status = ThreadStatus_Ready;
+    thread->exit_code = 0;
+    thread->priority = priority;
+    thread->base_priority = priority;
+    thread->top_priority = priority;
+    thread->slice_ticks = 0;
+    thread->boost_epoch = 0;
+    thread->vruntime = 0;
+    thread->held_mutexes = NULL;
     thread->stack_base = stack_base;
     thread->wakeup_ticks = 0;
     thread->blocked_on = NULL;
     thread->blocker_type = BlockerType_None;
+    thread->kmalloc_magazines = (struct KMMagazines) {0};
     thread_listnode_init (&thread->all_list, thread);
     thread_listnode_init (&thread->local_list, thread);
 
@@ -309,6 +425,7 @@ void thread_main_init (void)
     /* Initialize the synchronization primitives. */
     mutex_init (&all_threads_lock);
     mutex_init (&local_threads_lock);
+    kmem_cache_init (&thread_cache, "thread_t", sizeof (thread_t), 0, NULL);
 
     /* Initialize main thread as whoever called this. At this point no other thread should have
        been created. */
@@ -320,6 +437,9 @@ void thread_main_init (void)
     main_thread->blocked_on = NULL;
     main_thread->blocker_type = BlockerType_None;
     main_thread->wakeup_ticks = 0;
+    main_thread->priority = THREAD_PRIORITY_DEFAULT;
+    main_thread->base_priority = THREAD_PRIORITY_DEFAULT;
+    main_thread->top_priority = THREAD_PRIORITY_DEFAULT;
 
     thread_listnode_init (&main_thread->all_list, main_thread);
     thread_listnode_init (&main_thread->local_list, main_thread);
@@ -330,34 +450,50 @@ void thread_main_init (void)
     kernel_assert (current_thread->tid == 0, "thread_main_init(): expect main thread to have tid 0");
 
     /* Create the idle thread. */
+    *((uint32_t *) _idle_thread_stack) = THREAD_STACK_CANARY;
     internal_thread_init ((void (*)(void *)) cpu_idle_loop, NULL, _idle_thread_stack,
-                          &_idle_thread_stack[THREAD_STACK_SPACE], idle_thread);
+                          &_idle_thread_stack[THREAD_STACK_SPACE], THREAD_PRIORITY_MIN, idle_thread);
     thread_list_add (&all_threads, &idle_thread->all_list);
     kernel_assert (idle_thread->tid == 1, "thread_main_init(): expect idle thread to have tid 1");
+
+    /* Exited threads are deallocated by the reaper, it runs ahead of everything else so they are gone soon. */
+    semaphore_init (&reaper_sem, 0);
+    reaper_thread = thread_create_ex ((void (*)(void *)) thread_reaper, NULL, THREAD_PRIORITY_MAX);
+    kernel_assert (reaper_thread, "thread_main_init(): failed to create reaper thread");
 }
 
-thread_t *thread_create_arg (void (* const entry_point) (void *), void * const arg)
+thread_t *thread_create_ex (void (* const entry_point) (void *), void * const arg, const uint32_t priority)
 {
+    kernel_assert (priority <= THREAD_PRIORITY_MAX, "thread_create_ex(): priority %u out of range", priority);
+
     /* Allocate space for stack and thread. */
-    void * const stack_base = kcalloc (1, THREAD_STACK_SPACE);
+    void * const stack_base = thread_stack_alloc ();
     void * const stack = (void *) (((uintptr_t) stack_base) + THREAD_STACK_SPACE);
-    thread_t * const thread = kcalloc (1, sizeof (thread_t));
+    thread_t * const thread = kmem_cache_alloc (&thread_cache);
 
-    kernel_assert (stack_base && thread, "internal_thread_init(): kcalloc() failed");
+    kernel_assert (stack_base && thread, "thread_create_ex(): failed to allocate thread");
 
-    internal_thread_init (entry_point, arg, stack_base, stack, thread);
+    internal_thread_init (entry_point, arg, stack_base, stack, priority, thread);
 
     mutex_acquire (&all_threads_lock);
     thread_list_add (&all_threads, &thread->all_list);
     mutex_release (&all_threads_lock);
 
+    /* The timer interrupt touches the ready queues too. */
     mutex_acquire (&local_threads_lock);
-    thread_list_add (&ready_threads, &thread->local_list);
+    const bool interrupts = interrupt_disable ();
+    thread_ready_push (thread);
+    interrupt_restore (interrupts);
     mutex_release (&local_threads_lock);
 
     return thread;
 }
 
+thread_t *thread_create_arg (void (* const entry_point) (void *), void * const arg)
+{
+    return thread_create_ex (entry_point, arg, THREAD_PRIORITY_DEFAULT);
+}
+
 thread_t *thread_create (void (* const entry_point) (void))
 {
     return thread_create_arg ((void (*)(void *)) entry_point, NULL);
@@ -365,8 +501,12 @@ thread_t *thread_create (void (* const entry_point) (void))
 
 void thread_yield (void)
 {
-    /* Trigger IRQ0 to schedule new thread. */
+    /* Trigger IRQ0 to schedule new thread. Interrupts are disabled so a timer tick can not take the flag
+       first. */
+    const bool interrupts = interrupt_disable ();
+    thread_yielding = true;
     asm volatile ("int $0x20");
+    interrupt_restore (interrupts);
 }
 
 void thread_unblock (thread_t * const thread)
@@ -377,16 +517,14 @@ void thread_unblock (thread_t * const thread)
     thread->status = ThreadStatus_Ready;
     thread->blocked_on = NULL;
     thread->blocker_type = BlockerType_None;
-    thread_list_add (&ready_threads, &thread->local_list);
+    thread_ready_push (thread);
 }
 
 void thread_sleep (const uint32_t ticks)
 {
-    printf ("Thread %u Sleep for %u ticks\n", current_thread->tid, ticks);
     current_thread->wakeup_ticks = timer_ticks + ticks;
     current_thread->status = ThreadStatus_Sleeping;
     thread_yield ();
-    printf ("Thread %u woke up after %u ticks\n", current_thread->tid, ticks);
 }
 
 /* Synchronized because timer interrupt handler calls this (interrupt disabled). */
@@ -404,7 +542,7 @@ void thread_timer_tick (void)
         {
             thread_list_remove (&sleeping_threads, &thread->local_list);
             thread->status = ThreadStatus_Ready;
-            thread_list_add (&ready_threads, &thread->local_list);
+            thread_ready_push (thread);
         }
     }
 }
@@ -426,15 +564,7 @@ uint32_t thread_count (void)
 uint32_t thread_count_ready (void)
 {
     mutex_acquire (&local_threads_lock);
-
-    uint32_t count = 0;
-    const tlistnode_t *cur = ready_threads;
-    while (cur)
-    {
-        cur = cur->next;
-        count++;
-    }
-
+    const uint32_t count = ready_cnt;
     mutex_release (&local_threads_lock);
     return count;
 }
@@ -483,6 +613,87 @@ thread_t *thread_get_by_tid (const tid_t tid)
     return node->thread;
 }
 
+void thread_set_priority (thread_t * const thread, const uint32_t priority)
+{
+    kernel_assert (priority <= THREAD_PRIORITY_MAX, "thread_set_priority(): priority %u out of range", priority);
+
+    /* Priorities donated through held mutexes stay in effect until the mutexes are released. A raised
+       priority is passed on to the holder of the mutex the thread waits on. */
+    const bool interrupts = interrupt_disable ();
+    thread->top_priority = priority;
+    thread->base_priority = priority;
+    thread->slice_ticks = 0;
+    const uint32_t donated = mutex_donated_priority (thread);
+    thread_update_priority (thread, (donated > priority) ? donated : priority);
+    mutex_donate (thread);
+    interrupt_restore (interrupts);
+
+    thread_preempt ();
+}
+
+void thread_update_priority (thread_t * const thread, const uint32_t priority)
+{
+    /* Ready threads are taken back from the scheduling policy and handed to it again at the new priority. */
+    if (thread->status == ThreadStatus_Ready && thread != idle_thread)
+    {
+        thread_ready_remove (thread);
+        thread->priority = priority;
+        thread_ready_push (thread);
+    }
+    else
+    {
+        thread->priority = priority;
+    }
+}
+
+void thread_preempt (void)
+{
+    const bool interrupts = interrupt_disable ();
+    const bool preempt = sched_preempts (current_thread, true);
+    interrupt_restore (interrupts);
+
+    if (preempt)
+    {
+        thread_yield ();
+    }
+}
+
+uint32_t thread_set_stack_pool_size (const uint32_t size)
+{
+    bool interrupts = interrupt_disable ();
+    const uint32_t old_size = stack_pool_size;
+    stack_pool_size = (size < THREAD_STACK_POOL_SIZE) ? size : THREAD_STACK_POOL_SIZE;
+    interrupt_restore (interrupts);
+
+    /* Free the stacks above the new limit one at a time with interrupts enabled, kfree() can block on the
+       kernel heap lock. */
+    while (true)
+    {
+        interrupts = interrupt_disable ();
+        void * const stack_base = (stack_pool_cnt > stack_pool_size) ? stack_pool[--stack_pool_cnt] : NULL;
+        stack_stats.pool_free_cnt += (stack_base != NULL);
+        interrupt_restore (interrupts);
+
+        if (!stack_base)
+        {
+            break;
+        }
+        kfree (stack_base);
+    }
+
+    return old_size;
+}
+
+struct ThreadStackStats thread_stack_getstats (void)
+{
+    const bool interrupts = interrupt_disable ();
+    struct ThreadStackStats stats = stack_stats;
+    stats.pooled_cnt = stack_pool_cnt;
+    stats.pool_size = stack_pool_size;
+    interrupt_restore (interrupts);
+    return stats;
+}
+
 void thread_debug_synch_dependencies ()
 {
     mutex_acquire (&all_threads_lock);
@@ -0,0 +1,402 @@
+/* Fair share scheduling policy (THREAD_SCHED_FAIR). Every thread is charged virtual runtime for the timer
+   ticks it runs, scaled down by the weight of it's priority, and the ready thread with the least virtual
+   runtime runs next. Over time every runnable thread gets CPU time in proportion to it's weight. Ready threads
+   are kept in a red-black tree ordered by virtual runtime, ties broken by tid, the tree links live in the
+   thread.
+
+   Weights are the nice levels of Linux's completely fair scheduler, see sched_prio_to_weight in
+   kernel/sched/core.c. Introduction to Algorithms (Cormen et al.), chapter 13. */
+
+#include "alienos/kernel/thread_internal.h"
+#include "alienos/kernel/kernel.h"
+
+#ifdef THREAD_SCHED_FAIR
+
+/* Weight of each priority. THREAD_PRIORITY_DEFAULT is nice 0, each priority above it is one nice level
+   lower. */
+static const uint32_t fair_weights[THREAD_PRIORITY_COUNT] =
+{
+    /*  0 */    23,    36,    45,    56,    70,    87,   110,   137,
+    /*  8 */   172,   215,   272,   335,   423,   526,   655,   820,
+    /* 16 */  1024,  1277,  1586,  1991,  2501,  3121,  3906,  4904,
+    /* 24 */  6100,  7620,  9548, 11916, 14949, 18705, 23254, 29154,
+};
+
+_Static_assert (THREAD_PRIORITY_DEFAULT == 16, "fair_weights expects THREAD_PRIORITY_DEFAULT to weigh 1024");
+
+#define FAIR_RED 1u
+
+/* Every ready thread. */
+static thread_t *tree_root = NULL;
+
+/* Never decreases. Threads that wake up are placed relative to it, so time spent sleeping is not made up for
+   by a long run afterwards. */
+static uint64_t min_vruntime = 0;
+
+static inline thread_t *fair_parent (const thread_t * const thread)
+{
+    return (thread_t *) (thread->ready_node.parent & ~FAIR_RED);
+}
+
+static inline void fair_setparent (thread_t * const thread, const thread_t * const parent)
+{
+    thread->ready_node.parent = ((uintptr_t) parent) | (thread->ready_node.parent & FAIR_RED);
+}
+
+/* Missing children are black. */
+static inline bool fair_isred (const thread_t * const thread)
+{
+    return thread && (thread->ready_node.parent & FAIR_RED);
+}
+
+static inline void fair_setred (thread_t * const thread, const bool red)
+{
+    thread->ready_node.parent = (thread->ready_node.parent & ~FAIR_RED) | (red ? FAIR_RED : 0);
+}
+
+/* Tree order, by virtual runtime then by tid. */
+static inline bool fair_less (const thread_t * const a, const thread_t * const b)
+{
+    return a->vruntime < b->vruntime || (a->vruntime == b->vruntime && a->tid < b->tid);
+}
+
+/* Point the link to 'old' in 'parent' (or the root if there is no parent) at 'new'. */
+static void fair_relink (thread_t * const parent, const thread_t * const old, thread_t * const new)
+{
+    if (!parent)
+    {
+        tree_root = new;
+    }
+    else if (parent->ready_node.left == old)
+    {
+        parent->ready_node.left = new;
+    }
+    else
+    {
+        parent->ready_node.right = new;
+    }
+}
+
+/* Rotate 'thread' down to the left, it's right child takes it's place. */
+static void fair_rotate_left (thread_t * const thread)
+{
+    thread_t * const child = thread->ready_node.right;
+    thread->ready_node.right = child->ready_node.left;
+    if (child->ready_node.left)
+    {
+        fair_setparent (child->ready_node.left, thread);
+    }
+
+    fair_setparent (child, fair_parent (thread));
+    fair_relink (fair_parent (thread), thread, child);
+    child->ready_node.left = thread;
+    fair_setparent (thread, child);
+}
+
+/* Rotate 'thread' down to the right, it's left child takes it's place. */
+static void fair_rotate_right (thread_t * const thread)
+{
+    thread_t * const child = thread->ready_node.left;
+    thread->ready_node.left = child->ready_node.right;
+    if (child->ready_node.right)
+    {
+        fair_setparent (child->ready_node.right, thread);
+    }
+
+    fair_setparent (child, fair_parent (thread));
+    fair_relink (fair_parent (thread), thread, child);
+    child->ready_node.right = thread;
+    fair_setparent (thread, child);
+}
+
+/* Put 'new' (which may be NULL) in the place of 'old' in the tree. */
+static void fair_transplant (const thread_t * const old, thread_t * const new)
+{
+    fair_relink (fair_parent (old), old, new);
+    if (new)
+    {
+        fair_setparent (new, fair_parent (old));
+    }
+}
+
+/* Ready thread with the least virtual runtime, NULL if no thread is ready. */
+static thread_t *fair_leftmost (void)
+{
+    thread_t *thread = tree_root;
+    while (thread && thread->ready_node.left)
+    {
+        thread = thread->ready_node.left;
+    }
+    return thread;
+}
+
+/* Insert a thread into the tree. */
+static void fair_insert (thread_t * const thread)
+{
+    thread_t *parent = NULL;
+    thread_t **link = &tree_root;
+    while (*link)
+    {
+        parent = *link;
+        link = fair_less (thread, parent) ? &parent->ready_node.left : &parent->ready_node.right;
+    }
+
+    thread->ready_node.left = NULL;
+    thread->ready_node.right = NULL;
+    thread->ready_node.parent = ((uintptr_t) parent) | FAIR_RED;
+    *link = thread;
+
+    /* Fix two reds in a row. A red parent is never the root, so there is a grandparent. */
+    thread_t *cur = thread;
+    while (fair_isred (fair_parent (cur)))
+    {
+        parent = fair_parent (cur);
+        thread_t * const grandparent = fair_parent (parent);
+        if (parent == grandparent->ready_node.left)
+        {
+            thread_t * const uncle = grandparent->ready_node.right;
+            if (fair_isred (uncle))
+            {
+                fair_setred (parent, false);
+                fair_setred (uncle, false);
+                fair_setred (grandparent, true);
+                cur = grandparent;
+                continue;
+            }
+
+            if (cur == parent->ready_node.right)
+            {
+                cur = parent;
+                fair_rotate_left (cur);
+                parent = fair_parent (cur);
+            }
+            fair_setred (parent, false);
+            fair_setred (grandparent, true);
+            fair_rotate_right (grandparent);
+        }
+        else
+        {
+            thread_t * const uncle = grandparent->ready_node.left;
+            if (fair_isred (uncle))
+            {
+                fair_setred (parent, false);
+                fair_setred (uncle, false);
+                fair_setred (grandparent, true);
+                cur = grandparent;
+                continue;
+            }
+
+            if (cur == parent->ready_node.left)
+            {
+                cur = parent;
+                fair_rotate_right (cur);
+                parent = fair_parent (cur);
+            }
+            fair_setred (parent, false);
+            fair_setred (grandparent, true);
+            fair_rotate_left (grandparent);
+        }
+    }
+
+    fair_setred (tree_root, false);
+}
+
+/* Restore the black height after a black node was taken out above 'cur' (which may be NULL, so it's
+   parent is passed along). */
+static void fair_remove_fixup (thread_t *cur, thread_t *parent)
+{
+    /* The sibling of a node missing a black is never NULL. */
+    while (cur != tree_root && !fair_isred (cur))
+    {
+        if (cur == parent->ready_node.left)
+        {
+            thread_t *sibling = parent->ready_node.right;
+            if (fair_isred (sibling))
+            {
+                fair_setred (sibling, false);
+                fair_setred (parent, true);
+                fair_rotate_left (parent);
+                sibling = parent->ready_node.right;
+            }
+
+            if (!fair_isred (sibling->ready_node.left) && !fair_isred (sibling->ready_node.right))
+            {
+                fair_setred (sibling, true);
+                cur = parent;
+                parent = fair_parent (cur);
+                continue;
+            }
+
+            if (!fair_isred (sibling->ready_node.right))
+            {
+                fair_setred (sibling->ready_node.left, false);
+                fair_setred (sibling, true);
+                fair_rotate_right (sibling);
+                sibling = parent->ready_node.right;
+            }
+            fair_setred (sibling, fair_isred (parent));
+            fair_setred (parent, false);
+            fair_setred (sibling->ready_node.right, false);
+            fair_rotate_left (parent);
+        }
+        else
+        {
+            thread_t *sibling = parent->ready_node.left;
+            if (fair_isred (sibling))
+            {
+                fair_setred (sibling, false);
+                fair_setred (parent, true);
+                fair_rotate_right (parent);
+                sibling = parent->ready_node.left;
+            }
+
+            if (!fair_isred (sibling->ready_node.left) && !fair_isred (sibling->ready_node.right))
+            {
+                fair_setred (sibling, true);
+                cur = parent;
+                parent = fair_parent (cur);
+                continue;
+            }
+
+            if (!fair_isred (sibling->ready_node.left))
+            {
+                fair_setred (sibling->ready_node.right, false);
+                fair_setred (sibling, true);
+                fair_rotate_left (sibling);
+                sibling = parent->ready_node.left;
+            }
+            fair_setred (sibling, fair_isred (parent));
+            fair_setred (parent, false);
+            fair_setred (sibling->ready_node.left, false);
+            fair_rotate_right (parent);
+        }
+
+        cur = tree_root;
+    }
+
+    if (cur)
+    {
+        fair_setred (cur, false);
+    }
+}
+
+/* Remove a thread from the tree. */
+static void fair_remove (thread_t * const thread)
+{
+    thread_t * const left = thread->ready_node.left;
+    thread_t * const right = thread->ready_node.right;
+    kernel_assert (thread == tree_root || fair_parent (thread), "fair_remove(): thread %u is not ready",
+                   thread->tid);
+
+    thread_t *cur;
+    thread_t *parent;
+    bool removed_red = fair_isred (thread);
+    if (!left || !right)
+    {
+        /* At most one child, it takes the thread's place. */
+        cur = left ? left : right;
+        parent = fair_parent (thread);
+        fair_transplant (thread, cur);
+    }
+    else
+    {
+        /* Two children, the next thread in order (leftmost of the right subtree) takes the thread's place. */
+        thread_t *successor = right;
+        while (successor->ready_node.left)
+        {
+            successor = successor->ready_node.left;
+        }
+
+        removed_red = fair_isred (successor);
+        cur = successor->ready_node.right;
+        if (successor == right)
+        {
+            parent = successor;
+        }
+        else
+        {
+            parent = fair_parent (successor);
+            fair_transplant (successor, cur);
+            successor->ready_node.right = right;
+            fair_setparent (right, successor);
+        }
+
+        fair_transplant (thread, successor);
+        successor->ready_node.left = left;
+        fair_setparent (left, successor);
+        fair_setred (successor, fair_isred (thread));
+    }
+
+    if (!removed_red)
+    {
+        fair_remove_fixup (cur, parent);
+    }
+
+    thread->ready_node = (ttreenode_t) {0};
+}
+
+/* A thread that was not ready for a while would be far behind the others, it is placed no further behind
+   than THREAD_FAIR_GRANULARITY. */
+void sched_enqueue (thread_t * const thread)
+{
+    if (min_vruntime > THREAD_FAIR_GRANULARITY && thread->vruntime < min_vruntime - THREAD_FAIR_GRANULARITY)
+    {
+        thread->vruntime = min_vruntime - THREAD_FAIR_GRANULARITY;
+    }
+    fair_insert (thread);
+}
+
+/* Priority changes do not touch the virtual runtime, only how fast it grows from then on. */
+void sched_dequeue (thread_t * const thread)
+{
+    fair_remove (thread);
+}
+
+/* The ready thread that has run least for it's weight. */
+thread_t *sched_pick_next (void)
+{
+    thread_t * const thread = fair_leftmost ();
+    if (thread)
+    {
+        fair_remove (thread);
+    }
+    return thread;
+}
+
+/* Charge the current thread for a timer tick and move min_vruntime up to the least virtual runtime of the
+   runnable threads. Time slices end by virtual runtime rather than ticks, see sched_preempts(). */
+bool sched_tick (thread_t * const current)
+{
+    const thread_t * const leftmost = fair_leftmost ();
+    if (current)
+    {
+        current->vruntime += (uint32_t) THREAD_FAIR_TICK_VRUNTIME * fair_weights[THREAD_PRIORITY_DEFAULT]
+                             / fair_weights[current->priority];
+    }
+
+    uint64_t vruntime = min_vruntime;
+    if (current && leftmost)
+    {
+        vruntime = (current->vruntime < leftmost->vruntime) ? current->vruntime : leftmost->vruntime;
+    }
+    else if (current || leftmost)
+    {
+        vruntime = current ? current->vruntime : leftmost->vruntime;
+    }
+    min_vruntime = (vruntime > min_vruntime) ? vruntime : min_vruntime;
+    return true;
+}
+
+/* A timer tick switches once the current thread is THREAD_FAIR_GRANULARITY ahead of the thread that has run
+   least, a yield switches to any ready thread. */
+bool sched_preempts (const thread_t * const current, const bool slice_left)
+{
+    const thread_t * const leftmost = fair_leftmost ();
+    if (!leftmost)
+    {
+        return false;
+    }
+    return !slice_left || current->vruntime > leftmost->vruntime + THREAD_FAIR_GRANULARITY;
+}
+
+#endif /* THREAD_SCHED_FAIR */
\ No newline at end of file
@@ -0,0 +1,206 @@
+/* Priority scheduling policies (THREAD_SCHED_PRIORITY and THREAD_SCHED_MLFQ). Ready threads sit in a queue
+   per priority and the highest nonempty one is found with a bit scan of a bitmap of them, threads of the same
+   priority take turns in FIFO order. The MLFQ policy also moves threads between priorities by how much of
+   their time slices they use. */
+
+#include "alienos/kernel/thread_internal.h"
+#include "alienos/kernel/kernel.h"
+#include "alienos/kernel/synch.h"
+
+#ifndef THREAD_SCHED_FAIR
+
+/* Double ended thread list, threads are appended to the tail and taken from the head. */
+typedef struct ThreadQueue
+{
+    tlistnode_t *head;
+    tlistnode_t *tail;
+    uint32_t cnt;                   /* How many threads are in the queue. */
+} tqueue_t;
+
+/* Ready threads sit in the queue of their priority, bit i of ready_bitmap is set if ready_threads[i] is not
+   empty. */
+static tqueue_t ready_threads[THREAD_PRIORITY_COUNT] = {0};
+static uint32_t ready_bitmap = 0;
+
+#ifdef THREAD_SCHED_MLFQ
+/* Incremented by every priority boost, threads catch up with it when they are next scheduled. */
+static uint32_t boost_epoch = 0;
+static uint32_t boost_ticks = 0;
+#endif
+
+/* Append node to the tail of a thread queue. Must be synchronized externally. */
+static void thread_queue_push (tqueue_t * const queue, tlistnode_t * const node)
+{
+    node->next = NULL;
+    node->prev = queue->tail;
+    if (queue->tail)
+    {
+        queue->tail->next = node;
+    }
+    else
+    {
+        queue->head = node;
+    }
+
+    queue->tail = node;
+    queue->cnt++;
+}
+
+/* Remove node from anywhere in a thread queue. Must be synchronized externally. */
+static void thread_queue_remove (tqueue_t * const queue, tlistnode_t * const node)
+{
+    if (node->prev)
+    {
+        node->prev->next = node->next;
+    }
+    else
+    {
+        kernel_assert (queue->head == node, "thread_queue_remove(): Expected node without prev pointer to be head");
+        queue->head = node->next;
+    }
+
+    if (node->next)
+    {
+        node->next->prev = node->prev;
+    }
+    else
+    {
+        queue->tail = node->prev;
+    }
+
+    node->next = NULL;
+    node->prev = NULL;
+    queue->cnt--;
+}
+
+/* Highest priority of the ready threads, -1 if no thread is ready. Must be synchronized externally. */
+static inline int32_t thread_ready_priority (void)
+{
+    return ready_bitmap ? 31 - __builtin_clz (ready_bitmap) : -1;
+}
+
+#ifdef THREAD_SCHED_MLFQ
+/* Put a thread back at it's given priority with a fresh time slice if a boost happened since it was last
+   scheduled. Must be synchronized externally. */
+static void thread_mlfq_catchup (thread_t * const thread)
+{
+    if (thread->boost_epoch == boost_epoch)
+    {
+        return;
+    }
+
+    const uint32_t donated = mutex_donated_priority (thread);
+    thread->boost_epoch = boost_epoch;
+    thread->slice_ticks = 0;
+    thread->base_priority = thread->top_priority;
+    thread->priority = (donated > thread->base_priority) ? donated : thread->base_priority;
+}
+#endif
+
+/* Add thread to the tail of the ready queue of it's priority. */
+void sched_enqueue (thread_t * const thread)
+{
+#ifdef THREAD_SCHED_MLFQ
+    thread_mlfq_catchup (thread);
+#endif
+    thread_queue_push (&ready_threads[thread->priority], &thread->local_list);
+    ready_bitmap |= 1u << thread->priority;
+}
+
+/* Remove a ready thread from the ready queue of it's priority. */
+void sched_dequeue (thread_t * const thread)
+{
+    tqueue_t * const queue = &ready_threads[thread->priority];
+    thread_queue_remove (queue, &thread->local_list);
+    if (!queue->head)
+    {
+        ready_bitmap &= ~(1u << thread->priority);
+    }
+}
+
+/* Threads are appended to the tail, so the head of the highest priority queue has waited the longest. */
+thread_t *sched_pick_next (void)
+{
+    const int32_t priority = thread_ready_priority ();
+    if (priority < 0)
+    {
+        return NULL;
+    }
+
+    thread_t * const thread = ready_threads[priority].head->thread;
+    sched_dequeue (thread);
+    return thread;
+}
+
+#ifdef THREAD_SCHED_MLFQ
+/* Put every ready thread back at it's given priority. Threads that are not ready catch up when they are next
+   scheduled. Must be synchronized externally. */
+static void thread_mlfq_boost (void)
+{
+    boost_epoch++;
+
+    tqueue_t boosted = {0};
+    for (uint32_t priority = 0; priority < THREAD_PRIORITY_COUNT; priority++)
+    {
+        while (ready_threads[priority].head)
+        {
+            thread_t * const thread = ready_threads[priority].head->thread;
+            sched_dequeue (thread);
+            thread_queue_push (&boosted, &thread->local_list);
+        }
+    }
+
+    while (boosted.head)
+    {
+        thread_t * const thread = boosted.head->thread;
+        thread_queue_remove (&boosted, &thread->local_list);
+        sched_enqueue (thread);
+    }
+}
+
+/* Charge the current thread for a timer tick, dropping it a level if it used up it's time slice. */
+bool sched_tick (thread_t * const current)
+{
+    if (++boost_ticks >= THREAD_MLFQ_BOOST_TICKS)
+    {
+        boost_ticks = 0;
+        thread_mlfq_boost ();
+    }
+
+    if (!current)
+    {
+        return false;
+    }
+
+    thread_mlfq_catchup (current);
+    const uint32_t level = current->top_priority - current->base_priority;
+    if (++current->slice_ticks < ((uint32_t) THREAD_MLFQ_QUANTUM << level))
+    {
+        return true;
+    }
+
+    current->slice_ticks = 0;
+    if (level < THREAD_MLFQ_LEVELS - 1 && current->base_priority > THREAD_PRIORITY_MIN)
+    {
+        const uint32_t donated = mutex_donated_priority (current);
+        current->base_priority--;
+        current->priority = (donated > current->base_priority) ? donated : current->base_priority;
+    }
+    return false;
+}
+#else
+/* Every timer tick ends the time slice, threads of the same priority switch. */
+bool sched_tick (thread_t * const current)
+{
+    (void) current;
+    return false;
+}
+#endif
+
+/* A thread of a higher priority always runs first, one of the same priority once the slice is over. */
+bool sched_preempts (const thread_t * const current, const bool slice_left)
+{
+    return (int32_t) current->priority + slice_left <= thread_ready_priority ();
+}
+
+#endif /* THREAD_SCHED_FAIR */
\ No newline at end of file
@@ -0,0 +1,182 @@
+#include "alienos/mem/arena.h"
+#include "alienos/mem/kmalloc.h"
+#include "alienos/kernel/kernel.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#define KARENA_ALIGN_UP(x, align) (((x) + (align) - 1) & ~((uintptr_t) (align) - 1))
+
+/* Header at the start of every chunk, the allocations follow. */
+typedef struct KArenaChunk
+{
+    struct KArenaChunk *next;           /* Next older chunk. */
+    size_t size;                        /* Size of the chunk, including this header. */
+} __attribute__ ((aligned (KARENA_ALIGN))) karena_chunk_t;
+
+/* First byte of a chunk allocations are bumped out of. */
+static inline uint8_t *arena_chunk_begin (karena_chunk_t * const chunk)
+{
+    return (uint8_t *) (chunk + 1);
+}
+
+/* End of a chunk. */
+static inline uint8_t *arena_chunk_end (karena_chunk_t * const chunk)
+{
+    return ((uint8_t *) chunk) + chunk->size;
+}
+
+/* Fill released memory with KMALLOC_POISON_BYTE when built with paranoid hardening, so a pointer kept past
+   a reset or restore reads garbage instead of stale data. */
+static inline void arena_poison (uint8_t * const begin, uint8_t * const end)
+{
+#if KMALLOC_HARDENING_LEVEL >= KMALLOC_HARDENING_LEVEL_PARANOID
+    memset (begin, KMALLOC_POISON_BYTE, end - begin);
+#else
+    (void) begin;
+    (void) end;
+#endif
+}
+
+/* Return the newest chunk to the kernel heap. Must be synchronized externally. */
+static void arena_chunk_pop (karena_t * const arena)
+{
+    karena_chunk_t * const chunk = arena->chunks;
+    arena->chunks = chunk->next;
+    kfree (chunk);
+
+    arena->stats.chunk_cnt--;
+    arena->stats.chunk_free_cnt++;
+}
+
+/* Take a new chunk from the kernel heap with room for 'size' bytes aligned to 'align' bytes and make it
+   the newest. Returns where the allocation goes or NULL if the kernel heap is out of memory. Must be
+   synchronized externally. */
+static uint8_t *arena_grow (karena_t * const arena, const size_t size, const size_t align)
+{
+    /* The chunk body starts KARENA_ALIGN aligned, larger alignments may need padding. */
+    const size_t padding = align - KARENA_ALIGN;
+    if (size > SIZE_MAX - sizeof (karena_chunk_t) - padding)
+    {
+        return NULL;
+    }
+
+    const size_t needed = sizeof (karena_chunk_t) + padding + size;
+    const size_t chunk_size = (needed > arena->chunk_size) ? needed : arena->chunk_size;
+    karena_chunk_t * const chunk = kmalloc (chunk_size);
+    if (!chunk)
+    {
+        return NULL;
+    }
+
+    chunk->size = chunk_size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->end = arena_chunk_end (chunk);
+
+    arena->stats.chunk_cnt++;
+    arena->stats.chunk_alloc_cnt++;
+    return (uint8_t *) KARENA_ALIGN_UP ((uintptr_t) arena_chunk_begin (chunk), align);
+}
+
+void karena_init (karena_t * const arena, const char * const name, const size_t chunk_size)
+{
+    kernel_assert (chunk_size == 0 || chunk_size > sizeof (karena_chunk_t),
+                   "karena_init() - Chunk size %u of arena '%s' leaves no room for allocations.", chunk_size, name);
+
+    arena->name = name;
+    arena->chunk_size = chunk_size ? chunk_size : KARENA_CHUNK_SIZE;
+    arena->chunks = NULL;
+    arena->cur = NULL;
+    arena->end = NULL;
+    memset (&arena->stats, 0, sizeof (arena->stats));
+}
+
+void karena_destroy (karena_t * const arena)
+{
+    while (arena->chunks)
+    {
+        arena_chunk_pop (arena);
+    }
+
+    arena->cur = NULL;
+    arena->end = NULL;
+}
+
+void *karena_alloc (karena_t * const arena, const size_t size)
+{
+    return karena_alloc_aligned (arena, size, KARENA_ALIGN);
+}
+
+void *karena_alloc_aligned (karena_t * const arena, const size_t size, size_t align)
+{
+    kernel_assert (align && (align & (align - 1)) == 0, "karena_alloc_aligned() - Alignment %u is not a power of 2.",
+                   align);
+    align = (align < KARENA_ALIGN) ? KARENA_ALIGN : align;
+
+    uint8_t *ptr = (uint8_t *) KARENA_ALIGN_UP ((uintptr_t) arena->cur, align);
+    if (!arena->chunks || ptr > arena->end || size > (size_t) (arena->end - ptr))
+    {
+        ptr = arena_grow (arena, size, align);
+        if (!ptr)
+        {
+            return NULL;
+        }
+    }
+
+    arena->cur = ptr + size;
+    arena->stats.allocation_cnt++;
+    arena->stats.allocation_bytes += size;
+    return ptr;
+}
+
+void karena_reset (karena_t * const arena)
+{
+    while (arena->chunks && arena->chunks->next)
+    {
+        arena_chunk_pop (arena);
+    }
+
+    if (arena->chunks)
+    {
+        arena->cur = arena_chunk_begin (arena->chunks);
+        arena->end = arena_chunk_end (arena->chunks);
+        arena_poison (arena->cur, arena->end);
+    }
+
+    arena->stats.reset_cnt++;
+}
+
+karena_savepoint_t karena_save (const karena_t * const arena)
+{
+    return (karena_savepoint_t) {.chunk = arena->chunks, .cur = arena->cur};
+}
+
+void karena_restore (karena_t * const arena, const karena_savepoint_t savepoint)
+{
+    const bool same_chunk = arena->chunks == savepoint.chunk;
+    kernel_assert (!same_chunk || savepoint.cur <= arena->cur,
+                   "karena_restore() - Savepoint of arena '%s' was already released.", arena->name);
+
+    while (arena->chunks != savepoint.chunk)
+    {
+        kernel_assert (arena->chunks, "karena_restore() - Savepoint does not belong to arena '%s'.", arena->name);
+        arena_chunk_pop (arena);
+    }
+
+    if (!savepoint.chunk)
+    {
+        arena->cur = NULL;
+        arena->end = NULL;
+        return;
+    }
+
+    arena->end = arena_chunk_end (savepoint.chunk);
+    arena_poison (savepoint.cur, same_chunk ? arena->cur : arena->end);
+    arena->cur = savepoint.cur;
+}
+
+struct KArenaStats karena_getstats (const karena_t * const arena)
+{
+    return arena->stats;
+}
\ No newline at end of file
@@ -0,0 +1,386 @@
+#include "alienos/mem/page.h"
+#include "alienos/kernel/kernel.h"
+#include "alienos/io/io.h"
+#include "alienos/io/interrupt.h"
+
+extern uint8_t kernel_start;
+extern uint8_t kernel_end;
+
+#ifdef ALIENOS_TEST
+#define DEBUG(...) unsafe_printf (__VA_ARGS__)
+#else
+#define DEBUG(...) ;
+#endif
+
+/* Memory below 1 MiB is left to the BIOS and real mode structures. */
+#define PAGE_LOW_MEMORY 0x100000
+
+/* Highest address that can be managed, the top page is left out so block ends never overflow. */
+#define PAGE_HIGH_MEMORY 0xFFFFF000ull
+
+/* Per page frame state byte. Only the first page of a free or allocated block has a state, every other
+   page (and every page that is not managed) is 0. */
+#define PAGE_STATE_FREE 0x80
+#define PAGE_STATE_ALLOC 0x40
+#define PAGE_STATE_ORDER 0x3F
+
+#define PAGE_ALIGN_UP(x) ((((x) + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE)
+#define PAGE_ALIGN_DOWN(x) (((x) / PAGE_SIZE) * PAGE_SIZE)
+
+/* Link stored in the first page of a free block. */
+typedef struct PageFreeBlock
+{
+    struct PageFreeBlock *next;
+    struct PageFreeBlock *prev;
+} page_free_block_t;
+
+/* Address range left out of the allocator. */
+struct PageRange
+{
+    uint64_t start;
+    uint64_t end;
+};
+
+/* State of every page frame from page_base, page_cnt bytes. Placed right after the kernel image. */
+static uint8_t *page_state;
+static uintptr_t page_base;
+static uint32_t page_cnt;
+
+/* Free blocks of each order. Not ordered. */
+static page_free_block_t *free_area[PAGE_MAX_ORDER + 1] = {0};
+
+static struct PageStats page_stats = {};
+
+/* Get the state byte of the page at 'addr', or NULL if the page is not managed. */
+static inline uint8_t *page_getstate (const uintptr_t addr)
+{
+    if (addr < page_base || (addr - page_base) / PAGE_SIZE >= page_cnt)
+    {
+        return NULL;
+    }
+
+    return &page_state[(addr - page_base) / PAGE_SIZE];
+}
+
+/* Push free block of (1 << order) pages onto it's list. Must be synchronized externally. */
+static void page_push (const uintptr_t addr, const uint32_t order)
+{
+    page_free_block_t * const block = (page_free_block_t *) addr;
+    block->prev = NULL;
+    block->next = free_area[order];
+    if (free_area[order])
+    {
+        free_area[order]->prev = block;
+    }
+    free_area[order] = block;
+
+    *page_getstate (addr) = PAGE_STATE_FREE | order;
+    page_stats.free_pages += 1u << order;
+}
+
+/* Remove free block of (1 << order) pages from it's list. Must be synchronized externally. */
+static void page_remove (const uintptr_t addr, const uint32_t order)
+{
+    page_free_block_t * const block = (page_free_block_t *) addr;
+    if (block->prev)
+    {
+        block->prev->next = block->next;
+    }
+    else
+    {
+        kernel_assert (free_area[order] == block, "page_remove(): block without prev is not head of list");
+        free_area[order] = block->next;
+    }
+
+    if (block->next)
+    {
+        block->next->prev = block->prev;
+    }
+
+    *page_getstate (addr) = 0;
+    page_stats.free_pages -= 1u << order;
+}
+
+/* Add the pages of [start, end) to the free lists, leaving out the reserved ranges. Should be called
+   during init with interrupts disabled. */
+static void page_add_range (uint64_t start, uint64_t end, const struct PageRange * const reserved,
+                            const size_t reserved_cnt)
+{
+    for (size_t i = 0; i < reserved_cnt; i++)
+    {
+        if (start < reserved[i].end && reserved[i].start < end)
+        {
+            page_add_range (start, reserved[i].start, reserved, reserved_cnt);
+            page_add_range (reserved[i].end, end, reserved, reserved_cnt);
+            return;
+        }
+    }
+
+    start = PAGE_ALIGN_UP (start);
+    end = PAGE_ALIGN_DOWN (end);
+    while (start < end)
+    {
+        /* Largest block that is aligned to it's size and fits. */
+        uint32_t order = 0;
+        while (order < PAGE_MAX_ORDER && (start & ((PAGE_SIZE << (order + 1)) - 1)) == 0
+               && start + (PAGE_SIZE << (order + 1)) <= end)
+        {
+            order++;
+        }
+
+        page_push ((uintptr_t) start, order);
+        page_stats.total_pages += 1u << order;
+        start += PAGE_SIZE << order;
+    }
+}
+
+/* Clip an available multiboot region to the managed memory. Returns false if nothing is left. */
+static bool page_clip_region (const multiboot_memory_map_t * const mmap, uint64_t * const start,
+                              uint64_t * const end)
+{
+    *start = mmap->addr;
+    *end = mmap->addr + mmap->len;
+    if (*start < PAGE_LOW_MEMORY)
+    {
+        *start = PAGE_LOW_MEMORY;
+    }
+    if (*end > PAGE_HIGH_MEMORY)
+    {
+        *end = PAGE_HIGH_MEMORY;
+    }
+
+    *start = PAGE_ALIGN_UP (*start);
+    *end = PAGE_ALIGN_DOWN (*end);
+    return mmap->type == MULTIBOOT_MEMORY_AVAILABLE && *start < *end;
+}
+
+/* Get the next entry of the multiboot memory map. */
+static inline const multiboot_memory_map_t *page_next_region (const multiboot_memory_map_t * const mmap)
+{
+    return (const multiboot_memory_map_t *) ((uint32_t) mmap + mmap->size + sizeof (mmap->size));
+}
+
+void page_init (const multiboot_info_t * const mbinfo)
+{
+    kernel_assert (!interrupt_is_enabled (), "page_init(): interrupts are enabled");
+
+    static bool init = false;
+    kernel_assert (!init, "page_init(): already initialized");
+    init = true;
+
+    /* Panic if mmap is not available. */
+    kernel_assert (mbinfo->flags & MULTIBOOT_INFO_MEM_MAP, "page_init(): mmap unavailable");
+
+    const multiboot_memory_map_t * const mmap_begin = (const multiboot_memory_map_t *) mbinfo->mmap_addr;
+    const multiboot_memory_map_t * const mmap_end =
+        (const multiboot_memory_map_t *) (mbinfo->mmap_addr + mbinfo->mmap_length);
+
+    /* Find the span of managed memory and the region holding the kernel. */
+    uint64_t lowest = PAGE_HIGH_MEMORY, highest = 0, kernel_region_end = 0;
+
+    /* https://www.gnu.org/software/grub/manual/multiboot/multiboot.html#Boot-information-format */
+    DEBUG ("Searching Multiboot mmap\n");
+    for (const multiboot_memory_map_t *mmap = mmap_begin; mmap < mmap_end; mmap = page_next_region (mmap))
+    {
+        uint64_t start, end;
+        if (!page_clip_region (mmap, &start, &end))
+        {
+            DEBUG ("> Found memory region: %x, %x (type %u)\n", (uint32_t) mmap->addr,
+                   (uint32_t) (mmap->addr + mmap->len), mmap->type);
+            continue;
+        }
+
+        DEBUG ("> Found memory region: %x, %x\n", (uint32_t) start, (uint32_t) end);
+        lowest = (start < lowest) ? start : lowest;
+        highest = (end > highest) ? end : highest;
+        if (start <= (uintptr_t) &kernel_end && (uintptr_t) &kernel_end < end)
+        {
+            kernel_region_end = end;
+        }
+    }
+
+    kernel_assert (kernel_region_end, "page_init(): failed to find memory region containing the kernel");
+
+    page_base = (uintptr_t) lowest;
+    page_cnt = (uint32_t) ((highest - lowest) / PAGE_SIZE);
+
+    /* The page state array goes after the kernel, and after the multiboot info if the bootloader put it
+       there, since the memory map is read again below. */
+    const struct PageRange boot_info[] = {
+        {(uintptr_t) mbinfo, (uintptr_t) (mbinfo + 1)},
+        {mbinfo->mmap_addr, mbinfo->mmap_addr + mbinfo->mmap_length},
+    };
+    uintptr_t state_begin = PAGE_ALIGN_UP ((uintptr_t) &kernel_end);
+    bool moved = true;
+    while (moved)
+    {
+        moved = false;
+        for (size_t i = 0; i < sizeof (boot_info) / sizeof (boot_info[0]); i++)
+        {
+            if (state_begin < boot_info[i].end && boot_info[i].start < state_begin + page_cnt)
+            {
+                state_begin = PAGE_ALIGN_UP ((uintptr_t) boot_info[i].end);
+                moved = true;
+            }
+        }
+    }
+
+    page_state = (uint8_t *) state_begin;
+    const uintptr_t state_end = PAGE_ALIGN_UP (state_begin + page_cnt);
+    kernel_assert (state_end <= kernel_region_end, "page_init(): no room for page state array");
+
+    for (uint32_t i = 0; i < page_cnt; i++)
+    {
+        page_state[i] = 0;
+    }
+
+    const struct PageRange reserved[] = {
+        {(uintptr_t) &kernel_start, state_end},
+        boot_info[0],
+        boot_info[1],
+    };
+
+    for (const multiboot_memory_map_t *mmap = mmap_begin; mmap < mmap_end; mmap = page_next_region (mmap))
+    {
+        uint64_t start, end;
+        if (page_clip_region (mmap, &start, &end))
+        {
+            page_add_range (start, end, reserved, sizeof (reserved) / sizeof (reserved[0]));
+        }
+    }
+
+    DEBUG ("Page Allocator: %u pages [%x, %x]\n", page_stats.total_pages, page_base,
+           page_base + page_cnt * PAGE_SIZE);
+}
+
+void *page_alloc (const uint32_t order)
+{
+    if (order > PAGE_MAX_ORDER)
+    {
+        return NULL;
+    }
+
+    const bool interrupts = interrupt_disable ();
+
+    /* Smallest free block that is large enough. */
+    uint32_t cur = order;
+    while (cur <= PAGE_MAX_ORDER && !free_area[cur])
+    {
+        cur++;
+    }
+
+    if (cur > PAGE_MAX_ORDER)
+    {
+        interrupt_restore (interrupts);
+        return NULL;
+    }
+
+    const uintptr_t addr = (uintptr_t) free_area[cur];
+    page_remove (addr, cur);
+
+    /* Give back the upper half until the block is the right size. */
+    while (cur > order)
+    {
+        cur--;
+        page_push (addr + (PAGE_SIZE << cur), cur);
+        page_stats.split_cnt++;
+    }
+
+    *page_getstate (addr) = PAGE_STATE_ALLOC | order;
+    page_stats.alloc_cnt++;
+
+    interrupt_restore (interrupts);
+    return (void *) addr;
+}
+
+void page_free (void * const page)
+{
+    if (!page)
+    {
+        return;
+    }
+
+    uintptr_t addr = (uintptr_t) page;
+    uint8_t * const state = page_getstate (addr);
+    kernel_assert (state && (addr % PAGE_SIZE) == 0, "page_free() - Bad pointer.");
+
+    const bool interrupts = interrupt_disable ();
+    kernel_assert (*state & PAGE_STATE_ALLOC, "page_free() - Unallocated memory.");
+
+    uint32_t order = *state & PAGE_STATE_ORDER;
+    *state = 0;
+
+    /* Merge with the buddy while it is a free block of the same size. */
+    while (order < PAGE_MAX_ORDER)
+    {
+        const uintptr_t buddy = addr ^ (PAGE_SIZE << order);
+        const uint8_t * const buddy_state = page_getstate (buddy);
+        if (!buddy_state || *buddy_state != (PAGE_STATE_FREE | order))
+        {
+            break;
+        }
+
+        page_remove (buddy, order);
+        addr = (addr < buddy) ? addr : buddy;
+        order++;
+        page_stats.merge_cnt++;
+    }
+
+    page_push (addr, order);
+    page_stats.free_cnt++;
+
+    interrupt_restore (interrupts);
+}
+
+void page_shrink (void * const page, const uint32_t order)
+{
+    const uintptr_t addr = (uintptr_t) page;
+    uint8_t * const state = page_getstate (addr);
+    kernel_assert (state && (addr % PAGE_SIZE) == 0, "page_shrink() - Bad pointer.");
+
+    const bool interrupts = interrupt_disable ();
+    kernel_assert (*state & PAGE_STATE_ALLOC, "page_shrink() - Unallocated memory.");
+
+    uint32_t cur = *state & PAGE_STATE_ORDER;
+    kernel_assert (order <= cur, "page_shrink() - order %u is larger than the block (%u)", order, cur);
+
+    /* Give back the upper half until the block is the right size. The buddy of each half given back is
+       still allocated, so they do not merge. */
+    while (cur > order)
+    {
+        cur--;
+        page_push (addr + (PAGE_SIZE << cur), cur);
+        page_stats.split_cnt++;
+    }
+
+    *state = PAGE_STATE_ALLOC | order;
+    interrupt_restore (interrupts);
+}
+
+uint32_t page_order (const size_t size)
+{
+    uint32_t order = 0;
+    while (order <= PAGE_MAX_ORDER && ((size_t) PAGE_SIZE << order) < size)
+    {
+        order++;
+    }
+
+    return order;
+}
+
+bool page_isalloc (const void * const page)
+{
+    const uint8_t * const state = page_getstate ((uintptr_t) page);
+    return state && ((uintptr_t) page % PAGE_SIZE) == 0 && (*state & PAGE_STATE_ALLOC);
+}
+
+uint32_t page_getorder (const void * const page)
+{
+    kernel_assert (page_isalloc (page), "page_getorder() - Unallocated memory.");
+    return *page_getstate ((uintptr_t) page) & PAGE_STATE_ORDER;
+}
+
+struct PageStats page_getstats (void)
+{
+    return page_stats;
+}
\ No newline at end of file
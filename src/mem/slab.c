@@ -0,0 +1,280 @@
+#include "alienos/mem/slab.h"
+#include "alienos/mem/kmalloc.h"
+#include "alienos/kernel/kernel.h"
+
+#include <stdbool.h>
+
+/* Magic number stored in every slab header. */
+#define KMEM_SLAB_MAGIC 0x5AB5AB00
+
+#define KMEM_ALIGN(x, align) ((((x) + (align) - 1) / (align)) * (align))
+
+/* Header at the start of every slab, the objects follow. */
+typedef struct KMemSlab
+{
+    uint32_t magic;                     /* Magic number to detect bad pointers. */
+    kmem_cache_t *cache;                /* Cache this slab belongs to. */
+    void *free_objs;                    /* Singly linked list of free objects, the link is stored
+                                           'link_offset' bytes into the object. */
+    uint32_t inuse;                     /* How many objects are allocated. */
+    struct KMemSlab *next;              /* Next slab in the cache's list. */
+    struct KMemSlab *prev;              /* Previous slab in the cache's list. */
+} kmem_slab_t;
+
+/* Get the free list link of an object. */
+static inline void **slab_objlink (const kmem_cache_t * const cache, void * const obj)
+{
+    return (void **) (((uint8_t *) obj) + cache->link_offset);
+}
+
+/* Add slab to head of a cache slab list. Must be synchronized externally. */
+static void slab_list_add (kmem_slab_t ** const head, kmem_slab_t * const slab)
+{
+    if (*head)
+    {
+        (*head)->prev = slab;
+    }
+
+    slab->next = *head;
+    slab->prev = NULL;
+    *head = slab;
+}
+
+/* Remove slab from a cache slab list. Must be synchronized externally. */
+static void slab_list_remove (kmem_slab_t ** const head, kmem_slab_t * const slab)
+{
+    if (!slab->prev)
+    {
+        kernel_assert (*head == slab, "slab_list_remove(): Expected slab without prev pointer to be head of list");
+        *head = slab->next;
+    }
+    else
+    {
+        slab->prev->next = slab->next;
+    }
+
+    if (slab->next)
+    {
+        slab->next->prev = slab->prev;
+    }
+
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+/* Allocate a slab from the kernel heap and carve it into objects. Must be synchronized externally. */
+static kmem_slab_t *slab_create (kmem_cache_t * const cache)
+{
+    kmem_slab_t * const slab = kmalloc_aligned (KMEM_SLAB_SIZE, KMEM_SLAB_SIZE);
+    if (!slab)
+    {
+        return NULL;
+    }
+
+    slab->magic = KMEM_SLAB_MAGIC;
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free_objs = NULL;
+    slab->next = NULL;
+    slab->prev = NULL;
+
+    /* Link objects so the lowest addressed object is handed out first. */
+    uint8_t * const first = ((uint8_t *) slab) + cache->offset;
+    for (uint32_t i = cache->stats.objs_per_slab; i > 0; i--)
+    {
+        void * const obj = first + (i - 1) * cache->objsize;
+        if (cache->ctor)
+        {
+            cache->ctor (obj);
+        }
+
+        *slab_objlink (cache, obj) = slab->free_objs;
+        slab->free_objs = obj;
+    }
+
+    cache->stats.slab_cnt++;
+    cache->stats.slab_alloc_cnt++;
+    return slab;
+}
+
+/* Return an empty slab to the kernel heap. Must be synchronized externally. */
+static void slab_destroy (kmem_cache_t * const cache, kmem_slab_t * const slab)
+{
+    kernel_assert (slab->inuse == 0, "slab_destroy(): slab of cache '%s' still has objects in use", cache->name);
+
+    slab->magic = 0;
+    kfree (slab);
+
+    cache->stats.slab_cnt--;
+    cache->stats.slab_free_cnt++;
+}
+
+void kmem_cache_init (kmem_cache_t * const cache, const char * const name, const size_t objsize,
+                      size_t align, void (* const ctor) (void *obj))
+{
+    if (align == 0)
+    {
+        align = sizeof (void *);
+    }
+    kernel_assert ((align & (align - 1)) == 0, "kmem_cache_init(): alignment %u is not a power of 2", align);
+
+    cache->name = name;
+    cache->ctor = ctor;
+
+    /* Free objects hold the free list link. Constructed objects must keep their contents while free, so
+       the link goes after the object instead of overwriting it. */
+    if (ctor)
+    {
+        cache->link_offset = KMEM_ALIGN (objsize, sizeof (void *));
+        cache->objsize = KMEM_ALIGN (cache->link_offset + sizeof (void *), align);
+    }
+    else
+    {
+        cache->link_offset = 0;
+        cache->objsize = KMEM_ALIGN (objsize < sizeof (void *) ? sizeof (void *) : objsize, align);
+    }
+    cache->offset = KMEM_ALIGN (sizeof (kmem_slab_t), align);
+    kernel_assert (cache->offset + cache->objsize <= KMEM_SLAB_SIZE,
+                   "kmem_cache_init(): objects of cache '%s' do not fit in a slab", name);
+
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+
+    cache->stats = (struct KMemCacheStats) {0};
+    cache->stats.objs_per_slab = (KMEM_SLAB_SIZE - cache->offset) / cache->objsize;
+
+    mutex_init (&cache->lock);
+}
+
+kmem_cache_t *kmem_cache_create (const char * const name, const size_t objsize, const size_t align,
+                                 void (* const ctor) (void *obj))
+{
+    kmem_cache_t * const cache = kmalloc (sizeof (kmem_cache_t));
+    if (!cache)
+    {
+        return NULL;
+    }
+
+    kmem_cache_init (cache, name, objsize, align, ctor);
+    return cache;
+}
+
+void kmem_cache_destroy (kmem_cache_t * const cache)
+{
+    mutex_acquire (&cache->lock);
+    kernel_assert (!cache->partial && !cache->full,
+                   "kmem_cache_destroy(): cache '%s' still has objects in use", cache->name);
+
+    while (cache->empty)
+    {
+        kmem_slab_t * const slab = cache->empty;
+        slab_list_remove (&cache->empty, slab);
+        slab_destroy (cache, slab);
+    }
+    mutex_release (&cache->lock);
+
+    kfree (cache);
+}
+
+void *kmem_cache_alloc (kmem_cache_t * const cache)
+{
+    mutex_acquire (&cache->lock);
+
+    /* Prefer partially used slabs so empty slabs can be given back. */
+    kmem_slab_t *slab = cache->partial;
+    if (!slab)
+    {
+        slab = cache->empty;
+        if (slab)
+        {
+            slab_list_remove (&cache->empty, slab);
+        }
+        else
+        {
+            slab = slab_create (cache);
+            if (!slab)
+            {
+                mutex_release (&cache->lock);
+                return NULL;
+            }
+        }
+        slab_list_add (&cache->partial, slab);
+    }
+
+    void * const obj = slab->free_objs;
+    slab->free_objs = *slab_objlink (cache, obj);
+    slab->inuse++;
+
+    /* Slab has no free objects left. */
+    if (!slab->free_objs)
+    {
+        slab_list_remove (&cache->partial, slab);
+        slab_list_add (&cache->full, slab);
+    }
+
+    cache->stats.allocation_cnt++;
+    cache->stats.active_objs++;
+    mutex_release (&cache->lock);
+    return obj;
+}
+
+void kmem_cache_free (kmem_cache_t * const cache, void * const obj)
+{
+    if (!obj)
+    {
+        return;
+    }
+
+    kmem_slab_t * const slab = (kmem_slab_t *) (((uintptr_t) obj) & ~(KMEM_SLAB_SIZE - 1));
+    kernel_assert (slab->magic == KMEM_SLAB_MAGIC, "kmem_cache_free() - Bad pointer.");
+    kernel_assert (slab->cache == cache, "kmem_cache_free() - Object does not belong to cache '%s'.",
+                   cache->name);
+
+    mutex_acquire (&cache->lock);
+    kernel_assert (slab->inuse > 0, "kmem_cache_free() - Slab has no objects in use.");
+
+    /* Slab was full, it now has a free object. */
+    if (!slab->free_objs)
+    {
+        slab_list_remove (&cache->full, slab);
+        slab_list_add (&cache->partial, slab);
+    }
+
+    *slab_objlink (cache, obj) = slab->free_objs;
+    slab->free_objs = obj;
+    slab->inuse--;
+
+    /* Slab is empty, keep it around until the cache is shrunk. */
+    if (slab->inuse == 0)
+    {
+        slab_list_remove (&cache->partial, slab);
+        slab_list_add (&cache->empty, slab);
+    }
+
+    cache->stats.free_cnt++;
+    cache->stats.active_objs--;
+    mutex_release (&cache->lock);
+}
+
+uint32_t kmem_cache_shrink (kmem_cache_t * const cache)
+{
+    mutex_acquire (&cache->lock);
+
+    uint32_t freed = 0;
+    while (cache->empty)
+    {
+        kmem_slab_t * const slab = cache->empty;
+        slab_list_remove (&cache->empty, slab);
+        slab_destroy (cache, slab);
+        freed++;
+    }
+
+    mutex_release (&cache->lock);
+    return freed;
+}
+
+struct KMemCacheStats kmem_cache_getstats (const kmem_cache_t * const cache)
+{
+    return cache->stats;
+}
\ No newline at end of file
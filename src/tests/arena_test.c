@@ -0,0 +1,200 @@
+#include "alienos/tests/unit_tests.h"
+#include "alienos/mem/arena.h"
+#include "alienos/mem/kmalloc.h"
+#include "alienos/cpu/cpu.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+/* Bytes allocated from the kernel heap and not freed. */
+static size_t arena_test_heap_inuse (void)
+{
+    const struct KMStats stats = kmalloc_getstats ();
+    return stats.allocation_bytes - stats.free_bytes;
+}
+
+TEST(test_arena_alloc)
+{
+    printf ("\nRunning test_arena_alloc()\n");
+    const size_t inuse = arena_test_heap_inuse ();
+
+    karena_t arena;
+    karena_init (&arena, "test_arena", 512);
+
+    /* Enough small allocations to span several chunks. */
+    uint8_t *ptrs[64];
+    const size_t kNumPtrs = sizeof (ptrs) / sizeof (ptrs[0]);
+    for (size_t i = 0; i < kNumPtrs; i++)
+    {
+        ptrs[i] = karena_alloc (&arena, 1 + i % 40);
+        if (!ptrs[i]) return "Failed: karena_alloc()";
+        if ((uintptr_t) ptrs[i] & (KARENA_ALIGN - 1)) return "Failed: allocation is not aligned";
+        memset (ptrs[i], i, 1 + i % 40);
+    }
+
+    uint8_t * const aligned = karena_alloc_aligned (&arena, 24, 256);
+    if (!aligned || ((uintptr_t) aligned & 255)) return "Failed: karena_alloc_aligned()";
+
+    /* Larger than a chunk. */
+    uint8_t * const big = karena_alloc (&arena, 2048);
+    if (!big) return "Failed: karena_alloc() larger than a chunk";
+    memset (big, 0xAA, 2048);
+
+    for (size_t i = 0; i < kNumPtrs; i++)
+    {
+        for (size_t j = 0; j < 1 + i % 40; j++)
+        {
+            if (ptrs[i][j] != (uint8_t) i) return "Failed: overlapping allocations";
+        }
+    }
+
+    const struct KArenaStats stats = karena_getstats (&arena);
+    if (stats.allocation_cnt != kNumPtrs + 2) return "Failed: allocation count";
+    if (stats.chunk_cnt < 3) return "Failed: expected allocations to span several chunks";
+    if (stats.chunk_cnt != stats.chunk_alloc_cnt) return "Failed: chunk count";
+
+    karena_destroy (&arena);
+    if (karena_getstats (&arena).chunk_cnt != 0) return "Failed: chunks left after destroy";
+    if (arena_test_heap_inuse () != inuse) return "Failed: memory leak";
+
+    printf ("Passed test_arena_alloc()\n");
+    return NULL;
+}
+
+TEST(test_arena_reset)
+{
+    printf ("\nRunning test_arena_reset()\n");
+    const size_t inuse = arena_test_heap_inuse ();
+
+    karena_t arena;
+    karena_init (&arena, "test_arena", 0);
+
+    void * const first = karena_alloc (&arena, 64);
+    for (size_t i = 0; i < 16; i++)
+    {
+        if (!karena_alloc (&arena, 1024)) return "Failed: karena_alloc()";
+    }
+
+    /* Only the oldest chunk is kept, and allocations start over at it's beginning. */
+    const uint32_t chunk_alloc_cnt = karena_getstats (&arena).chunk_alloc_cnt;
+    karena_reset (&arena);
+    if (karena_getstats (&arena).chunk_cnt != 1) return "Failed: expected reset to keep one chunk";
+    if (karena_alloc (&arena, 64) != first) return "Failed: did not reuse the oldest chunk";
+    if (karena_getstats (&arena).chunk_alloc_cnt != chunk_alloc_cnt) return "Failed: chunk allocated after reset";
+
+    karena_destroy (&arena);
+    if (arena_test_heap_inuse () != inuse) return "Failed: memory leak";
+
+    printf ("Passed test_arena_reset()\n");
+    return NULL;
+}
+
+TEST(test_arena_savepoint)
+{
+    printf ("\nRunning test_arena_savepoint()\n");
+    const size_t inuse = arena_test_heap_inuse ();
+
+    karena_t arena;
+    karena_init (&arena, "test_arena", 256);
+
+    uint8_t * const keep = karena_alloc (&arena, 32);
+    memset (keep, 0x11, 32);
+
+    const karena_savepoint_t outer = karena_save (&arena);
+    uint8_t * const a = karena_alloc (&arena, 32);
+    const karena_savepoint_t inner = karena_save (&arena);
+    for (size_t i = 0; i < 8; i++)
+    {
+        if (!karena_alloc (&arena, 200)) return "Failed: karena_alloc()";
+    }
+
+    /* Restoring the inner savepoint returns the chunks taken after it. */
+    karena_restore (&arena, inner);
+    if (karena_getstats (&arena).chunk_cnt != 1) return "Failed: chunks left after restoring inner savepoint";
+    if (karena_alloc (&arena, 16) != a + 32) return "Failed: did not rewind to inner savepoint";
+
+    karena_restore (&arena, outer);
+    if (karena_alloc (&arena, 32) != a) return "Failed: did not rewind to outer savepoint";
+    for (size_t i = 0; i < 32; i++)
+    {
+        if (keep[i] != 0x11) return "Failed: restore released memory allocated before the savepoint";
+    }
+
+    /* A savepoint of an empty arena releases everything. */
+    karena_t empty;
+    karena_init (&empty, "test_arena_empty", 0);
+    const karena_savepoint_t start = karena_save (&empty);
+    if (!karena_alloc (&empty, 100)) return "Failed: karena_alloc()";
+    karena_restore (&empty, start);
+    if (karena_getstats (&empty).chunk_cnt != 0) return "Failed: chunks left after restoring empty savepoint";
+
+    karena_destroy (&arena);
+    karena_destroy (&empty);
+    if (arena_test_heap_inuse () != inuse) return "Failed: memory leak";
+
+    printf ("Passed test_arena_savepoint()\n");
+    return NULL;
+}
+
+TEST(test_arena_stress)
+{
+    printf ("\nRunning test_arena_stress()\n");
+    const size_t inuse = arena_test_heap_inuse ();
+
+    /* Rounds of many small allocations that are all released together, once with kmalloc() and kfree()
+       and once with an arena. */
+    void *ptrs[256];
+    const size_t kNumPtrs = sizeof (ptrs) / sizeof (ptrs[0]);
+    const uint32_t rounds = 64;
+
+    uint32_t seed = 12345;
+    const uint64_t kmalloc_start = cpu_rdtsc ();
+    for (uint32_t round = 0; round < rounds; round++)
+    {
+        for (size_t i = 0; i < kNumPtrs; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            ptrs[i] = kmalloc (1 + (seed >> 16) % 128);
+            if (!ptrs[i]) return "Failed: kmalloc()";
+        }
+        for (size_t i = 0; i < kNumPtrs; i++)
+        {
+            kfree (ptrs[i]);
+        }
+    }
+    const uint64_t kmalloc_cycles = cpu_rdtsc () - kmalloc_start;
+
+    karena_t arena;
+    karena_init (&arena, "test_arena_stress", 0);
+    seed = 12345;
+    const uint64_t arena_start = cpu_rdtsc ();
+    for (uint32_t round = 0; round < rounds; round++)
+    {
+        for (size_t i = 0; i < kNumPtrs; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            ptrs[i] = karena_alloc (&arena, 1 + (seed >> 16) % 128);
+            if (!ptrs[i]) return "Failed: karena_alloc()";
+        }
+        karena_reset (&arena);
+    }
+    const uint64_t arena_cycles = cpu_rdtsc () - arena_start;
+    karena_destroy (&arena);
+
+    const uint32_t ops = rounds * kNumPtrs;
+    printf ("> kmalloc()/kfree() cycles per allocation: %u\n", (uint32_t) (kmalloc_cycles / ops));
+    printf ("> karena_alloc()/karena_reset() cycles per allocation: %u\n", (uint32_t) (arena_cycles / ops));
+
+    if (arena_test_heap_inuse () != inuse) return "Failed: memory leak";
+
+    printf ("Passed test_arena_stress()\n");
+    return NULL;
+}
+
+void arena_test (struct UnitTestsResult * const result)
+{
+    run_test (test_arena_alloc, result);
+    run_test (test_arena_reset, result);
+    run_test (test_arena_savepoint, result);
+    run_test (test_arena_stress, result);
+}
\ No newline at end of file
@@ -1,7 +1,13 @@
 #include "alienos/tests/unit_tests.h"
 #include "alienos/mem/kmalloc.h"
+#include "alienos/mem/kmalloc_internal.h"
 #include "alienos/kernel/kernel.h"
+#include "alienos/io/interrupt.h"
+#include "alienos/cpu/cpu.h"
+#include "alienos/kernel/thread.h"
+#include "alienos/mem/page.h"
 
+#include <stdbool.h>
 #include <string.h>
 
 TEST(test_alloc)
@@ -69,26 +75,31 @@ TEST(test_realloc)
 {
     printf ("\nRunning test_realloc()\n");
 
-    void * const p1 = kmalloc (4);
-    if (!p1) return "Failed: kmalloc(4)";
+    /* Sizes are too large for the thread's magazines, whose blocks never have a free neighbor. Shrinking the
+       first of two blocks next to each other leaves a free block of known size after it. */
+    void *ps[2];
+    if (!kmalloc_bulk (512, 2, ps)) return "Failed: kmalloc_bulk(512)";
+    void * const p1 = krealloc (ps[0], 160);
+    if (p1 != ps[0]) return "Failed: krealloc() moved a shrinking block";
 
-    void *const p2 = krealloc (p1, 8);
+    void *const p2 = krealloc (p1, 168);
     if ((uintptr_t) p1 != (uintptr_t) p2) return "Failed: resized when original block is large enough";
 
-    uint32_t * const p3 = krealloc (p2, 32);
+    uint32_t * const p3 = krealloc (p2, 320);
     if ((uintptr_t) p2 != (uintptr_t) p3) return "Failed: did not resize block";
 
-    for (size_t i = 0; i < 8; i++) p3[i] = i;
+    for (size_t i = 0; i < 80; i++) p3[i] = i;
 
-    void * const p4 = kmalloc (32);
-    uint32_t * const p5 = krealloc (p3, 64);
+    void * const p4 = kmalloc (320);
+    uint32_t * const p5 = krealloc (p3, 640);
     if ((uintptr_t) p5 == (uintptr_t) p3) return "Failed: did not reallocate block";
 
-    for (size_t i = 0; i < 8; i++)
+    for (size_t i = 0; i < 80; i++)
         if (p5[i] != i) return "Failed: overlapping memory blocks";
 
     kfree (p4);
     kfree (p5);
+    kfree (ps[1]);
 
     printf ("Passed test_realloc()\n");
     return NULL;
@@ -146,7 +157,8 @@ TEST(test_short)
         kfree (ps[i]);
     }
 
-    kmalloc_printdebug ();
+    kmalloc_dump (false);
+    kmalloc_trace_dump ();
 
     const struct KMStats stats_now = kmalloc_getstats ();
     if (stats.allocation_bytes - stats.free_bytes != stats_now.allocation_bytes - stats_now.free_bytes)
@@ -155,6 +167,707 @@ TEST(test_short)
     return NULL;
 }
 
+TEST(test_bins)
+{
+    printf ("\nRunning test_bins()\n");
+    const struct KMStats stats = kmalloc_getstats ();
+
+    /* Free every other block so they cannot coalesce and must sit in the 64 byte size class bin. The
+       last block stays allocated to keep the freed blocks away from the rest of the heap. Paranoid builds
+       add a redzone to every request, which is taken off so the blocks are the same size. */
+    const size_t size = 64 - KMALLOC_REDZONE_SIZE;
+    void *ps[33];
+    for (size_t i = 0; i < sizeof (ps) / sizeof (ps[0]); i++)
+    {
+        ps[i] = kmalloc (size);
+        if (!ps[i]) return "Failed: kmalloc(64)";
+    }
+    for (size_t i = 1; i < sizeof (ps) / sizeof (ps[0]); i += 2)
+    {
+        kfree (ps[i]);
+    }
+    kmalloc_magazines_flush (&current_thread->kmalloc_magazines);
+
+    const struct KMStats stats_freed = kmalloc_getstats ();
+    void *reallocs[sizeof (ps) / sizeof (ps[0]) / 2];
+    for (size_t i = 0; i < sizeof (reallocs) / sizeof (reallocs[0]); i++)
+    {
+        reallocs[i] = kmalloc (size);
+        bool reused = false;
+        for (size_t j = 1; j < sizeof (ps) / sizeof (ps[0]); j += 2)
+        {
+            reused |= (reallocs[i] == ps[j]);
+        }
+        if (!reused) return "Failed: did not reuse binned block";
+    }
+
+#ifdef KMALLOC_POLICY_FIRSTFIT
+    const struct KMStats stats_reused = kmalloc_getstats ();
+    if (stats_reused.bin_hits[2] - stats_freed.bin_hits[2] != sizeof (reallocs) / sizeof (reallocs[0]))
+        return "Failed: expected every reallocation to hit the bin";
+#else
+    (void) stats_freed;
+#endif
+
+    for (size_t i = 0; i < sizeof (ps) / sizeof (ps[0]); i += 2)
+    {
+        kfree (ps[i]);
+    }
+    for (size_t i = 0; i < sizeof (reallocs) / sizeof (reallocs[0]); i++)
+    {
+        kfree (reallocs[i]);
+    }
+
+    /* A 3.5 KiB free block between two allocated ones sits in the last bin, and serves a request too large for
+       any size class without growing the heap. */
+    void *large[3];
+    if (!kmalloc_bulk (3584 - 16 - KMALLOC_REDZONE_SIZE, 3, large)) return "Failed: kmalloc_bulk(3.5 KiB)";
+    kfree (large[1]);
+    const size_t heap_bytes = kmalloc_getstats ().heap_bytes;
+    void * const reused = kmalloc (3000);
+    if (reused != large[1]) return "Failed: did not reuse the block in the last bin";
+    if (kmalloc_getstats ().heap_bytes > heap_bytes) return "Failed: heap grew instead";
+    kfree (reused);
+    kfree (large[0]);
+    kfree (large[2]);
+
+    const struct KMStats stats_now = kmalloc_getstats ();
+    if (stats.allocation_bytes - stats.free_bytes != stats_now.allocation_bytes - stats_now.free_bytes)
+        return "Failed: memory leak";
+
+    printf ("Passed test_bins()\n");
+    return NULL;
+}
+
+TEST(test_bestfit)
+{
+    printf ("\nRunning test_bestfit() [%s]\n", KMALLOC_POLICY_NAME);
+    const struct KMStats stats = kmalloc_getstats ();
+
+#ifdef KMALLOC_POLICY_BESTFIT
+    /* Free three runs of a batch to leave holes of 16, 8 and 12 blocks (2048, 1024 and 1536 bytes) with
+       allocated blocks between them. */
+    void *ps[40];
+    const size_t cnt = sizeof (ps) / sizeof (ps[0]);
+    if (!kmalloc_bulk (112, cnt, ps)) return "Failed: kmalloc_bulk()";
+    void * const holes[] = {ps[1], ps[18], ps[27]};
+    kfree_bulk (&ps[1], 16);
+    kfree_bulk (&ps[18], 8);
+    kfree_bulk (&ps[27], 12);
+
+    /* The tightest hole wins over the first one that fits. Requests fill a hole exactly, so no other free
+       block can fit better. Paranoid builds add a redzone to every block. */
+    const size_t block = 128 + KMALLOC_REDZONE_SIZE;
+    void * const p1 = kmalloc (12 * block - 16 - KMALLOC_REDZONE_SIZE);
+    if (p1 != holes[2]) return "Failed: expected the best fitting block";
+    void * const p2 = kmalloc (16 * block - 16 - KMALLOC_REDZONE_SIZE);
+    if (p2 != holes[0]) return "Failed: expected the best fitting block";
+
+    kfree (p1);
+    kfree (p2);
+    kfree (ps[0]);
+    kfree (ps[17]);
+    kfree (ps[26]);
+    kfree (ps[39]);
+#endif
+
+    const struct KMStats stats_now = kmalloc_getstats ();
+    if (stats.allocation_bytes - stats.free_bytes != stats_now.allocation_bytes - stats_now.free_bytes)
+        return "Failed: memory leak";
+
+    printf ("Passed test_bestfit()\n");
+    return NULL;
+}
+
+TEST(test_aligned)
+{
+    printf ("\nRunning test_aligned()\n");
+    const struct KMStats stats = kmalloc_getstats ();
+
+    /* Small pins between the aligned blocks keep their slack from merging back. */
+    const size_t aligns[] = {16, 32, 64, 256, 4096, 16384};
+    uint8_t *ptrs[sizeof (aligns) / sizeof (aligns[0])];
+    void *pins[sizeof (aligns) / sizeof (aligns[0])];
+    for (size_t i = 0; i < sizeof (aligns) / sizeof (aligns[0]); i++)
+    {
+        ptrs[i] = kmalloc_aligned (100 + i, aligns[i]);
+        pins[i] = kmalloc (16);
+        if (!ptrs[i] || !pins[i]) return "Failed: kmalloc_aligned()";
+        if ((uintptr_t) ptrs[i] % aligns[i]) return "Failed: not aligned";
+        for (size_t j = 0; j < 100 + i; j++) ptrs[i][j] = i + j;
+    }
+
+    for (size_t i = 0; i < sizeof (aligns) / sizeof (aligns[0]); i++)
+    {
+        for (size_t j = 0; j < 100 + i; j++)
+            if (ptrs[i][j] != (uint8_t) (i + j)) return "Failed: overlapping blocks";
+        kfree (ptrs[i]);
+        kfree (pins[i]);
+    }
+
+    uint32_t * const page = kpage_alloc (5000);
+    if (!page) return "Failed: kpage_alloc()";
+    if ((uintptr_t) page % 4096) return "Failed: kpage_alloc() not page aligned";
+    for (size_t i = 0; i < 8192 / sizeof (uint32_t); i++) page[i] = i;
+    kfree (page);
+
+    const struct KMStats stats_now = kmalloc_getstats ();
+    if (stats.allocation_bytes - stats.free_bytes != stats_now.allocation_bytes - stats_now.free_bytes)
+        return "Failed: memory leak";
+
+    printf ("Passed test_aligned()\n");
+    return NULL;
+}
+
+TEST(test_magazines)
+{
+    printf ("\nRunning test_magazines()\n");
+    const struct KMStats stats = kmalloc_getstats ();
+    kmalloc_magazines_flush (&current_thread->kmalloc_magazines);
+
+    /* A freed small block is handed straight back. Paranoid builds add a redzone to every request, which is
+       taken off so the blocks are the same size. */
+    const size_t size = 48 - KMALLOC_REDZONE_SIZE;
+    void * const p1 = kmalloc (size);
+    kfree (p1);
+    void * const p2 = kmalloc (size);
+    if (p1 != p2) return "Failed: expected block from magazine";
+
+    const struct KMStats stats_hit = kmalloc_getstats ();
+    if (stats_hit.magazine_hits == stats.magazine_hits) return "Failed: expected magazine hit";
+
+    /* Freeing more blocks than a magazine holds drains it. */
+    void *ps[2 * KMALLOC_MAGAZINE_SIZE];
+    for (size_t i = 0; i < sizeof (ps) / sizeof (ps[0]); i++)
+    {
+        ps[i] = kmalloc (size);
+        if (!ps[i]) return "Failed: kmalloc(48)";
+    }
+    for (size_t i = 0; i < sizeof (ps) / sizeof (ps[0]); i++)
+    {
+        kfree (ps[i]);
+    }
+    kfree (p2);
+
+    const struct KMStats stats_now = kmalloc_getstats ();
+    if (stats_now.magazine_drains == stats.magazine_drains) return "Failed: expected magazine drain";
+    if (stats.allocation_bytes - stats.free_bytes != stats_now.allocation_bytes - stats_now.free_bytes)
+        return "Failed: memory leak";
+
+    kmalloc_magazines_flush (&current_thread->kmalloc_magazines);
+
+    printf ("Passed test_magazines()\n");
+    return NULL;
+}
+
+TEST(test_atomic)
+{
+    printf ("\nRunning test_atomic()\n");
+
+    /* Works with interrupts disabled, like in an interrupt handler. */
+    bool enabled = interrupt_disable ();
+    uint8_t * const p1 = kmalloc_atomic (100);
+    uint8_t * const p2 = kmalloc_atomic (3000);
+    void * const p3 = kmalloc_atomic (5000);
+    interrupt_restore (enabled);
+
+    if (!p1 || !p2) return "Failed: kmalloc_atomic()";
+    if (p3) return "Failed: kmalloc_atomic() larger than the largest class";
+    for (size_t i = 0; i < 100; i++) p1[i] = i;
+    for (size_t i = 0; i < 3000; i++) p2[i] = i;
+    for (size_t i = 0; i < 100; i++)
+        if (p1[i] != (uint8_t) i) return "Failed: overlapping blocks";
+
+    /* Emptying the largest class fails instead of blocking. */
+    void *ps[KMALLOC_ATOMIC_POOL_SIZE];
+    size_t cnt = 0;
+    enabled = interrupt_disable ();
+    while (cnt < sizeof (ps) / sizeof (ps[0]) && (ps[cnt] = kmalloc_atomic (4096)))
+    {
+        cnt++;
+    }
+    void * const extra = (cnt < sizeof (ps) / sizeof (ps[0])) ? NULL : kmalloc_atomic (4096);
+    const bool exhausted = !extra;
+    for (size_t i = 0; i < cnt; i++)
+    {
+        kfree_atomic (ps[i]);
+    }
+    if (extra)
+    {
+        kfree_atomic (extra);
+    }
+    kfree_atomic (p1);
+    interrupt_restore (enabled);
+
+    if (!exhausted) return "Failed: expected largest class to run out";
+
+    /* Atomic blocks are ordinary heap blocks. */
+    kfree (p2);
+
+    printf ("Passed test_atomic()\n");
+    return NULL;
+}
+
+TEST(test_zeroed)
+{
+    printf ("\nRunning test_zeroed()\n");
+
+    /* Fill the pool like the fill thread does. */
+    size_t filled = 0;
+    while (kmalloc_zeroed_fill ())
+    {
+        filled++;
+    }
+    if (filled > KMALLOC_ZEROED_CLASSES * KMALLOC_ZEROED_POOL_SIZE) return "Failed: pool overflowed";
+
+    /* Drain the 1 KiB class, dirtying every block so the refill has to zero it again. */
+    const struct KMStats stats = kmalloc_getstats ();
+    uint32_t *ps[KMALLOC_ZEROED_POOL_SIZE + 1];
+    for (size_t i = 0; i < sizeof (ps) / sizeof (ps[0]); i++)
+    {
+        ps[i] = kcalloc (200, sizeof (uint32_t));
+        if (!ps[i]) return "Failed: kcalloc()";
+        for (size_t j = 0; j < 200; j++)
+        {
+            if (ps[i][j] != 0) return "Failed: did not clear memory";
+            ps[i][j] = 0xFEEDF00D;
+        }
+    }
+
+    const struct KMStats after = kmalloc_getstats ();
+    /* The fill thread may top the pool up in between under a policy that shares the CPU with it. */
+    const uint32_t hits = after.zeroed_hits - stats.zeroed_hits;
+    const uint32_t misses = after.zeroed_misses - stats.zeroed_misses;
+    if (hits < KMALLOC_ZEROED_POOL_SIZE) return "Failed: expected pool hits";
+    if (hits + misses != KMALLOC_ZEROED_POOL_SIZE + 1) return "Failed: expected every request to go to the pool";
+
+    for (size_t i = 0; i < sizeof (ps) / sizeof (ps[0]); i++)
+    {
+        kfree (ps[i]);
+    }
+
+    /* Refilled blocks are zero even where freed blocks were dirtied. */
+    while (kmalloc_zeroed_fill ());
+    for (size_t i = 0; i < KMALLOC_ZEROED_POOL_SIZE; i++)
+    {
+        ps[i] = kcalloc (1000, 1);
+        for (size_t j = 0; j < 250; j++)
+            if (ps[i][j] != 0) return "Failed: refilled block not cleared";
+    }
+    for (size_t i = 0; i < KMALLOC_ZEROED_POOL_SIZE; i++)
+    {
+        kfree (ps[i]);
+    }
+
+    /* A pool hit cuts the block down to size. Once the pool is full again, allocated minus freed bytes is what
+       it was before. */
+    while (kmalloc_zeroed_fill ());
+    const struct KMStats before_hit = kmalloc_getstats ();
+    kfree (kcalloc (300, 1));
+    while (kmalloc_zeroed_fill ());
+    const struct KMStats after_hit = kmalloc_getstats ();
+    if (after_hit.zeroed_hits - before_hit.zeroed_hits != 1) return "Failed: expected a pool hit";
+    if (before_hit.allocation_bytes - before_hit.free_bytes != after_hit.allocation_bytes - after_hit.free_bytes)
+        return "Failed: memory leak";
+
+    printf ("Passed test_zeroed()\n");
+    return NULL;
+}
+
+TEST(test_trim)
+{
+    printf ("\nRunning test_trim()\n");
+    const struct KMStats stats = kmalloc_getstats ();
+
+    /* No free block holds a batch of blocks this size, so they are allocated one at a time, each in a heap
+       segment of it's own. Once freed, kmalloc_trim() gives the segments back. */
+    void *ps[128];
+    const size_t cnt = sizeof (ps) / sizeof (ps[0]);
+    if (!kmalloc_bulk (8176, cnt, ps)) return "Failed: kmalloc_bulk()";
+    if (kmalloc_getstats ().heap_bytes < stats.heap_bytes + (1 << 20)) return "Failed: footprint did not grow";
+    kfree_bulk (ps, cnt);
+
+    const struct KMStats after = kmalloc_getstats ();
+    if (after.heap_peak_bytes < stats.heap_bytes + (1 << 20)) return "Failed: high water mark";
+    if (kmalloc_trim () < (1 << 20)) return "Failed: kmalloc_trim() did not give the burst back";
+    if (kmalloc_getstats ().heap_bytes > stats.heap_bytes) return "Failed: burst was not trimmed";
+
+    /* With every other block freed, kmalloc_trim() gives back their segments and leaves the rest alone. */
+    if (!kmalloc_bulk (8176, cnt, ps)) return "Failed: kmalloc_bulk()";
+    uint8_t * const p1 = ps[0];
+    for (size_t i = 0; i < 4096; i++) p1[i] = i;
+    for (size_t i = 1; i < cnt; i += 2)
+    {
+        kfree (ps[i]);
+        ps[i] = NULL;
+    }
+
+    const size_t heap_bytes = kmalloc_getstats ().heap_bytes;
+    const size_t released = kmalloc_trim ();
+    if (released == 0) return "Failed: kmalloc_trim() gave nothing back";
+    if (kmalloc_getstats ().heap_bytes != heap_bytes - released) return "Failed: footprint after kmalloc_trim()";
+    for (size_t i = 0; i < 4096; i++)
+        if (p1[i] != (uint8_t) i) return "Failed: kmalloc_trim() clobbered memory";
+
+    kfree_bulk (ps, cnt);
+    kmalloc_trim ();
+    if (kmalloc_getstats ().heap_bytes > stats.heap_bytes) return "Failed: memory leak";
+
+    printf ("Passed test_trim()\n");
+    return NULL;
+}
+
+TEST(test_large)
+{
+    printf ("\nRunning test_large()\n");
+    const struct KMStats stats = kmalloc_getstats ();
+
+    /* A thread stack sized block comes from the page allocator and leaves the heap alone. */
+    uint8_t * const p1 = kmalloc (THREAD_STACK_SPACE);
+    if (!p1) return "Failed: kmalloc(THREAD_STACK_SPACE)";
+    if ((uintptr_t) p1 % PAGE_SIZE) return "Failed: large block is not page aligned";
+    memset (p1, 0xAB, THREAD_STACK_SPACE);
+
+    struct KMStats after = kmalloc_getstats ();
+    if (after.large_allocation_cnt != stats.large_allocation_cnt + 1) return "Failed: expected the large path";
+    if (after.large_bytes != stats.large_bytes + THREAD_STACK_SPACE) return "Failed: large_bytes";
+    if (after.heap_bytes != stats.heap_bytes) return "Failed: large block grew the heap";
+
+    void * const p2 = kmalloc (KMALLOC_LARGE_THRESHOLD);
+    if (!p2) return "Failed: kmalloc(KMALLOC_LARGE_THRESHOLD)";
+    if (kmalloc_getstats ().large_allocation_cnt != after.large_allocation_cnt)
+        return "Failed: small request took the large path";
+
+    /* Shrinking keeps the pages, growing moves them and a small enough size moves back to the heap. */
+    if (krealloc (p1, THREAD_STACK_SPACE / 2) != p1) return "Failed: krealloc() moved a shrinking block";
+    uint8_t * const p3 = krealloc (p1, 2 * THREAD_STACK_SPACE);
+    if (!p3) return "Failed: krealloc() to grow";
+    for (size_t i = 0; i < THREAD_STACK_SPACE / 2; i++)
+        if (p3[i] != 0xAB) return "Failed: krealloc() lost the contents";
+
+    const uint32_t large_free_cnt = kmalloc_getstats ().large_free_cnt;
+    uint8_t * const p4 = krealloc (p3, 64);
+    if (!p4) return "Failed: krealloc() to shrink";
+    if (kmalloc_getstats ().large_free_cnt != large_free_cnt + 1) return "Failed: expected a move to the heap";
+    for (size_t i = 0; i < 64; i++)
+        if (p4[i] != 0xAB) return "Failed: krealloc() lost the contents";
+
+    /* Pages are not zeroed by the page allocator. */
+    uint32_t * const p5 = kcalloc (3, PAGE_SIZE);
+    if (!p5) return "Failed: kcalloc()";
+    for (size_t i = 0; i < 3 * PAGE_SIZE / sizeof (uint32_t); i++)
+        if (p5[i] != 0) return "Failed: did not clear memory";
+
+    kfree (p2);
+    kfree (p4);
+    kfree (p5);
+
+    after = kmalloc_getstats ();
+    if (after.large_bytes != stats.large_bytes) return "Failed: large block leaked";
+    if (after.large_peak_bytes < stats.large_bytes + 2 * THREAD_STACK_SPACE) return "Failed: high water mark";
+    if (stats.allocation_bytes - stats.free_bytes != after.allocation_bytes - after.free_bytes)
+        return "Failed: memory leak";
+
+    printf ("Passed test_large()\n");
+    return NULL;
+}
+
+TEST(test_bulk)
+{
+    printf ("\nRunning test_bulk()\n");
+    const struct KMStats stats = kmalloc_getstats ();
+
+    /* One free block serves the whole batch, so the blocks are back to back. Freeing a block large enough for
+       the batch makes sure there is one. */
+    void *ptrs[32];
+    const size_t cnt = sizeof (ptrs) / sizeof (ptrs[0]);
+    kfree (kmalloc (cnt * 256));
+    if (!kmalloc_bulk (200, cnt, ptrs)) return "Failed: kmalloc_bulk()";
+    if (kmalloc_getstats ().bulk_run_cnt != stats.bulk_run_cnt + 1) return "Failed: expected one run";
+    for (size_t i = 1; i < cnt; i++)
+        if ((uintptr_t) ptrs[i] <= (uintptr_t) ptrs[i - 1]) return "Failed: run out of order";
+    for (size_t i = 0; i < cnt; i++) memset (ptrs[i], i, 200);
+    for (size_t i = 0; i < cnt; i++)
+        for (size_t j = 0; j < 200; j++)
+            if (((uint8_t *) ptrs[i])[j] != (uint8_t) i) return "Failed: overlapping blocks";
+
+    /* Blocks of a batch can be freed on their own, the rest go back in any order. */
+    kfree (ptrs[5]);
+    ptrs[5] = NULL;
+    void * const first = ptrs[0];
+    ptrs[0] = ptrs[cnt - 1];
+    ptrs[cnt - 1] = first;
+    const uint32_t free_block_cnt = kmalloc_getstats ().free_block_cnt;
+    kfree_bulk (ptrs, cnt);
+
+    /* Everything merged back into one free block with the hole. */
+    const struct KMStats after = kmalloc_getstats ();
+    if (after.allocation_bytes - after.free_bytes != stats.allocation_bytes - stats.free_bytes)
+        return "Failed: memory leak";
+    if (after.free_block_cnt > free_block_cnt) return "Failed: blocks did not merge";
+
+    if (!kmalloc_bulk (16, 0, ptrs)) return "Failed: empty kmalloc_bulk()";
+    kfree_bulk (ptrs, 0);
+
+    printf ("Passed test_bulk()\n");
+    return NULL;
+}
+
+/* Block held for test_shrink_hold(), and the order the test shrinkers ran in. */
+static void *shrink_hold = NULL;
+static char shrink_order[8];
+static uint32_t shrink_order_cnt = 0;
+
+/* Gives up the held block. */
+static size_t test_shrink_hold (void * const arg)
+{
+    if (shrink_order_cnt < sizeof (shrink_order)) shrink_order[shrink_order_cnt++] = *(const char *) arg;
+    if (!shrink_hold) return 0;
+
+    kfree (shrink_hold);
+    shrink_hold = NULL;
+    return 1 << 20;
+}
+
+/* Has nothing to give up. */
+static size_t test_shrink_empty (void * const arg)
+{
+    if (shrink_order_cnt < sizeof (shrink_order)) shrink_order[shrink_order_cnt++] = *(const char *) arg;
+    return 0;
+}
+
+TEST(test_shrinker)
+{
+    printf ("\nRunning test_shrinker()\n");
+    const struct KMStats stats = kmalloc_getstats ();
+
+    /* Registered out of priority order, they still run lowest value first. */
+    static kmalloc_shrinker_t empty, hold;
+    kmalloc_register_shrinker (&empty, "test_empty", 200, test_shrink_empty, "e");
+    kmalloc_register_shrinker (&hold, "test_hold", 100, test_shrink_hold, "h");
+    shrink_order_cnt = 0;
+
+    /* Take every free MiB of pages. Running out calls the shrinkers, the held block is given back and serves
+       the failed request. The next time nothing is given back and kmalloc() returns NULL. */
+    static void *ptrs[512];
+    const size_t max_cnt = sizeof (ptrs) / sizeof (ptrs[0]);
+    shrink_hold = kmalloc (1 << 20);
+    if (!shrink_hold) return "Failed: kmalloc(1 MiB)";
+    size_t cnt = 0;
+    while (cnt < max_cnt && (ptrs[cnt] = kmalloc (1 << 20)))
+    {
+        cnt++;
+    }
+    if (cnt == max_cnt) return "Failed: did not run out of pages";
+    if (cnt == 0) return "Failed: no MiB block after the held one";
+
+    const bool freed = shrink_hold == NULL;
+    const uint32_t hold_cnt = hold.call_cnt;
+    const size_t hold_bytes = hold.reclaimed_bytes;
+    const uint32_t order_cnt = shrink_order_cnt;
+    for (size_t i = 0; i < cnt; i++) kfree (ptrs[i]);
+    kmalloc_unregister_shrinker (&empty);
+    kmalloc_unregister_shrinker (&hold);
+
+    if (!freed) return "Failed: held block was not given back";
+    if (hold_cnt < 2 || empty.call_cnt != hold_cnt) return "Failed: expected both shrinkers to run twice";
+    if (hold_bytes != 1 << 20) return "Failed: reclaimed_bytes";
+    if (order_cnt < 4 || shrink_order[0] != 'h' || shrink_order[1] != 'e' || shrink_order[2] != 'h'
+        || shrink_order[3] != 'e')
+        return "Failed: shrinkers ran out of priority order";
+
+    const struct KMStats after = kmalloc_getstats ();
+    if (after.shrink_cnt < stats.shrink_cnt + 2) return "Failed: shrink_cnt";
+    if (after.shrink_bytes < stats.shrink_bytes + (1 << 20)) return "Failed: shrink_bytes";
+    if (after.large_bytes != stats.large_bytes) return "Failed: large block leaked";
+
+    /* Unregistered shrinkers are not called. */
+    kmalloc_shrink ();
+    if (hold.call_cnt != hold_cnt) return "Failed: unregistered shrinker ran";
+
+    printf ("Passed test_shrinker()\n");
+    return NULL;
+}
+
+TEST(test_hardening)
+{
+    printf ("\nRunning test_hardening() [%s]\n", KMALLOC_HARDENING_NAME);
+
+#if KMALLOC_HARDENING_LEVEL >= KMALLOC_HARDENING_LEVEL_PARANOID
+    /* Every block has a redzone after the requested bytes, on every allocation path. */
+    uint8_t * const p1 = kmalloc (200);
+    uint8_t * const p2 = kmalloc (20);
+    uint8_t * const p3 = kcalloc (3, 100);
+    uint8_t * const p4 = kmalloc_aligned (50, 64);
+    if (!p1 || !p2 || !p3 || !p4) return "Failed: allocation";
+    for (size_t i = 0; i < 16; i++)
+    {
+        if (p1[200 + i] != KMALLOC_REDZONE_BYTE || p2[20 + i] != KMALLOC_REDZONE_BYTE
+            || p3[300 + i] != KMALLOC_REDZONE_BYTE || p4[50 + i] != KMALLOC_REDZONE_BYTE)
+            return "Failed: missing redzone";
+    }
+
+    /* The redzone moves with krealloc(), in place or not. */
+    uint8_t * const p5 = krealloc (p1, 100);
+    if (p5 != p1) return "Failed: krealloc() moved a shrinking block";
+    for (size_t i = 0; i < 16; i++)
+        if (p5[100 + i] != KMALLOC_REDZONE_BYTE) return "Failed: missing redzone after krealloc()";
+
+    /* Freed memory is poisoned, wherever it goes. The first bytes may hold free list links. */
+    kfree (p5);
+    kfree (p2);
+    for (size_t i = 32; i < 100; i++)
+        if (p5[i] != KMALLOC_POISON_BYTE) return "Failed: freed block was not poisoned";
+    for (size_t i = 0; i < 20; i++)
+        if (p2[i] != KMALLOC_POISON_BYTE) return "Failed: block freed to a magazine was not poisoned";
+
+    kfree (p3);
+    kfree (p4);
+#endif
+
+    printf ("Passed test_hardening()\n");
+    return NULL;
+}
+
+/* Sum of a latency histogram. */
+static uint32_t histogram_total (const uint32_t * const histogram)
+{
+    uint32_t total = 0;
+    for (int i = 0; i < KMALLOC_CYCLE_BUCKETS; i++)
+    {
+        total += histogram[i];
+    }
+    return total;
+}
+
+TEST(test_telemetry)
+{
+    printf ("\nRunning test_telemetry()\n");
+    const struct KMStats stats = kmalloc_getstats ();
+
+    /* Free every other block so the heap has holes. */
+    void *ps[8];
+    for (size_t i = 0; i < sizeof (ps) / sizeof (ps[0]); i++)
+    {
+        ps[i] = kmalloc (1024);
+        if (!ps[i]) return "Failed: kmalloc()";
+    }
+    for (size_t i = 0; i < sizeof (ps) / sizeof (ps[0]); i += 2)
+    {
+        kfree (ps[i]);
+    }
+    ps[1] = krealloc (ps[1], 512);
+
+    const struct KMStats after = kmalloc_getstats ();
+    if (histogram_total (after.alloc_cycles) - histogram_total (stats.alloc_cycles) != 8)
+        return "Failed: alloc histogram";
+    if (histogram_total (after.free_cycles) - histogram_total (stats.free_cycles) != 4)
+        return "Failed: free histogram";
+    if (histogram_total (after.realloc_cycles) - histogram_total (stats.realloc_cycles) != 1)
+        return "Failed: realloc histogram";
+    if (after.split_cnt <= stats.split_cnt) return "Failed: expected splits";
+
+    if (after.free_block_cnt < 4) return "Failed: expected free blocks";
+    if (after.largest_free_block > after.free_block_bytes) return "Failed: largest free block";
+    if (after.fragmentation == 0 || after.fragmentation >= 1000) return "Failed: fragmentation";
+
+    /* Freeing the rest fills the holes back in. */
+    const uint32_t coalesce_cnt = after.coalesce_cnt;
+    for (size_t i = 1; i < sizeof (ps) / sizeof (ps[0]); i += 2)
+    {
+        kfree (ps[i]);
+    }
+    if (kmalloc_getstats ().coalesce_cnt <= coalesce_cnt) return "Failed: expected coalescing";
+
+    printf ("Passed test_telemetry()\n");
+    return NULL;
+}
+
+TEST(test_latency)
+{
+    printf ("\nRunning test_latency() [%s]\n", KMALLOC_POLICY_NAME);
+    const struct KMStats stats = kmalloc_getstats ();
+
+    /* Time the allocator alone, holding the lock so no other thread is in the heap, without being preempted. */
+    km_lock ();
+    const bool enabled = interrupt_disable ();
+
+    /* Leave large free holes between small allocated pins so the heap has many free blocks, none large
+       enough for the biggest requests. */
+    void *holes[64];
+    void *pins[64];
+    for (size_t i = 0; i < sizeof (holes) / sizeof (holes[0]); i++)
+    {
+        holes[i] = _kmalloc_unsafe (4096 + (i % 8) * 512);
+        pins[i] = _kmalloc_unsafe (16);
+        if (!holes[i] || !pins[i])
+        {
+            interrupt_restore (enabled);
+            km_unlock ();
+            return "Failed: kmalloc() while making holes";
+        }
+    }
+    for (size_t i = 0; i < sizeof (holes) / sizeof (holes[0]); i++)
+    {
+        _kfree_unsafe (holes[i]);
+    }
+
+    /* Keep a window of live blocks and replace a pseudo random one each round, so the heap stays
+       fragmented while being timed. */
+    void *live[128] = {0};
+    uint32_t alloc_max = 0, free_max = 0;
+    uint64_t alloc_total = 0, free_total = 0;
+    uint32_t seed = 12345;
+    const uint32_t rounds = 4096;
+    for (uint32_t i = 0; i < rounds; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        const size_t slot = (seed >> 16) % (sizeof (live) / sizeof (live[0]));
+        const size_t size = (seed & 0x8000) ? (seed >> 4) % 256 : (seed >> 4) % 12288;
+
+        const uint64_t t0 = cpu_rdtsc ();
+        _kfree_unsafe (live[slot]);
+        const uint64_t t1 = cpu_rdtsc ();
+        live[slot] = _kmalloc_unsafe (size);
+        const uint64_t t2 = cpu_rdtsc ();
+
+        if (!live[slot])
+        {
+            interrupt_restore (enabled);
+            km_unlock ();
+            return "Failed: kmalloc() while timing";
+        }
+
+        const uint32_t free_cycles = t1 - t0;
+        const uint32_t alloc_cycles = t2 - t1;
+        alloc_max = (alloc_cycles > alloc_max) ? alloc_cycles : alloc_max;
+        free_max = (free_cycles > free_max) ? free_cycles : free_max;
+        alloc_total += alloc_cycles;
+        free_total += free_cycles;
+    }
+
+    for (size_t i = 0; i < sizeof (live) / sizeof (live[0]); i++)
+    {
+        _kfree_unsafe (live[i]);
+    }
+    for (size_t i = 0; i < sizeof (pins) / sizeof (pins[0]); i++)
+    {
+        _kfree_unsafe (pins[i]);
+    }
+    interrupt_restore (enabled);
+    km_unlock ();
+
+    printf ("> kmalloc() cycles: max %u, avg %u\n", alloc_max, (uint32_t) (alloc_total / rounds));
+    printf ("> kfree() cycles: max %u, avg %u\n", free_max, (uint32_t) (free_total / rounds));
+
+    const struct KMStats stats_now = kmalloc_getstats ();
+    if (stats.allocation_bytes - stats.free_bytes != stats_now.allocation_bytes - stats_now.free_bytes)
+        return "Failed: memory leak";
+
+    printf ("Passed test_latency()\n");
+    return NULL;
+}
+
 TEST(test_extensive)
 {
     /* TODO: */
@@ -167,6 +880,7 @@ TEST(test_free)
     const struct KMStats stats = kmalloc_getstats ();
 
     kfree (NULL);
+    kmalloc_magazines_flush (&current_thread->kmalloc_magazines);
 
     void * const p1 = kmalloc (16);
     void * const p2 = kmalloc (16);
@@ -180,6 +894,9 @@ TEST(test_free)
     kfree (p5);
     kfree (p3);
     kfree (p4);
+
+    /* Blocks in the thread's magazines do not coalesce. */
+    kmalloc_magazines_flush (&current_thread->kmalloc_magazines);
     void * const p6 = kmalloc (48);
     if ((uintptr_t) p6 != (uintptr_t) p2) return "Failed: coalescing";
 
@@ -203,8 +920,21 @@ void kmalloc_test (struct UnitTestsResult * const result)
     run_test (test_calloc, result);
     run_test (test_realloc, result);
     run_test (test_free, result);
+    run_test (test_bins, result);
+    run_test (test_bestfit, result);
+    run_test (test_aligned, result);
+    run_test (test_magazines, result);
+    run_test (test_atomic, result);
+    run_test (test_zeroed, result);
+    run_test (test_trim, result);
+    run_test (test_bulk, result);
+    run_test (test_large, result);
+    run_test (test_shrinker, result);
+    run_test (test_hardening, result);
+    run_test (test_telemetry, result);
 
     kmalloc_disabledebug ();
     run_test (test_short, result);
+    run_test (test_latency, result);
     run_test (test_extensive, result);
 }
@@ -0,0 +1,77 @@
+#include "alienos/tests/unit_tests.h"
+#include "alienos/mem/page.h"
+
+#include <stdbool.h>
+
+TEST(test_page_alloc)
+{
+    printf ("\nRunning test_page_alloc()\n");
+    const struct PageStats stats = page_getstats ();
+
+    uint32_t * const p1 = page_alloc (0);
+    uint32_t * const p2 = page_alloc (3);
+    if (!p1 || !p2) return "Failed: page_alloc()";
+    if ((uintptr_t) p1 % PAGE_SIZE) return "Failed: order 0 block is not aligned";
+    if ((uintptr_t) p2 % (PAGE_SIZE << 3)) return "Failed: order 3 block is not aligned";
+    if (!page_isalloc (p1) || !page_isalloc (p2)) return "Failed: page_isalloc()";
+
+    for (size_t i = 0; i < PAGE_SIZE / sizeof (uint32_t); i++) p1[i] = 0xFEEDF00D;
+    for (size_t i = 0; i < (PAGE_SIZE << 3) / sizeof (uint32_t); i++) p2[i] = i;
+    for (size_t i = 0; i < PAGE_SIZE / sizeof (uint32_t); i++)
+        if (p1[i] != 0xFEEDF00D) return "Failed: overlapping blocks";
+
+    if (page_getstats ().free_pages != stats.free_pages - 1 - 8) return "Failed: free page count";
+
+    page_free (p1);
+    page_free (p2);
+    page_free (NULL);
+    if (page_isalloc (p1)) return "Failed: page_isalloc() after page_free()";
+
+    if (page_alloc (PAGE_MAX_ORDER + 1)) return "Failed: page_alloc() above PAGE_MAX_ORDER";
+
+    if (page_getstats ().free_pages != stats.free_pages) return "Failed: memory leak";
+
+    printf ("Passed test_page_alloc()\n");
+    return NULL;
+}
+
+TEST(test_page_buddy)
+{
+    printf ("\nRunning test_page_buddy()\n");
+    const struct PageStats stats = page_getstats ();
+
+    /* Take single pages until one comes from a split. Splitting hands out the lower half and keeps the
+       upper half, so the next page is it's buddy. */
+    void *pages[64];
+    size_t cnt = 0;
+    bool split = false;
+    while (!split && cnt < sizeof (pages) / sizeof (pages[0]) - 1)
+    {
+        const uint32_t split_cnt = page_getstats ().split_cnt;
+        pages[cnt++] = page_alloc (0);
+        if (!pages[cnt - 1]) return "Failed: page_alloc()";
+        split = page_getstats ().split_cnt != split_cnt;
+    }
+    if (!split) return "Failed: expected a split";
+
+    pages[cnt++] = page_alloc (0);
+    if (((uintptr_t) pages[cnt - 2] ^ (uintptr_t) pages[cnt - 1]) != PAGE_SIZE) return "Failed: expected buddies";
+
+    const uint32_t merge_cnt = page_getstats ().merge_cnt;
+    for (size_t i = 0; i < cnt; i++)
+    {
+        page_free (pages[i]);
+    }
+    if (page_getstats ().merge_cnt == merge_cnt) return "Failed: expected buddies to merge";
+
+    if (page_getstats ().free_pages != stats.free_pages) return "Failed: memory leak";
+
+    printf ("Passed test_page_buddy()\n");
+    return NULL;
+}
+
+void page_test (struct UnitTestsResult * const result)
+{
+    run_test (test_page_alloc, result);
+    run_test (test_page_buddy, result);
+}
\ No newline at end of file
@@ -0,0 +1,134 @@
+#include "alienos/tests/unit_tests.h"
+#include "alienos/mem/slab.h"
+#include "alienos/mem/kmalloc.h"
+
+struct test_object
+{
+    uint32_t data[12];
+};
+
+#define TEST_CTOR_MAGIC 0xC0FFEE00
+
+static void test_object_ctor (void * const obj)
+{
+    struct test_object * const object = (struct test_object *) obj;
+    for (size_t i = 0; i < sizeof (object->data) / sizeof (object->data[0]); i++)
+    {
+        object->data[i] = TEST_CTOR_MAGIC + i;
+    }
+}
+
+TEST(test_cache_alloc)
+{
+    printf ("\nRunning test_cache_alloc()\n");
+    const struct KMStats kmstats = kmalloc_getstats ();
+
+    kmem_cache_t * const cache = kmem_cache_create ("test_object", sizeof (struct test_object), 16, NULL);
+    if (!cache) return "Failed: kmem_cache_create()";
+
+    const uint32_t kNumObjects = 3 * kmem_cache_getstats (cache).objs_per_slab;
+    struct test_object *objs[kNumObjects];
+    for (uint32_t i = 0; i < kNumObjects; i++)
+    {
+        objs[i] = kmem_cache_alloc (cache);
+        if (!objs[i]) return "Failed: kmem_cache_alloc()";
+        if ((uintptr_t) objs[i] & 15) return "Failed: object is not aligned";
+        for (size_t j = 0; j < sizeof (objs[i]->data) / sizeof (objs[i]->data[0]); j++)
+        {
+            objs[i]->data[j] = i * 12 + j;
+        }
+    }
+
+    struct KMemCacheStats stats = kmem_cache_getstats (cache);
+    if (stats.active_objs != kNumObjects) return "Failed: active object count";
+    if (stats.slab_cnt != 3) return "Failed: expected objects to fill exactly 3 slabs";
+
+    for (uint32_t i = 0; i < kNumObjects; i++)
+    {
+        for (size_t j = 0; j < sizeof (objs[i]->data) / sizeof (objs[i]->data[0]); j++)
+        {
+            if (objs[i]->data[j] != i * 12 + j) return "Failed: overlapping objects";
+        }
+        kmem_cache_free (cache, objs[i]);
+    }
+
+    /* Empty slabs are kept until the cache is shrunk. */
+    stats = kmem_cache_getstats (cache);
+    if (stats.active_objs != 0) return "Failed: active object count after free";
+    if (stats.slab_cnt != 3) return "Failed: empty slabs released before shrink";
+    if (kmem_cache_shrink (cache) != 3) return "Failed: kmem_cache_shrink() did not free empty slabs";
+    if (kmem_cache_getstats (cache).slab_cnt != 0) return "Failed: slabs left after shrink";
+
+    kmem_cache_destroy (cache);
+
+    const struct KMStats kmstats_now = kmalloc_getstats ();
+    if (kmstats.allocation_bytes - kmstats.free_bytes != kmstats_now.allocation_bytes - kmstats_now.free_bytes)
+        return "Failed: memory leak";
+
+    printf ("Passed test_cache_alloc()\n");
+    return NULL;
+}
+
+TEST(test_cache_reuse)
+{
+    printf ("\nRunning test_cache_reuse()\n");
+
+    kmem_cache_t * const cache = kmem_cache_create ("test_object", sizeof (struct test_object), 0, NULL);
+    if (!cache) return "Failed: kmem_cache_create()";
+
+    void * const p1 = kmem_cache_alloc (cache);
+    void * const p2 = kmem_cache_alloc (cache);
+    kmem_cache_free (cache, p1);
+    void * const p3 = kmem_cache_alloc (cache);
+    if (p1 != p3) return "Failed: did not reuse freed object";
+
+    kmem_cache_free (cache, p2);
+    kmem_cache_free (cache, p3);
+    kmem_cache_free (cache, NULL);
+
+    const struct KMemCacheStats stats = kmem_cache_getstats (cache);
+    if (stats.allocation_cnt != 3 || stats.free_cnt != 3) return "Failed: stats";
+    if (stats.slab_alloc_cnt != 1) return "Failed: expected a single slab";
+
+    kmem_cache_destroy (cache);
+
+    printf ("Passed test_cache_reuse()\n");
+    return NULL;
+}
+
+TEST(test_cache_ctor)
+{
+    printf ("\nRunning test_cache_ctor()\n");
+
+    kmem_cache_t * const cache = kmem_cache_create ("test_object", sizeof (struct test_object), 0,
+                                                    test_object_ctor);
+    if (!cache) return "Failed: kmem_cache_create()";
+
+    struct test_object * const obj = kmem_cache_alloc (cache);
+    for (size_t i = 0; i < sizeof (obj->data) / sizeof (obj->data[0]); i++)
+    {
+        if (obj->data[i] != TEST_CTOR_MAGIC + i) return "Failed: object not constructed";
+    }
+
+    /* Freed objects keep their constructed state. */
+    kmem_cache_free (cache, obj);
+    struct test_object * const obj2 = kmem_cache_alloc (cache);
+    if (obj != obj2) return "Failed: did not reuse freed object";
+    for (size_t i = 0; i < sizeof (obj2->data) / sizeof (obj2->data[0]); i++)
+    {
+        if (obj2->data[i] != TEST_CTOR_MAGIC + i) return "Failed: free list link overwrote object";
+    }
+
+    kmem_cache_free (cache, obj2);
+    kmem_cache_destroy (cache);
+
+    printf ("Passed test_cache_ctor()\n");
+    return NULL;
+}
+
+void slab_test (struct UnitTestsResult * const result)
+{
+    run_test (test_cache_alloc, result);
+    run_test (test_cache_reuse, result);
+    run_test (test_cache_ctor, result);
+}
\ No newline at end of file
@@ -344,6 +344,182 @@ TEST(test_condvar_broadcast)
     return NULL;
 }
 
+#ifndef THREAD_SCHED_FAIR
+/* The donation test expects a higher priority to always run first, the fair policy only gives it more CPU
+   time. */
+
+/* Locks of the donation test. L holds lock_a, M holds lock_b and waits on lock_a, H waits on lock_b and D waits
+   on lock_a. */
+static mutex_t lock_a;
+static mutex_t lock_b;
+static semaphore_t go;
+static char donation_order[8];
+static uint32_t donation_order_len;
+static uint32_t donation_released_priority;
+static uint32_t donation_released_base;
+
+/* Check a priority of the donation test. The exact 'expected' priority is checked unless the MLFQ policy is
+   used, which may drop a thread a level if a timer tick lands while it runs. Then it is compared to
+   'relative', the priority of the thread it should match, instead. */
+static bool donation_check (const uint32_t priority, const uint32_t expected, const uint32_t relative)
+{
+#ifdef THREAD_SCHED_MLFQ
+    (void) expected;
+    return priority == relative;
+#else
+    (void) relative;
+    return priority == expected;
+#endif
+}
+
+static void test_donation_low (void * const arg)
+{
+    (void) arg;
+    mutex_acquire (&lock_a);
+    semaphore_down (&go);
+    mutex_release (&lock_a);
+    donation_released_priority = current_thread->priority;
+    donation_released_base = current_thread->base_priority;
+    donation_order[donation_order_len++] = 'L';
+    semaphore_up (&done);
+}
+
+static void test_donation_medium (void * const arg)
+{
+    (void) arg;
+    mutex_acquire (&lock_b);
+    mutex_acquire (&lock_a);
+    donation_order[donation_order_len++] = 'M';
+    mutex_release (&lock_a);
+    mutex_release (&lock_b);
+    semaphore_up (&done);
+}
+
+static void test_donation_waiter (void * const arg)
+{
+    mutex_t * const lock = (mutex_t *) arg;
+    mutex_acquire (lock);
+    donation_order[donation_order_len++] = (lock == &lock_b) ? 'H' : 'D';
+    mutex_release (lock);
+    semaphore_up (&done);
+}
+
+TEST(test_mutex_donation)
+{
+    printf ("\nRunning test_mutex_donation()\n");
+    mutex_init (&lock_a);
+    mutex_init (&lock_b);
+    semaphore_init (&go, 0);
+    semaphore_init (&done, 0);
+    donation_order_len = 0;
+
+    /* Every test thread has a higher priority than this one, so each yield runs them until they block. */
+    thread_set_priority (current_thread, THREAD_PRIORITY_MIN);
+
+    thread_t * const low = thread_create_ex (test_donation_low, NULL, 4);
+    thread_yield ();
+    if (!donation_check (low->priority, 4, low->base_priority)) return "Failed: priority changed without waiters";
+
+    /* M blocks on lock_a and donates to L. */
+    thread_t * const medium = thread_create_ex (test_donation_medium, NULL, 8);
+    thread_yield ();
+    if (!donation_check (low->priority, 8, medium->priority)) return "Failed: no donation to the holder";
+
+    /* A second donor on lock_a raises L further. */
+    thread_t * const donor = thread_create_ex (test_donation_waiter, &lock_a, 20);
+    thread_yield ();
+    if (!donation_check (low->priority, 20, donor->priority)) return "Failed: second donor did not raise the holder";
+    if (!donation_check (medium->priority, 8, medium->base_priority))
+        return "Failed: M received a donation meant for L";
+
+    /* H blocks on lock_b held by M, which passes the donation on down the chain to L. */
+    thread_t * const high = thread_create_ex (test_donation_waiter, &lock_b, 28);
+    thread_yield ();
+    if (!donation_check (medium->priority, 28, high->priority)) return "Failed: no donation to the holder of lock_b";
+    if (!donation_check (low->priority, 28, high->priority)) return "Failed: donation not passed down the chain";
+
+    /* Releasing lock_a gives M the lock before D. M keeps H's donation while it holds lock_b, so it finishes
+       before D, and H runs as soon as lock_b is released. */
+    semaphore_up (&go);
+    thread_yield ();
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        semaphore_down (&done);
+    }
+    thread_set_priority (current_thread, THREAD_PRIORITY_DEFAULT);
+
+    donation_order[donation_order_len] = '\0';
+    printf ("> lock order: %s\n", donation_order);
+    if (!donation_check (donation_released_priority, 4, donation_released_base))
+        return "Failed: donation not given back on release";
+    if (donation_order_len != 4 || donation_order[0] != 'M' || donation_order[1] != 'H' || donation_order[2] != 'D'
+        || donation_order[3] != 'L')
+        return "Failed: expected lock order MHDL";
+
+    printf ("Passed test_mutex_donation()\n");
+    return NULL;
+}
+
+/* Priority of the handoff test's waiter right after it took lock_a, and of it's donor. */
+static uint32_t handoff_priority;
+static uint32_t handoff_donor_priority;
+
+static void test_handoff_waiter (void * const arg)
+{
+    (void) arg;
+    mutex_acquire (&lock_a);
+    handoff_priority = current_thread->priority;
+    mutex_release (&lock_a);
+    semaphore_up (&done);
+}
+
+static void test_handoff_donor (void * const arg)
+{
+    (void) arg;
+    handoff_donor_priority = current_thread->priority;
+    mutex_acquire (&lock_a);
+    mutex_release (&lock_a);
+    semaphore_up (&done);
+}
+
+TEST(test_mutex_handoff_donation)
+{
+    printf ("\nRunning test_mutex_handoff_donation()\n");
+    mutex_init (&lock_a);
+    semaphore_init (&done, 0);
+
+    /* W blocks on lock_a held by this thread. */
+    mutex_acquire (&lock_a);
+    thread_t * const waiter = thread_create_ex (test_handoff_waiter, NULL, 4);
+    thread_set_priority (current_thread, THREAD_PRIORITY_MIN);
+    thread_yield ();
+    thread_set_priority (current_thread, THREAD_PRIORITY_DEFAULT);
+
+    /* Releasing wakes W, but it has a lower priority than this thread and does not run yet. H blocks on lock_a
+       while it has no holder, so there is nobody to donate to. */
+    mutex_release (&lock_a);
+    thread_create_ex (test_handoff_donor, NULL, 28);
+    thread_yield ();
+    if (!donation_check (waiter->priority, 4, waiter->base_priority))
+        return "Failed: waiter raised before it holds the lock";
+
+    /* W takes H's priority as soon as it holds the lock. */
+    thread_set_priority (current_thread, THREAD_PRIORITY_MIN);
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        semaphore_down (&done);
+    }
+    thread_set_priority (current_thread, THREAD_PRIORITY_DEFAULT);
+
+    printf ("> waiter priority after the handoff: %u\n", handoff_priority);
+    if (!donation_check (handoff_priority, 28, handoff_donor_priority))
+        return "Failed: donation made during the handoff lost";
+
+    printf ("Passed test_mutex_handoff_donation()\n");
+    return NULL;
+}
+#endif /* THREAD_SCHED_FAIR */
+
 void synch_test (struct UnitTestsResult * const result)
 {
     kmalloc_disabledebug ();
@@ -354,4 +530,8 @@ void synch_test (struct UnitTestsResult * const result)
     run_test (test_semaphore_multiplex, result);
     run_test (test_condvar_producer_consumer, result);
     run_test (test_condvar_broadcast, result);
+#ifndef THREAD_SCHED_FAIR
+    run_test (test_mutex_donation, result);
+    run_test (test_mutex_handoff_donation, result);
+#endif
 }
\ No newline at end of file
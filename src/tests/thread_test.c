@@ -2,6 +2,9 @@
 #include "alienos/kernel/thread.h"
 #include "alienos/kernel/synch.h"
 #include "alienos/mem/kmalloc.h"
+#include "alienos/cpu/cpu.h"
+#include "alienos/io/timer.h"
+#include "alienos/io/interrupt.h"
 
 static semaphore_t start;
 static semaphore_t done;
@@ -44,7 +47,310 @@ TEST(test_multiple_threads)
     return NULL;
 }
 
+static void thread_test_exit (void *arg)
+{
+    (void) arg;
+    semaphore_up (&done);
+}
+
+/* Wait until the threads a test created have exited and been reaped, leaving 'count' threads. Sleeps rather than
+   yields, a yield never runs the exiting threads while they have a lower priority than this one. */
+static void thread_test_wait_count (const uint32_t count)
+{
+    while (thread_count () != count)
+    {
+        thread_sleep (1);
+    }
+}
+
+/* Create short lived threads one after another, returns the average cycles taken by thread_create_arg(). */
+static uint32_t thread_test_create_cycles (const uint32_t cnt)
+{
+    const uint32_t count = thread_count ();
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < cnt; i++)
+    {
+        const uint64_t start = cpu_rdtsc ();
+        thread_create_arg (thread_test_exit, NULL);
+        total += cpu_rdtsc () - start;
+
+        /* Wait for the thread to be cleaned up, so it's stack is released before the next one is created. */
+        semaphore_down (&done);
+        thread_test_wait_count (count);
+    }
+    return total / cnt;
+}
+
+TEST(test_stack_pool)
+{
+    printf ("\nRunning test_stack_pool()\n");
+    semaphore_init (&done, 0);
+    const uint32_t kNumThreads = 16;
+
+    /* Without the pool every stack comes from and goes back to the kernel heap. */
+    const uint32_t pool_size = thread_set_stack_pool_size (0);
+    struct ThreadStackStats stats = thread_stack_getstats ();
+    if (stats.pooled_cnt != 0) return "Failed: stacks left in the pool";
+
+    const uint32_t heap_cycles = thread_test_create_cycles (kNumThreads);
+    const struct ThreadStackStats heap_stats = thread_stack_getstats ();
+    if (heap_stats.pool_hit_cnt != stats.pool_hit_cnt) return "Failed: stack taken from disabled pool";
+
+    /* With the pool every thread after the first reuses the stack of the one before. */
+    thread_set_stack_pool_size (pool_size);
+    const uint32_t pool_cycles = thread_test_create_cycles (kNumThreads);
+    stats = thread_stack_getstats ();
+    if (stats.pool_hit_cnt - heap_stats.pool_hit_cnt < kNumThreads - 1) return "Failed: pooled stacks not reused";
+    if (stats.pooled_cnt == 0) return "Failed: stack of exited thread not pooled";
+
+    printf ("> thread_create_arg() cycles without stack pool: %u\n", heap_cycles);
+    printf ("> thread_create_arg() cycles with stack pool: %u\n", pool_cycles);
+
+    printf ("Passed test_stack_pool()\n");
+    return NULL;
+}
+
+static volatile bool schedule_stop;
+
+static void thread_test_spin (void *arg)
+{
+    (void) arg;
+    while (!schedule_stop)
+    {
+        thread_yield ();
+    }
+    semaphore_up (&done);
+}
+
+TEST(test_schedule_cost)
+{
+    printf ("\nRunning test_schedule_cost()\n");
+    semaphore_init (&done, 0);
+
+    /* Every thread only yields, so each yield of this thread lets all the others run once before it comes
+       back around. */
+    const uint32_t kThreadCounts[] = {1, 8, 64, 128};
+    const uint32_t kRounds = 64;
+    for (size_t i = 0; i < sizeof (kThreadCounts) / sizeof (kThreadCounts[0]); i++)
+    {
+        const uint32_t count = thread_count ();
+        schedule_stop = false;
+        for (uint32_t j = 0; j < kThreadCounts[i]; j++)
+        {
+            if (!thread_create_arg (thread_test_spin, NULL)) return "Failed: thread_create_arg()";
+        }
+        thread_yield ();
+
+        const uint64_t start = cpu_rdtsc ();
+        for (uint32_t j = 0; j < kRounds; j++)
+        {
+            thread_yield ();
+        }
+        const uint64_t cycles = cpu_rdtsc () - start;
+
+        schedule_stop = true;
+        for (uint32_t j = 0; j < kThreadCounts[i]; j++)
+        {
+            semaphore_down (&done);
+        }
+        thread_test_wait_count (count);
+
+        printf ("> %u runnable threads: %u cycles per context switch\n", kThreadCounts[i],
+                (uint32_t) (cycles / (kRounds * (kThreadCounts[i] + 1))));
+    }
+
+    printf ("Passed test_schedule_cost()\n");
+    return NULL;
+}
+
+static volatile bool busy_stop;
+static volatile uint32_t busy_work;
+
+static void thread_test_busy (void *arg)
+{
+    (void) arg;
+    uint32_t work = 0;
+    while (!busy_stop)
+    {
+        work++;
+    }
+
+    const bool interrupts = interrupt_disable ();
+    busy_work += work;
+    interrupt_restore (interrupts);
+    semaphore_up (&done);
+}
+
+struct test_lateness
+{
+    uint32_t max;                   /* Most ticks the sleeper woke up late by. */
+    uint32_t total;                 /* Ticks late over all it's sleeps. */
+};
+
+#define TEST_SLEEPS 16
+
+/* Sleeps for one tick at a time, recording how late it wakes up in the struct test_lateness arg points to. */
+static void thread_test_sleeper (void *arg)
+{
+    struct test_lateness * const lateness = (struct test_lateness *) arg;
+    *lateness = (struct test_lateness) {0};
+    for (uint32_t i = 0; i < TEST_SLEEPS; i++)
+    {
+        thread_sleep (1);
+        const uint32_t late = timer_ticks - current_thread->wakeup_ticks;
+        lateness->max = (late > lateness->max) ? late : lateness->max;
+        lateness->total += late;
+    }
+    semaphore_up (&done);
+}
+
+/* Run a sleeper of 'priority' next to 'busy_cnt' threads spinning at 'busy_priority'. Returns how late the
+   sleeper woke up. */
+static struct test_lateness thread_test_wakeup_lateness (const uint32_t priority, const uint32_t busy_priority,
+                                                         const uint32_t busy_cnt)
+{
+    const uint32_t count = thread_count ();
+    busy_stop = false;
+    for (uint32_t i = 0; i < busy_cnt; i++)
+    {
+        thread_create_ex (thread_test_busy, NULL, busy_priority);
+    }
+
+    struct test_lateness lateness;
+    thread_create_ex (thread_test_sleeper, &lateness, priority);
+    semaphore_down (&done);
+
+    busy_stop = true;
+    for (uint32_t i = 0; i < busy_cnt; i++)
+    {
+        semaphore_down (&done);
+    }
+    thread_test_wait_count (count);
+    return lateness;
+}
+
+#ifndef THREAD_SCHED_FAIR
+/* Expects a higher priority to always run first, the fair policy only gives it more CPU time. */
+TEST(test_priority)
+{
+    printf ("\nRunning test_priority()\n");
+    semaphore_init (&done, 0);
+    const uint32_t kNumBusy = 8;
+
+    /* A high priority sleeper runs as soon as it wakes up, however many threads are busy. */
+    const uint32_t idle_lateness = thread_test_wakeup_lateness (THREAD_PRIORITY_MAX, THREAD_PRIORITY_MIN, 0).max;
+    const uint32_t high_lateness = thread_test_wakeup_lateness (THREAD_PRIORITY_MAX, THREAD_PRIORITY_MIN,
+                                                                kNumBusy).max;
+
+    /* At the busy threads' priority it waits for it's turn behind them. */
+    const uint32_t equal_lateness = thread_test_wakeup_lateness (THREAD_PRIORITY_MIN, THREAD_PRIORITY_MIN,
+                                                                 kNumBusy).max;
+
+    printf ("> wakeup lateness in ticks: %u idle, %u with %u busy threads, %u at their priority\n",
+            idle_lateness, high_lateness, kNumBusy, equal_lateness);
+    if (high_lateness > idle_lateness + 1) return "Failed: high priority wakeup delayed by busy threads";
+
+    /* Lowering the current thread's priority below a ready thread yields to it. */
+    busy_stop = false;
+    const uint32_t count = thread_count ();
+    thread_create_ex (thread_test_busy, NULL, THREAD_PRIORITY_DEFAULT - 1);
+    if (thread_count_ready () == 0) return "Failed: created thread not ready";
+    busy_stop = true;
+    thread_set_priority (current_thread, THREAD_PRIORITY_MIN);
+    const bool yielded = semaphore_try_down (&done);
+    thread_set_priority (current_thread, THREAD_PRIORITY_DEFAULT);
+    if (!yielded) return "Failed: thread_set_priority() did not yield to higher priority thread";
+    thread_test_wait_count (count);
+
+    printf ("Passed test_priority()\n");
+    return NULL;
+}
+#endif /* THREAD_SCHED_FAIR */
+
+TEST(test_sched_mix)
+{
+    printf ("\nRunning test_sched_mix() [%s]\n", THREAD_SCHED_NAME);
+    semaphore_init (&done, 0);
+
+    /* An interactive thread that sleeps a tick at a time and busy threads that never block, all given the
+       same priority. Plain priority scheduling makes the sleeper wait it's turn behind every busy thread,
+       MLFQ drops the busy threads below it and the fair policy places the woken up sleeper ahead of them. */
+    const uint32_t kNumBusy = 8;
+    busy_work = 0;
+    const uint64_t start = cpu_rdtsc ();
+    const struct test_lateness lateness = thread_test_wakeup_lateness (THREAD_PRIORITY_DEFAULT,
+                                                                       THREAD_PRIORITY_DEFAULT, kNumBusy);
+    const uint32_t mcycles = (uint32_t) ((cpu_rdtsc () - start) >> 20);
+
+    printf ("> interactive wakeup lateness in ticks: max %u, total %u over %u sleeps\n", lateness.max,
+            lateness.total, TEST_SLEEPS);
+    printf ("> busy throughput: %u iterations per 2^20 cycles\n", busy_work / (mcycles ? mcycles : 1));
+
+    printf ("Passed test_sched_mix()\n");
+    return NULL;
+}
+
+static volatile uint32_t share_work[2];
+
+/* Spins until busy_stop is set, counting iterations in the counter arg points to. */
+static void thread_test_share (void *arg)
+{
+    volatile uint32_t * const work = (volatile uint32_t *) arg;
+    while (!busy_stop)
+    {
+        (*work)++;
+    }
+    semaphore_up (&done);
+}
+
+TEST(test_fair_share)
+{
+    printf ("\nRunning test_fair_share() [%s]\n", THREAD_SCHED_NAME);
+    semaphore_init (&done, 0);
+
+    /* Two busy threads three priorities apart while this thread sleeps. The fair policy gives the higher one
+       about 1.25^3 (1.95) times the CPU time of the lower one, the priority policies give it all of it. */
+    const uint32_t kPriorities[] = {THREAD_PRIORITY_DEFAULT, THREAD_PRIORITY_DEFAULT - 3};
+    const uint32_t count = thread_count ();
+    busy_stop = false;
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        share_work[i] = 0;
+        if (!thread_create_ex (thread_test_share, (void *) &share_work[i], kPriorities[i]))
+            return "Failed: thread_create_ex()";
+    }
+    thread_sleep (200);
+
+    busy_stop = true;
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        semaphore_down (&done);
+    }
+    thread_test_wait_count (count);
+
+    printf ("> iterations: %u at priority %u, %u at priority %u\n", share_work[0], kPriorities[0], share_work[1],
+            kPriorities[1]);
+
+#ifdef THREAD_SCHED_FAIR
+    /* Loose bounds, the ticks are only a sample of which thread ran. */
+    if (share_work[1] < 100) return "Failed: lower priority thread starved";
+    const uint32_t ratio = share_work[0] / (share_work[1] / 100);
+    printf ("> share ratio: %u.%02u\n", ratio / 100, ratio % 100);
+    if (ratio < 150 || ratio > 250) return "Failed: CPU time not shared in proportion to the weights";
+#endif
+
+    printf ("Passed test_fair_share()\n");
+    return NULL;
+}
+
 void thread_test (struct UnitTestsResult * const result)
 {
     run_test (test_multiple_threads, result);
+    run_test (test_stack_pool, result);
+    run_test (test_schedule_cost, result);
+#ifndef THREAD_SCHED_FAIR
+    run_test (test_priority, result);
+#endif
+    run_test (test_sched_mix, result);
+    run_test (test_fair_share, result);
 }
\ No newline at end of file
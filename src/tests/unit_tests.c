@@ -6,6 +6,9 @@ void unit_tests (void)
 
     struct UnitTestsResult results = {0};
     kmalloc_test (&results);
+    slab_test (&results);
+    arena_test (&results);
+    page_test (&results);
     io_test (&results);
     thread_test (&results);
     synch_test (&results);